@@ -1,4 +1,5 @@
 #include <db.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -6,6 +7,54 @@
 
 static bool debug = false;
 
+enum {
+	METHOD_BTREE,
+	METHOD_HASH,
+	METHOD_RECNO,
+	NR_METHOD,
+};
+
+static const char *const method_names[NR_METHOD] = {
+	[METHOD_BTREE] = "btree",
+	[METHOD_HASH] = "hash",
+	[METHOD_RECNO] = "recno",
+};
+
+static const DBTYPE method_types[NR_METHOD] = {
+	[METHOD_BTREE] = DB_BTREE,
+	[METHOD_HASH] = DB_HASH,
+	[METHOD_RECNO] = DB_RECNO,
+};
+
+enum {
+	DUP_NONE,
+	DUP_DUP,
+	DUP_DUPSORT,
+	NR_DUP,
+};
+
+static const char *const dup_names[NR_DUP] = {
+	[DUP_NONE] = "none",
+	[DUP_DUP] = "dup",
+	[DUP_DUPSORT] = "dupsort",
+};
+
+static const u_int32_t dup_flags[NR_DUP] = {
+	[DUP_NONE] = 0,
+	[DUP_DUP] = DB_DUP,
+	[DUP_DUPSORT] = DB_DUPSORT,
+};
+
+#define DEFAULT_CACHE_SIZE (8ULL << 30)
+#define DEFAULT_CACHE_REGIONS 2
+
+/* -bdb-* options */
+static unsigned long long cache_size = DEFAULT_CACHE_SIZE;
+static int cache_regions = DEFAULT_CACHE_REGIONS;
+static int pagesize;
+static int method = METHOD_BTREE;
+static int dup_mode = DUP_DUP;
+
 /* Disable memory pool trickle thread by default */
 #undef USE_MEMP_TRICKLE_THREAD
 
@@ -77,7 +126,10 @@ static DB_ENV *init_env(const char *home)
 		die("db_env_create: %s", db_strerror(ret));
 
 	env->set_flags(env, DB_TXN_NOSYNC, 1);
-	env->set_cachesize(env, 8, 0, 2);
+	ret = env->set_cachesize(env, cache_size >> 30,
+				cache_size & ((1 << 30) - 1), cache_regions);
+	if (ret)
+		die("env->set_cachesize: %s", db_strerror(ret));
 	env->set_errfile(env, stderr);
 
 	ret = env->open(env, home,
@@ -123,11 +175,19 @@ static void *open_db(struct benchmark_config *config)
 	}
 	db->set_errfile(db, stderr);
 
-	ret = db->set_flags(db, DB_DUP);
-	if (ret)
-		die("dbp->set_flags: %s", db_strerror(ret));
+	if (dup_flags[dup_mode]) {
+		ret = db->set_flags(db, dup_flags[dup_mode]);
+		if (ret)
+			die("dbp->set_flags: %s", db_strerror(ret));
+	}
+	if (pagesize) {
+		ret = db->set_pagesize(db, pagesize);
+		if (ret)
+			die("dbp->set_pagesize: %s", db_strerror(ret));
+	}
 
-	ret = db->open(db, NULL, "data.db", NULL, DB_BTREE, DB_CREATE, 0664);
+	ret = db->open(db, NULL, "data.db", NULL, method_types[method],
+			DB_CREATE, 0664);
 	if (ret) {
 		db->err(db, ret, "open");
 		exit(1);
@@ -172,6 +232,21 @@ static void close_db(void *db)
 
 #define KSIZ KEYGEN_KEY_SIZE
 
+/* Bulk buffers are multiples of 1024 bytes */
+#define BULK_ALIGN(size) (((size) + 1023) / 1024 * 1024)
+
+/*
+ * DB_MULTIPLE buffer for up to "limit" items of "size" bytes, every item
+ * also takes two offsets, plus the terminator
+ */
+static void bulk_write_dbt_init(DBT *dbt, int limit, u_int32_t size)
+{
+	memset(dbt, 0, sizeof(*dbt));
+	dbt->ulen = BULK_ALIGN((limit + 1) * (size + 2 * sizeof(u_int32_t)));
+	dbt->flags = DB_DBT_USERMEM | DB_DBT_BULK;
+	dbt->data = xmalloc(dbt->ulen);
+}
+
 static void db_put(DB *db, DBT *key, DBT *data, u_int32_t flags)
 {
 	int ret;
@@ -198,23 +273,18 @@ static void putlist_test(void *db, const char *command, int num, int vsiz,
 	char *value = xmalloc(vsiz);
 	DBT key, data;
 	void *ptrk, *ptrd;
-	int i;
+	int limit = batch_limit(batch);
+	unsigned long long start;
+	int i, n = 0;
 
 	keygen_init(&keygen, seed);
 
-	memset(&key, 0, sizeof(key));
-	memset(&data, 0, sizeof(data));
-
-	key.ulen = batch * KSIZ * 1024;
-	key.flags = DB_DBT_USERMEM | DB_DBT_BULK;
-	key.data = xmalloc(key.ulen);
-
-	data.ulen = batch * vsiz * 1024;
-	data.flags = DB_DBT_USERMEM | DB_DBT_BULK;
-	data.data = xmalloc(data.ulen);
+	bulk_write_dbt_init(&key, limit, KSIZ);
+	bulk_write_dbt_init(&data, limit, vsiz);
 
 	DB_MULTIPLE_WRITE_INIT(ptrk, &key);
 	DB_MULTIPLE_WRITE_INIT(ptrd, &data);
+	start = batch_start();
 
 	for (i = 0; i < num; i++) {
 		DB_MULTIPLE_WRITE_NEXT(ptrk, &key,
@@ -223,33 +293,21 @@ static void putlist_test(void *db, const char *command, int num, int vsiz,
 		if (ptrk == NULL || ptrd == NULL)
 			die("DB_MULTIPLE_WRITE_NEXT failed");
 
-		if ((i + 1) % batch == 0) {
+		if (++n >= batch) {
 			db_put(bdb, &key, &data, DB_MULTIPLE);
+			batch = batch_end(batch, n, start);
+			n = 0;
 
-			free(key.data);
-			free(data.data);
-
-			memset(&key, 0, sizeof(key));
-			memset(&data, 0, sizeof(data));
-
-			key.ulen = batch * KSIZ * 1024;
-			key.flags = DB_DBT_USERMEM | DB_DBT_BULK;
-			key.data = xmalloc(key.ulen);
-
-			data.ulen = batch * vsiz * 1024;
-			data.flags = DB_DBT_USERMEM | DB_DBT_BULK;
-			data.data = xmalloc(data.ulen);
-			
 			DB_MULTIPLE_WRITE_INIT(ptrk, &key);
 			DB_MULTIPLE_WRITE_INIT(ptrd, &data);
+			start = batch_start();
 		}
 	}
 
-	if (num % batch) {
+	if (n)
 		db_put(bdb, &key, &data, DB_MULTIPLE);
-		free(key.data);
-		free(data.data);
-	}
+	free(key.data);
+	free(data.data);
 
 	free(value);
 }
@@ -279,17 +337,16 @@ static void outlist_test(void *db, const char *command, int num, int batch,
 	struct keygen keygen;
 	DBT key;
 	void *ptrk;
-	int i;
+	int limit = batch_limit(batch);
+	unsigned long long start;
+	int i, n = 0;
 
 	keygen_init(&keygen, seed);
 
-	memset(&key, 0, sizeof(key));
-
-	key.ulen = batch * KSIZ * 1024;
-	key.flags = DB_DBT_USERMEM | DB_DBT_BULK;
-	key.data = xmalloc(key.ulen);
+	bulk_write_dbt_init(&key, limit, KSIZ);
 
 	DB_MULTIPLE_WRITE_INIT(ptrk, &key);
+	start = batch_start();
 
 	for (i = 0; i < num; i++) {
 		DB_MULTIPLE_WRITE_NEXT(ptrk, &key,
@@ -297,24 +354,18 @@ static void outlist_test(void *db, const char *command, int num, int batch,
 		if (ptrk == NULL)
 			die("DB_MULTIPLE_WRITE_NEXT failed");
 
-		if ((i + 1) % batch == 0) {
+		if (++n >= batch) {
 			db_del(bdb, &key, DB_MULTIPLE);
-
-			free(key.data);
-
-			memset(&key, 0, sizeof(key));
-
-			key.ulen = batch * KSIZ * 1024;
-			key.flags = DB_DBT_USERMEM | DB_DBT_BULK;
-			key.data = xmalloc(key.ulen);
+			batch = batch_end(batch, n, start);
+			n = 0;
 
 			DB_MULTIPLE_WRITE_INIT(ptrk, &key);
+			start = batch_start();
 		}
 	}
-	if (num % batch) {
+	if (n)
 		db_del(bdb, &key, DB_MULTIPLE);
-		free(key.data);
-	}
+	free(key.data);
 }
 
 static void put_test(void *db, int num, int vsiz, unsigned int seed)
@@ -394,21 +445,457 @@ static void get_test(void *db, int num, int vsiz, unsigned int seed)
 	free(value);
 }
 
-static void fwmkeys_test(void *db, int num, unsigned int seed)
+/*
+ * Bulk reads return as many records as fit in a DB_DBT_USERMEM buffer,
+ * which must be at least one page.  The buffer grows when a single
+ * record does not fit.
+ */
+static void bulk_dbt_init(DBT *dbt, DB *db, size_t size)
+{
+	u_int32_t pagesize;
+
+	if (db->get_pagesize(db, &pagesize))
+		pagesize = 0;
+	if (size < pagesize)
+		size = pagesize;
+
+	memset(dbt, 0, sizeof(*dbt));
+	dbt->ulen = BULK_ALIGN(size);
+	dbt->flags = DB_DBT_USERMEM;
+	dbt->data = xmalloc(dbt->ulen);
+}
+
+static void bulk_dbt_grow(DBT *dbt)
+{
+	dbt->ulen = BULK_ALIGN(dbt->size);
+	free(dbt->data);
+	dbt->data = xmalloc(dbt->ulen);
+}
+
+/* Returns 0 or DB_NOTFOUND */
+static int db_get(DB *db, DBT *key, DBT *data, u_int32_t flags)
+{
+	int ret;
+retry:
+	ret = db->get(db, NULL, key, data, flags);
+
+	switch (ret) {
+		case 0:
+		case DB_NOTFOUND:
+			break;
+		case DB_LOCK_DEADLOCK:
+			goto retry;
+		case DB_BUFFER_SMALL:
+			bulk_dbt_grow(data);
+			goto retry;
+		default:
+			db->err(db, ret, "DB->get");
+			exit(EXIT_FAILURE);
+			break;
+	}
+
+	return ret;
+}
+
+/* Returns 0 or DB_NOTFOUND */
+static int cursor_get(DB *db, DBC *cursor, DBT *key, DBT *data,
+			u_int32_t flags)
+{
+	int ret;
+retry:
+	ret = cursor->get(cursor, key, data, flags);
+
+	switch (ret) {
+		case 0:
+		case DB_NOTFOUND:
+			break;
+		case DB_LOCK_DEADLOCK:
+			goto retry;
+		case DB_BUFFER_SMALL:
+			if (data->size <= data->ulen)
+				die("key buffer too small");
+			bulk_dbt_grow(data);
+			goto retry;
+		default:
+			db->err(db, ret, "DBcursor->get");
+			exit(EXIT_FAILURE);
+			break;
+	}
+
+	return ret;
+}
+
+static int key_cmp(const void *k1, u_int32_t k1len, const void *k2,
+			u_int32_t k2len)
+{
+	int ret = memcmp(k1, k2, k1len < k2len ? k1len : k2len);
+
+	return ret ? ret : (int)k1len - (int)k2len;
+}
+
+/*
+ * Walks the records of a cursor from a start key on, one DB_MULTIPLE_KEY
+ * page of the caller's buffer at a time
+ */
+struct bulk_cursor {
+	DB *db;
+	DBC *cursor;
+	DBT key;
+	DBT *data;
+	char keybuf[KSIZ];
+	u_int32_t flags;
+	void *p;
+};
+
+static void bulk_cursor_open(struct bulk_cursor *bc, DB *db, DBT *data)
+{
+	int ret;
+
+	ret = db->cursor(db, NULL, &bc->cursor, 0);
+	if (ret) {
+		db->err(db, ret, "DB->cursor");
+		exit(EXIT_FAILURE);
+	}
+	bc->db = db;
+	bc->data = data;
+
+	memset(&bc->key, 0, sizeof(bc->key));
+	bc->key.data = bc->keybuf;
+	bc->key.ulen = KSIZ;
+	bc->key.flags = DB_DBT_USERMEM;
+
+	bc->flags = DB_FIRST | DB_MULTIPLE_KEY;
+	bc->p = NULL;
+}
+
+/* The next page starts at the first key >= start */
+static void bulk_cursor_seek(struct bulk_cursor *bc, const void *start,
+			u_int32_t len)
+{
+	memcpy(bc->keybuf, start, len);
+	bc->key.size = len;
+	bc->flags = DB_SET_RANGE | DB_MULTIPLE_KEY;
+	bc->p = NULL;
+}
+
+/* The returned record is valid until the next call */
+static bool bulk_cursor_next(struct bulk_cursor *bc, void **key,
+			u_int32_t *klen, void **value, u_int32_t *vlen)
+{
+	while (1) {
+		if (bc->p) {
+			DB_MULTIPLE_KEY_NEXT(bc->p, bc->data, *key, *klen,
+					*value, *vlen);
+			if (bc->p)
+				return true;
+		}
+		if (cursor_get(bc->db, bc->cursor, &bc->key, bc->data,
+				bc->flags) == DB_NOTFOUND)
+			return false;
+		bc->flags = DB_NEXT | DB_MULTIPLE_KEY;
+		DB_MULTIPLE_INIT(bc->p, bc->data);
+	}
+}
+
+static void bulk_cursor_close(struct bulk_cursor *bc)
+{
+	bc->cursor->close(bc->cursor);
+}
+
+/*
+ * Every key of the batch gets all of its duplicates with one DB->get
+ * DB_MULTIPLE.  Returns the number of keys found.
+ */
+static int getlist_multiple(DB *db, char *keys, int n, DBT *data, int vsiz)
+{
+	DBT key;
+	int i, found = 0;
+
+	memset(&key, 0, sizeof(key));
+
+	for (i = 0; i < n; i++) {
+		void *p, *retdata;
+		u_int32_t retdlen;
+
+		key.data = keys + i * KSIZ;
+		key.size = KSIZ;
+
+		if (db_get(db, &key, data, DB_MULTIPLE) == DB_NOTFOUND)
+			continue;
+
+		DB_MULTIPLE_INIT(p, data);
+		while (1) {
+			DB_MULTIPLE_NEXT(p, data, retdata, retdlen);
+			if (p == NULL)
+				break;
+			if (debug && (!retdata || retdlen != vsiz))
+				die("Unexpected value size %d", retdlen);
+		}
+		found++;
+	}
+
+	return found;
+}
+
+/* Records skipped in a row before the cursor seeks to the next key */
+#define BULK_SKIP_MAX 64
+
+/*
+ * Ascending keys are mostly neighbours in the btree, so the batch is
+ * read with DB_MULTIPLE_KEY cursor pages from the first key on and
+ * matched against the records in them.  Returns the number of keys
+ * found.
+ */
+static int getlist_cursor(DB *db, char *keys, int n, DBT *data, int vsiz)
 {
-	die("fwmkeys_test is not implemented");
+	struct bulk_cursor bc;
+	void *retkey, *retdata;
+	u_int32_t retklen, retdlen;
+	int j = 0, skipped = 0, found = 0;
+
+	bulk_cursor_open(&bc, db, data);
+	bulk_cursor_seek(&bc, keys, KSIZ);
+
+	while (j < n && bulk_cursor_next(&bc, &retkey, &retklen, &retdata,
+					&retdlen)) {
+		int cmp = key_cmp(retkey, retklen, keys + j * KSIZ, KSIZ);
+
+		/* Skip the wanted keys that are not stored */
+		while (cmp > 0 && ++j < n)
+			cmp = key_cmp(retkey, retklen, keys + j * KSIZ, KSIZ);
+		if (j == n)
+			break;
+
+		if (!cmp) {
+			if (debug && (!retdata || retdlen != vsiz))
+				die("Unexpected value size %d", retdlen);
+			found++;
+			j++;
+			skipped = 0;
+		} else if (++skipped > BULK_SKIP_MAX) {
+			bulk_cursor_seek(&bc, keys + j * KSIZ, KSIZ);
+			skipped = 0;
+		}
+	}
+
+	bulk_cursor_close(&bc);
+
+	return found;
+}
+
+static int getlist_batch(DB *db, char *keys, int n, bool ascending, DBT *data,
+			int vsiz)
+{
+	/* Hash databases are not in key order */
+	if (ascending && method == METHOD_BTREE)
+		return getlist_cursor(db, keys, n, data, vsiz);
+
+	return getlist_multiple(db, keys, n, data, vsiz);
 }
 
 static void getlist_test(void *db, const char *command, int num, int vsiz,
 			int batch, unsigned int seed)
 {
-	die("getlist_test is not implemented");
+	DB *bdb = ((struct BDB *)db)->db;
+	struct keygen keygen;
+	int limit = batch_limit(batch);
+	char *keys = xmalloc(limit * KSIZ);
+	bool ascending = true;
+	DBT data;
+	unsigned long long start;
+	int i, n = 0, found = 0;
+
+	keygen_init(&keygen, seed);
+	/*
+	 * A DB_MULTIPLE_KEY page fills the whole buffer, so it is sized for
+	 * one batch: records past it would be copied again by the next one
+	 */
+	bulk_dbt_init(&data, bdb,
+		limit * (KSIZ + vsiz + 4 * sizeof(u_int32_t)));
+	start = batch_start();
+
+	for (i = 0; i < num; i++) {
+		char *key = keys + n * KSIZ;
+
+		memcpy(key, keygen_next_key(&keygen), KSIZ);
+		if (n && memcmp(key - KSIZ, key, KSIZ) >= 0)
+			ascending = false;
+
+		if (++n >= batch) {
+			found += getlist_batch(bdb, keys, n, ascending, &data,
+						vsiz);
+			batch = batch_end(batch, n, start);
+			n = 0;
+			ascending = true;
+			start = batch_start();
+		}
+	}
+	if (n)
+		found += getlist_batch(bdb, keys, n, ascending, &data, vsiz);
+
+	if (debug && found != num)
+		die("Unexpected record num %d", found);
+
+	free(data.data);
+	free(keys);
+}
+
+/* Buffer of the prefix scans, enough for a few thousand small records */
+#define BULK_BUFFER_SIZE (1024 * 1024)
+
+/* Prefix scans jump to the prefix with DB_SET_RANGE */
+static void need_btree(const char *command)
+{
+	if (method != METHOD_BTREE)
+		die("%s needs -bdb-method btree", command);
 }
 
+static bool match_prefix(const void *key, u_int32_t klen, const char *prefix)
+{
+	return klen >= KEYGEN_PREFIX_SIZE &&
+		!memcmp(key, prefix, KEYGEN_PREFIX_SIZE);
+}
+
+static void fwmkeys_test(void *db, int num, unsigned int seed)
+{
+	DB *bdb = ((struct BDB *)db)->db;
+	struct keygen keygen;
+	char prefix[KEYGEN_PREFIX_SIZE + 1];
+	struct bulk_cursor bc;
+	void *retkey, *retdata;
+	u_int32_t retklen, retdlen;
+	DBT data;
+	int nkeys = 0;
+
+	need_btree("fwmkeys");
+	keygen_init(&keygen, seed);
+	keygen_prefix(&keygen, prefix);
+
+	bulk_dbt_init(&data, bdb, BULK_BUFFER_SIZE);
+	bulk_cursor_open(&bc, bdb, &data);
+	bulk_cursor_seek(&bc, prefix, KEYGEN_PREFIX_SIZE);
+
+	while (bulk_cursor_next(&bc, &retkey, &retklen, &retdata, &retdlen)) {
+		if (!match_prefix(retkey, retklen, prefix))
+			break;
+		if (debug && (retklen != KSIZ ||
+			      memcmp(retkey, keygen_next_key(&keygen), KSIZ)))
+			die("Unexpected key");
+		nkeys++;
+	}
+	if (debug && nkeys != num)
+		die("Unexpected key num: %d", nkeys);
+
+	bulk_cursor_close(&bc);
+	free(data.data);
+}
+
+/*
+ * Every batch collects the keys of up to "batch" records with the prefix
+ * from a bulk read and removes them with one DB->del DB_MULTIPLE.  The
+ * cursor is closed before the delete, so that it holds no page locks.
+ */
 static void rangeout_test(void *db, const char *command, int num, int vsiz,
 			int batch, unsigned int seed)
 {
-	die("rangeout_test is not implemented");
+	DB *bdb = ((struct BDB *)db)->db;
+	struct keygen keygen;
+	char prefix[KEYGEN_PREFIX_SIZE + 1];
+	int limit = batch_limit(batch);
+	DBT data, keys;
+	int nrecs = 0;
+
+	need_btree(command);
+	keygen_init(&keygen, seed);
+	keygen_prefix(&keygen, prefix);
+
+	bulk_dbt_init(&data, bdb, BULK_BUFFER_SIZE);
+	bulk_write_dbt_init(&keys, limit, KSIZ);
+
+	while (1) {
+		unsigned long long start = batch_start();
+		struct bulk_cursor bc;
+		void *ptrk, *retkey, *retdata;
+		u_int32_t retklen, retdlen;
+		char last[KSIZ];
+		int n = 0;
+
+		DB_MULTIPLE_WRITE_INIT(ptrk, &keys);
+		bulk_cursor_open(&bc, bdb, &data);
+		bulk_cursor_seek(&bc, prefix, KEYGEN_PREFIX_SIZE);
+
+		while (bulk_cursor_next(&bc, &retkey, &retklen, &retdata,
+					&retdlen)) {
+			if (!match_prefix(retkey, retklen, prefix))
+				break;
+			if (retklen != KSIZ)
+				die("Unexpected key size %d", retklen);
+
+			/* DB->del removes all duplicates of a key */
+			if (n && !memcmp(retkey, last, KSIZ)) {
+				n++;
+				continue;
+			}
+			if (n >= batch)
+				break;
+
+			DB_MULTIPLE_WRITE_NEXT(ptrk, &keys, retkey, retklen);
+			if (ptrk == NULL)
+				die("DB_MULTIPLE_WRITE_NEXT failed");
+			memcpy(last, retkey, KSIZ);
+			n++;
+		}
+		bulk_cursor_close(&bc);
+
+		if (!n)
+			break;
+		db_del(bdb, &keys, DB_MULTIPLE);
+		nrecs += n;
+		batch = batch_end(batch, n, start);
+	}
+
+	if (debug && num != nrecs)
+		die("Unexpected number of records are deleted");
+
+	free(keys.data);
+	free(data.data);
+}
+
+static void range_bulk_test(void *db, const char *command, int num, int vsiz,
+			int batch, unsigned int seed)
+{
+	DB *bdb = ((struct BDB *)db)->db;
+	struct keygen keygen;
+	char prefix[KEYGEN_PREFIX_SIZE + 1];
+	struct bulk_cursor bc;
+	void *retkey, *retdata;
+	u_int32_t retklen, retdlen;
+	DBT data;
+	int i;
+
+	need_btree(command);
+	keygen_init(&keygen, seed);
+	keygen_prefix(&keygen, prefix);
+
+	bulk_dbt_init(&data, bdb, BULK_BUFFER_SIZE);
+	bulk_cursor_open(&bc, bdb, &data);
+	bulk_cursor_seek(&bc, prefix, KEYGEN_PREFIX_SIZE);
+
+	for (i = 0; i < num; i++) {
+		if (!bulk_cursor_next(&bc, &retkey, &retklen, &retdata,
+					&retdlen))
+			break;
+		if (debug && (retklen != KSIZ ||
+			      memcmp(retkey, keygen_next_key(&keygen), KSIZ)))
+			die("Unexpected key");
+		if (debug && (!retdata || retdlen != vsiz))
+			die("Unexpected value size %d", retdlen);
+	}
+	if (debug && i != num)
+		die("Unexpected record num");
+
+	bulk_cursor_close(&bc);
+	free(data.data);
 }
 
 static void range_test(void *db, const char *command, int num, int vsiz,
@@ -424,6 +911,7 @@ static void range_test(void *db, const char *command, int num, int vsiz,
 	int ret;
 	char prefix[KEYGEN_PREFIX_SIZE + 1];
 
+	need_btree(command);
 	keygen_init(&keygen, seed);
 
 	memset(&key, 0, sizeof(key));
@@ -472,7 +960,129 @@ static void range_test(void *db, const char *command, int num, int vsiz,
 	free(value);
 }
 
-struct benchmark_config config = {
+enum {
+	RANGE_CURSOR,
+	RANGE_BULK,
+	NR_RANGE,
+};
+
+static const char *const range_names[NR_RANGE] = {
+	[RANGE_CURSOR] = "cursor",
+	[RANGE_BULK] = "bulk",
+};
+
+/* -bdb-range, how range reads the records */
+static int range_strategy = RANGE_CURSOR;
+
+static int parse_strategy(const char *option, const char *arg,
+			const char *const *names, int nr_names)
+{
+	int i;
+
+	for (i = 0; i < nr_names; i++) {
+		if (!strcmp(arg, names[i]))
+			return i;
+	}
+	die("Invalid %s: %s", option, arg);
+
+	return -1;
+}
+
+/* Bytes with an optional k, m or g suffix */
+static unsigned long long parse_size(const char *option, const char *arg)
+{
+	char *end;
+	unsigned long long size = strtoull(arg, &end, 0);
+
+	switch (*end) {
+		case 'g':
+		case 'G':
+			size <<= 10;
+			/* fall through */
+		case 'm':
+		case 'M':
+			size <<= 10;
+			/* fall through */
+		case 'k':
+		case 'K':
+			size <<= 10;
+			end++;
+			break;
+	}
+	if (*end || !size)
+		die("Invalid %s: %s", option, arg);
+
+	return size;
+}
+
+/*
+ * Cache statistics of the phase, DB_STAT_CLEAR starts the next phase
+ * from zero
+ */
+static void report(struct benchmark_config *config)
+{
+	DB_ENV *dbenv;
+	DB_MPOOL_STAT *stat;
+	unsigned long long hit, miss;
+	int ret;
+
+	if (!bdb)
+		return;
+	dbenv = bdb->dbenv;
+
+	ret = dbenv->memp_stat(dbenv, &stat, NULL, DB_STAT_CLEAR);
+	if (ret) {
+		dbenv->err(dbenv, ret, "memp_stat");
+		return;
+	}
+	hit = stat->st_cache_hit;
+	miss = stat->st_cache_miss;
+
+	printf("# bdb-cache %llu hits, %llu misses, %.2f%% hit ratio, "
+		"%llu pages read, %llu pages written\n", hit, miss,
+		hit + miss ? 100.0 * hit / (hit + miss) : 0.0,
+		(unsigned long long)stat->st_page_in,
+		(unsigned long long)stat->st_page_out);
+
+	free(stat);
+}
+
+static int parse_option(struct benchmark_config *config, int argc,
+			char **argv, int i)
+{
+	if (!strcmp(argv[i], "-bdb-range")) {
+		range_strategy = parse_strategy(argv[i], argv[i + 1],
+						range_names, NR_RANGE);
+		return 2;
+	} else if (!strcmp(argv[i], "-bdb-cache")) {
+		cache_size = parse_size(argv[i], argv[i + 1]);
+		return 2;
+	} else if (!strcmp(argv[i], "-bdb-cache-regions")) {
+		cache_regions = atoi(argv[i + 1]);
+		if (cache_regions < 1)
+			die("Invalid number of cache regions: %s", argv[i + 1]);
+		return 2;
+	} else if (!strcmp(argv[i], "-bdb-pagesize")) {
+		pagesize = parse_size(argv[i], argv[i + 1]);
+		return 2;
+	} else if (!strcmp(argv[i], "-bdb-method")) {
+		method = parse_strategy(argv[i], argv[i + 1], method_names,
+					NR_METHOD);
+		/* Record numbers can't hold the keygen keys */
+		if (method == METHOD_RECNO)
+			die("recno databases are keyed by record numbers, "
+			    "use btree or hash");
+		return 2;
+	} else if (!strcmp(argv[i], "-bdb-dup")) {
+		dup_mode = parse_strategy(argv[i], argv[i + 1], dup_names,
+					NR_DUP);
+		return 2;
+	}
+
+	return 0;
+}
+
+static struct benchmark_config config = {
 	.producer = "nop",
 	.consumer = "nop",
 	.path = "data",
@@ -494,16 +1104,48 @@ struct benchmark_config config = {
 		.range_test = range_test,
 		.rangeout_test = rangeout_test,
 		.outlist_test = outlist_test,
+		.parse_option = parse_option,
+		.report = report,
 	},
 };
 
-int main(int argc, char **argv)
+static void setup(struct benchmark_config *config)
 {
-	parse_options(&config, argc, argv);
+	debug = config->debug;
+
+	if (range_strategy == RANGE_BULK)
+		config->ops.range_test = range_bulk_test;
+}
+
+#ifdef BENCHMARK_PLUGIN
+
+static void init_config(struct benchmark_config *plugin_config)
+{
+	/* The same plugin may be loaded for several -backend runs */
+	range_strategy = RANGE_CURSOR;
+	cache_size = DEFAULT_CACHE_SIZE;
+	cache_regions = DEFAULT_CACHE_REGIONS;
+	pagesize = 0;
+	method = METHOD_BTREE;
+	dup_mode = DUP_DUP;
+	*plugin_config = config;
+}
+
+struct benchmark_plugin benchmark_plugin = {
+	.name = "berkeleydb",
+	.init = init_config,
+	.setup = setup,
+};
 
-	debug = config.debug;
+#else
 
+int main(int argc, char **argv)
+{
+	parse_options(&config, argc, argv);
+	setup(&config);
 	benchmark(&config);
 
 	return 0;
 }
+
+#endif
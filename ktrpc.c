@@ -0,0 +1,519 @@
+#include <tcutil.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include "testutil.h"
+#include "ktrpc.h"
+
+/* Send buffers are written out once they grow past this */
+#define KT_SEND_FLUSH (64 * 1024)
+#define KT_RECV_SIZE (64 * 1024)
+#define KT_LINE_MAX 8192
+
+/* A queued call whose reply has not been read yet */
+struct kt_pending {
+	kt_rpc_done_t done;
+	void *arg;
+};
+
+/* Growable byte buffer */
+struct kt_buf {
+	char *ptr;
+	int size;
+	int cap;
+};
+
+struct kt_rpc {
+	int fd;
+	char *host;
+	int port;
+
+	struct kt_buf sbuf;
+	struct kt_buf body;
+
+	char *rbuf;
+	int rpos;
+	int rlen;
+	int rcap;
+
+	int pipeline;
+	struct kt_pending *pending;
+	int head;
+	int nr_pending;
+
+	unsigned long long errors;
+};
+
+static void buf_reserve(struct kt_buf *buf, int size)
+{
+	if (buf->size + size <= buf->cap)
+		return;
+
+	if (!buf->cap)
+		buf->cap = KT_SEND_FLUSH;
+	while (buf->size + size > buf->cap)
+		buf->cap *= 2;
+	buf->ptr = realloc(buf->ptr, buf->cap);
+	if (!buf->ptr)
+		die("realloc: out of memory");
+}
+
+static void buf_cat(struct kt_buf *buf, const void *ptr, int size)
+{
+	buf_reserve(buf, size);
+	memcpy(buf->ptr + buf->size, ptr, size);
+	buf->size += size;
+}
+
+static void buf_cat2(struct kt_buf *buf, const char *str)
+{
+	buf_cat(buf, str, strlen(str));
+}
+
+struct kt_rpc *kt_rpc_open(const char *host, int port, int pipeline)
+{
+	struct kt_rpc *rpc = xmalloc(sizeof(*rpc));
+	struct addrinfo hints, *res, *ai;
+	char service[16];
+	int one = 1;
+	int err;
+
+	memset(rpc, 0, sizeof(*rpc));
+	rpc->host = strdup(host);
+	rpc->port = port;
+	rpc->pipeline = pipeline < 1 ? 1 : pipeline;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	sprintf(service, "%d", port);
+
+	err = getaddrinfo(host, service, &hints, &res);
+	if (err)
+		die("getaddrinfo: %s:%d: %s", host, port, gai_strerror(err));
+
+	rpc->fd = -1;
+	for (ai = res; ai; ai = ai->ai_next) {
+		rpc->fd = socket(ai->ai_family, ai->ai_socktype,
+				ai->ai_protocol);
+		if (rpc->fd < 0)
+			continue;
+		if (!connect(rpc->fd, ai->ai_addr, ai->ai_addrlen))
+			break;
+		close(rpc->fd);
+		rpc->fd = -1;
+	}
+	freeaddrinfo(res);
+	if (rpc->fd < 0)
+		die("connect error: %s:%d: %s", host, port, strerror(errno));
+
+	/* Requests are combined in the send buffer already */
+	setsockopt(rpc->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	rpc->rcap = KT_RECV_SIZE;
+	rpc->rbuf = xmalloc(rpc->rcap);
+	rpc->pending = xmalloc(sizeof(*rpc->pending) * rpc->pipeline);
+
+	return rpc;
+}
+
+/*
+ * Append what the socket has to the receive buffer, which grows when it
+ * is full of unread replies
+ */
+static void recv_fill(struct kt_rpc *rpc)
+{
+	ssize_t n;
+
+	if (rpc->rpos == rpc->rlen) {
+		rpc->rpos = 0;
+		rpc->rlen = 0;
+	} else if (rpc->rlen == rpc->rcap && rpc->rpos) {
+		memmove(rpc->rbuf, rpc->rbuf + rpc->rpos,
+			rpc->rlen - rpc->rpos);
+		rpc->rlen -= rpc->rpos;
+		rpc->rpos = 0;
+	} else if (rpc->rlen == rpc->rcap) {
+		rpc->rcap *= 2;
+		rpc->rbuf = realloc(rpc->rbuf, rpc->rcap);
+		if (!rpc->rbuf)
+			die("realloc: out of memory");
+	}
+
+	do {
+		n = read(rpc->fd, rpc->rbuf + rpc->rlen, rpc->rcap - rpc->rlen);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0)
+		die("recv error: %s:%d: %s", rpc->host, rpc->port,
+			strerror(errno));
+	if (!n)
+		die("connection closed: %s:%d", rpc->host, rpc->port);
+
+	rpc->rlen += n;
+}
+
+/*
+ * ktserver stops reading requests while its replies are not read, so
+ * while calls are pending the replies that arrive are buffered as the
+ * send buffer goes out, without blocking on either side.
+ */
+static void send_flush(struct kt_rpc *rpc)
+{
+	int off = 0;
+
+	while (off < rpc->sbuf.size) {
+		struct pollfd pfd = { rpc->fd, POLLOUT, 0 };
+		ssize_t n;
+
+		if (rpc->nr_pending)
+			pfd.events |= POLLIN;
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			die("poll error: %s:%d: %s", rpc->host, rpc->port,
+				strerror(errno));
+		}
+		if (pfd.revents & (POLLIN | POLLHUP | POLLERR))
+			recv_fill(rpc);
+		if (!(pfd.revents & POLLOUT))
+			continue;
+
+		n = send(rpc->fd, rpc->sbuf.ptr + off, rpc->sbuf.size - off,
+			MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0 && (errno == EINTR || errno == EAGAIN ||
+			      errno == EWOULDBLOCK))
+			continue;
+		if (n <= 0)
+			die("send error: %s:%d: %s", rpc->host, rpc->port,
+				strerror(errno));
+		off += n;
+	}
+	rpc->sbuf.size = 0;
+}
+
+static void recv_bytes(struct kt_rpc *rpc, void *buf, int size)
+{
+	while (size > 0) {
+		int n;
+
+		if (rpc->rpos == rpc->rlen)
+			recv_fill(rpc);
+
+		n = rpc->rlen - rpc->rpos;
+		if (n > size)
+			n = size;
+		memcpy(buf, rpc->rbuf + rpc->rpos, n);
+		buf = (char *)buf + n;
+		rpc->rpos += n;
+		size -= n;
+	}
+}
+
+/* Read one header line without its CRLF */
+static void recv_line(struct kt_rpc *rpc, char *line)
+{
+	int len = 0;
+
+	while (1) {
+		char c;
+
+		if (rpc->rpos == rpc->rlen)
+			recv_fill(rpc);
+		c = rpc->rbuf[rpc->rpos++];
+		if (c == '\n')
+			break;
+		if (len == KT_LINE_MAX - 1)
+			die("too long header line: %s:%d", rpc->host, rpc->port);
+		line[len++] = c;
+	}
+	if (len && line[len - 1] == '\r')
+		len--;
+	line[len] = '\0';
+}
+
+/* Values with tabs, newlines or binary data are sent Base64 encoded */
+static bool need_colenc(const TCLIST *in)
+{
+	int i, j;
+
+	for (i = 0; i < tclistnum(in); i++) {
+		int siz;
+		const unsigned char *ptr = tclistval(in, i, &siz);
+
+		for (j = 0; j < siz; j++) {
+			if (ptr[j] < ' ' || ptr[j] >= 0x7f)
+				return true;
+		}
+	}
+
+	return false;
+}
+
+static void body_cat_column(struct kt_buf *body, const void *ptr, int size,
+			bool colenc)
+{
+	char *enc;
+
+	if (!colenc) {
+		buf_cat(body, ptr, size);
+		return;
+	}
+	enc = tcbaseencode(ptr, size);
+	buf_cat2(body, enc);
+	tcfree(enc);
+}
+
+static void recv_reply(struct kt_rpc *rpc, struct kt_pending *p);
+
+/* Read the reply of the oldest pending call */
+static void recv_head(struct kt_rpc *rpc)
+{
+	send_flush(rpc);
+	recv_reply(rpc, &rpc->pending[rpc->head]);
+	rpc->head = (rpc->head + 1) % rpc->pipeline;
+	rpc->nr_pending--;
+}
+
+void kt_rpc_call(struct kt_rpc *rpc, const char *procedure,
+		const TCLIST *in, kt_rpc_done_t done, void *arg)
+{
+	bool colenc = need_colenc(in);
+	struct kt_pending *p;
+	char header[512];
+	int i;
+
+	/* Keep "pipeline" calls in flight, the oldest one makes room */
+	if (rpc->nr_pending == rpc->pipeline)
+		recv_head(rpc);
+
+	rpc->body.size = 0;
+	for (i = 0; i + 1 < tclistnum(in); i += 2) {
+		int nsiz, vsiz;
+		const char *name = tclistval(in, i, &nsiz);
+		const char *value = tclistval(in, i + 1, &vsiz);
+
+		body_cat_column(&rpc->body, name, nsiz, colenc);
+		buf_cat(&rpc->body, "\t", 1);
+		body_cat_column(&rpc->body, value, vsiz, colenc);
+		buf_cat(&rpc->body, "\n", 1);
+	}
+
+	snprintf(header, sizeof(header),
+		"POST /rpc/%s HTTP/1.1\r\n"
+		"Host: %s:%d\r\n"
+		"Content-Type: text/tab-separated-values%s\r\n"
+		"Content-Length: %d\r\n"
+		"\r\n",
+		procedure, rpc->host, rpc->port,
+		colenc ? "; colenc=B" : "", rpc->body.size);
+	buf_cat2(&rpc->sbuf, header);
+	buf_cat(&rpc->sbuf, rpc->body.ptr, rpc->body.size);
+
+	p = &rpc->pending[(rpc->head + rpc->nr_pending) % rpc->pipeline];
+	p->done = done;
+	p->arg = arg;
+	rpc->nr_pending++;
+
+	if (rpc->sbuf.size >= KT_SEND_FLUSH)
+		send_flush(rpc);
+}
+
+static void push_column(TCLIST *out, const char *ptr, int size, int colenc)
+{
+	char *str, *dec = NULL;
+	int dsiz;
+
+	if (!colenc) {
+		tclistpush(out, ptr, size);
+		return;
+	}
+
+	str = xmalloc(size + 1);
+	memcpy(str, ptr, size);
+	str[size] = '\0';
+
+	switch (colenc) {
+	case 'B':
+		dec = tcbasedecode(str, &dsiz);
+		break;
+	case 'Q':
+		dec = tcquotedecode(str, &dsiz);
+		break;
+	case 'U':
+		dec = tcurldecode(str, &dsiz);
+		break;
+	default:
+		die("unknown column encoding: %c", colenc);
+	}
+	tclistpush(out, dec, dsiz);
+	tcfree(dec);
+	free(str);
+}
+
+/* Split the body into alternating names and values */
+static TCLIST *parse_body(const char *body, int size, int colenc)
+{
+	TCLIST *out = tclistnew();
+	const char *end = body + size;
+
+	while (body < end) {
+		const char *eol = memchr(body, '\n', end - body);
+		const char *tab;
+
+		if (!eol)
+			eol = end;
+		tab = memchr(body, '\t', eol - body);
+		if (tab) {
+			push_column(out, body, tab - body, colenc);
+			push_column(out, tab + 1, eol - tab - 1, colenc);
+		}
+		body = eol + 1;
+	}
+
+	return out;
+}
+
+static void recv_reply(struct kt_rpc *rpc, struct kt_pending *p)
+{
+	char line[KT_LINE_MAX];
+	int status = 0;
+	int length = -1;
+	int colenc = 0;
+	TCLIST *out;
+
+	recv_line(rpc, line);
+	if (sscanf(line, "HTTP/%*d.%*d %d", &status) != 1)
+		die("bad status line: %s:%d: %s", rpc->host, rpc->port, line);
+
+	while (1) {
+		recv_line(rpc, line);
+		if (!line[0])
+			break;
+		if (!strncasecmp(line, "Content-Length:", 15)) {
+			length = atoi(line + 15);
+		} else if (!strncasecmp(line, "Content-Type:", 13)) {
+			const char *enc = strstr(line, "colenc=");
+
+			if (enc)
+				colenc = enc[7];
+		}
+	}
+	if (length < 0)
+		die("reply without Content-Length: %s:%d", rpc->host,
+			rpc->port);
+
+	rpc->body.size = 0;
+	buf_reserve(&rpc->body, length);
+	recv_bytes(rpc, rpc->body.ptr, length);
+	rpc->body.size = length;
+
+	if (!p->done) {
+		if (status != 200)
+			rpc->errors++;
+		return;
+	}
+
+	out = parse_body(rpc->body.ptr, rpc->body.size, colenc);
+	p->done(p->arg, status, out);
+	tclistdel(out);
+}
+
+void kt_rpc_sync(struct kt_rpc *rpc)
+{
+	send_flush(rpc);
+
+	while (rpc->nr_pending)
+		recv_head(rpc);
+}
+
+unsigned long long kt_rpc_errors(struct kt_rpc *rpc)
+{
+	return rpc->errors;
+}
+
+void kt_rpc_close(struct kt_rpc *rpc)
+{
+	kt_rpc_sync(rpc);
+	close(rpc->fd);
+	free(rpc->pending);
+	free(rpc->rbuf);
+	free(rpc->body.ptr);
+	free(rpc->sbuf.ptr);
+	free(rpc->host);
+	free(rpc);
+}
+
+/*
+ * TCP_INFO byte counters of every socket seen by the previous call,
+ * indexed by fd.  The inode tells a reused fd from the same socket.
+ */
+struct socket_seen {
+	ino_t ino;
+	unsigned long long sent;
+	unsigned long long received;
+};
+
+static struct socket_seen *seen;
+static int nr_seen;
+
+void socket_bytes(unsigned long long *sent, unsigned long long *received)
+{
+	DIR *dir = opendir("/proc/self/fd");
+	struct dirent *d;
+
+	*sent = 0;
+	*received = 0;
+	if (!dir)
+		return;
+
+	while ((d = readdir(dir)) != NULL) {
+		int fd = atoi(d->d_name);
+		struct tcp_info info;
+		socklen_t len = sizeof(info);
+		struct socket_seen *s;
+		struct stat st;
+
+		if (d->d_name[0] == '.' || fd == dirfd(dir))
+			continue;
+		if (fstat(fd, &st) < 0 || !S_ISSOCK(st.st_mode))
+			continue;
+		memset(&info, 0, sizeof(info));
+		if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+			continue;
+
+		if (fd >= nr_seen) {
+			int n = fd + 64;
+
+			seen = realloc(seen, sizeof(*seen) * n);
+			if (!seen)
+				die("realloc: out of memory");
+			memset(seen + nr_seen, 0,
+				sizeof(*seen) * (n - nr_seen));
+			nr_seen = n;
+		}
+		s = &seen[fd];
+		if (s->ino != st.st_ino) {
+			s->ino = st.st_ino;
+			s->sent = 0;
+			s->received = 0;
+		}
+		/* Older kernels return a shorter tcp_info without these */
+		*sent += info.tcpi_bytes_acked - s->sent;
+		*received += info.tcpi_bytes_received - s->received;
+		s->sent = info.tcpi_bytes_acked;
+		s->received = info.tcpi_bytes_received;
+	}
+	closedir(dir);
+}
@@ -0,0 +1,33 @@
+/*
+ * Minimal Kyoto Tycoon HTTP RPC client
+ *
+ * Every call is a POST of /rpc/<procedure> with its input as
+ * tab-separated name/value lines, over one keep-alive connection.
+ * Requests are appended to a send buffer which goes out when it is
+ * large, when a reply is needed, or at kt_rpc_sync().  Up to "pipeline"
+ * calls are in flight: a call made while all of them are waits for the
+ * oldest reply only.  Replies arriving while the buffer goes out are
+ * buffered, so that neither side blocks on a full socket.
+ *
+ * Replies are read back in request order.  done() is called with the
+ * HTTP status and the decoded output as a list of alternating names
+ * and values; without done() a status other than 200 is counted in
+ * kt_rpc_errors().
+ */
+
+struct kt_rpc;
+
+typedef void (*kt_rpc_done_t)(void *arg, int status, const TCLIST *out);
+
+struct kt_rpc *kt_rpc_open(const char *host, int port, int pipeline);
+void kt_rpc_close(struct kt_rpc *rpc);
+void kt_rpc_call(struct kt_rpc *rpc, const char *procedure,
+		const TCLIST *in, kt_rpc_done_t done, void *arg);
+void kt_rpc_sync(struct kt_rpc *rpc);
+unsigned long long kt_rpc_errors(struct kt_rpc *rpc);
+
+/*
+ * Payload bytes sent and received over every TCP socket of the process
+ * since the previous call, whatever client library owns them
+ */
+void socket_bytes(unsigned long long *sent, unsigned long long *received);
@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+#include "testutil.h"
+
+/*
+ * Single benchmark driver for backend plugins
+ *
+ *	kvbench [-report file] [options] -backend plugin.so [options] ...
+ *
+ * Options before the first -backend apply to every backend, options
+ * after a -backend apply to that backend only.  Backends run one after
+ * another in command line order, each with the same command or
+ * scenario, and a combined report of all their results is printed at
+ * the end (and written to -report when given).
+ */
+
+struct backend {
+	const char *path;
+	void *handle;
+	struct benchmark_plugin *plugin;
+	char **args;
+	int nr_args;
+	struct benchmark_config config;
+};
+
+static const char *report_path;
+
+/* Option lists start with argv[0], as parse_options() expects */
+static void push_arg(char ***args, int *nr_args, char *arg)
+{
+	*args = realloc(*args, sizeof(**args) * (*nr_args + 1));
+	if (!*args)
+		die("realloc: out of memory");
+	(*args)[(*nr_args)++] = arg;
+}
+
+static int parse_backends(int argc, char **argv, struct backend **backends,
+			char ***common, int *nr_common)
+{
+	int nr_backends = 0;
+	int i;
+
+	*backends = NULL;
+	*common = NULL;
+	*nr_common = 0;
+	push_arg(common, nr_common, argv[0]);
+
+	for (i = 1; i < argc; i++) {
+		struct backend *backend;
+
+		if (!strcmp(argv[i], "-report")) {
+			if (++i >= argc)
+				die("-report needs a file name");
+			report_path = argv[i];
+		} else if (!strcmp(argv[i], "-backend")) {
+			if (++i >= argc)
+				die("-backend needs a plugin");
+
+			*backends = realloc(*backends,
+					sizeof(**backends) * (nr_backends + 1));
+			if (!*backends)
+				die("realloc: out of memory");
+
+			backend = &(*backends)[nr_backends++];
+			memset(backend, 0, sizeof(*backend));
+			backend->path = argv[i];
+		} else if (nr_backends) {
+			backend = &(*backends)[nr_backends - 1];
+			push_arg(&backend->args, &backend->nr_args, argv[i]);
+		} else {
+			push_arg(common, nr_common, argv[i]);
+		}
+	}
+	if (!nr_backends)
+		die("no -backend given");
+
+	return nr_backends;
+}
+
+static void load_backend(struct backend *backend)
+{
+	backend->handle = dlopen(backend->path, RTLD_NOW | RTLD_LOCAL);
+	if (!backend->handle)
+		die("dlopen: %s", dlerror());
+
+	backend->plugin = dlsym(backend->handle, BENCHMARK_PLUGIN_SYMBOL);
+	if (!backend->plugin)
+		die("%s: no %s symbol", backend->path,
+			BENCHMARK_PLUGIN_SYMBOL);
+}
+
+static void run_backend(struct backend *backend, char **common, int nr_common)
+{
+	struct benchmark_plugin *plugin = backend->plugin;
+	struct benchmark_config *config = &backend->config;
+	char **args = NULL;
+	int nr_args = 0;
+	int i;
+
+	/* The common options come first, the backend's own ones override */
+	for (i = 0; i < nr_common; i++)
+		push_arg(&args, &nr_args, common[i]);
+	for (i = 0; i < backend->nr_args; i++)
+		push_arg(&args, &nr_args, backend->args[i]);
+
+	memset(config, 0, sizeof(*config));
+	plugin->init(config);
+	parse_options(config, nr_args, args);
+	plugin->setup(config);
+
+	printf("# backend %s (%s)\n", plugin->name, backend->path);
+	fflush(stdout);
+	benchmark(config);
+
+	free(args);
+}
+
+static void write_report(FILE *out, struct backend *backends, int nr_backends)
+{
+	int i, j;
+
+	fprintf(out, "# backend run works elapsed(s) records/s "
+		"avg0 max0 avg1 max1\n");
+
+	for (i = 0; i < nr_backends; i++) {
+		struct benchmark_config *config = &backends[i].config;
+
+		for (j = 0; j < config->nr_results; j++) {
+			struct benchmark_result *r = &config->results[j];
+
+			fprintf(out, "%s %s %d %lld.%03lld %.1f "
+				"%lld.%03lld %lld.%03lld %lld.%03lld %lld.%03lld\n",
+				backends[i].plugin->name, r->name, r->works,
+				r->elapsed / 1000000, r->elapsed / 1000 % 1000,
+				r->elapsed ? (double)r->records * 1000000 /
+						r->elapsed : 0.0,
+				r->avg[0] / 1000000, r->avg[0] / 1000 % 1000,
+				r->max[0] / 1000000, r->max[0] / 1000 % 1000,
+				r->avg[1] / 1000000, r->avg[1] / 1000 % 1000,
+				r->max[1] / 1000000, r->max[1] / 1000 % 1000);
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct backend *backends;
+	char **common;
+	int nr_backends, nr_common;
+	int i;
+
+	nr_backends = parse_backends(argc, argv, &backends, &common,
+					&nr_common);
+
+	for (i = 0; i < nr_backends; i++)
+		load_backend(&backends[i]);
+	for (i = 0; i < nr_backends; i++)
+		run_backend(&backends[i], common, nr_common);
+
+	write_report(stdout, backends, nr_backends);
+	if (report_path) {
+		FILE *out = fopen(report_path, "w");
+
+		if (!out)
+			die("unable to open report: %s", report_path);
+		write_report(out, backends, nr_backends);
+		fclose(out);
+	}
+
+	return 0;
+}
@@ -1,38 +1,487 @@
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <new>
 #include <ktremotedb.h>
 
 extern "C" {
+#include <tcutil.h>
 #include "testutil.h"
+#include "shard.h"
+#include "ktrpc.h"
 }
 
 using namespace std;
 using namespace kyototycoon;
 
+/* Endpoints of -hosts (or -host/-port), shared by all handles */
+static struct shard_ring *ring;
+
+/*
+ * Bulk protocols (-kt-protocol)
+ *
+ * http:     RemoteDB set_bulk/get_bulk/remove_bulk, HTTP RPCs
+ * binary:   RemoteDB set_bulk_binary/..., the binary protocol
+ * pipeline: the same HTTP RPCs as http through ktrpc.c, with up to
+ *           -kt-pipeline calls in flight on each keep-alive connection
+ *
+ * -kt-pipeline alone selects the pipeline protocol, and is rejected with
+ * any other -kt-protocol.
+ */
+enum { PROTOCOL_HTTP, PROTOCOL_BINARY, PROTOCOL_PIPELINE, NR_PROTOCOL };
+
+static const char *const protocol_names[NR_PROTOCOL] = {
+	"http", "binary", "pipeline",
+};
+static int protocol = PROTOCOL_BINARY;
+static int pipeline = 8;
+static bool protocol_given;
+static bool pipeline_given;
+
+/* Records of every test since the last report, for bytes per op */
+static unsigned long long nr_ops;
+
+static void account_ops(int num)
+{
+	__sync_fetch_and_add(&nr_ops, num);
+}
+
+/* operator new calls of the process since the last report */
+static unsigned long long nr_allocs;
+
+#if __cplusplus >= 201103L
+#define THROW_BAD_ALLOC
+#define THROW_NOTHING noexcept
+#else
+#define THROW_BAD_ALLOC throw(std::bad_alloc)
+#define THROW_NOTHING throw()
+#endif
+
+void *operator new(size_t size) THROW_BAD_ALLOC
+{
+	void *ptr = malloc(size ? size : 1);
+
+	if (!ptr)
+		throw std::bad_alloc();
+	__sync_fetch_and_add(&nr_allocs, 1);
+
+	return ptr;
+}
+
+void operator delete(void *ptr) THROW_NOTHING
+{
+	free(ptr);
+}
+
+#ifdef __cpp_sized_deallocation
+void operator delete(void *ptr, size_t size) THROW_NOTHING
+{
+	free(ptr);
+}
+#endif
+
+/*
+ * A benchmark handle holds one connection per shard, and one more for
+ * the pipelined HTTP RPCs.  Batches are split by shard and the parts
+ * are sent in parallel through the fan-out.
+ */
+struct kt_handle {
+	int nr_shards;
+	RemoteDB **dbs;
+	struct kt_rpc **rpcs;
+	struct shard_fanout *fanout;
+	struct kt_batch *batch;
+	struct shard_counter *counter;
+	/*
+	 * Records per shard with -kt-dbs, written by its fan-out thread
+	 * only.  Several shards share an endpoint, so they are folded into
+	 * the endpoint counter when collected.
+	 */
+	unsigned long long *nrecs;
+	struct kt_handle *next;
+};
+
+/*
+ * Databases of every server (-kt-dbs)
+ *
+ * Every database of every endpoint is one shard of the handles: shard
+ * s is database s % nr_dbs of ring endpoint s / nr_dbs.  The ring picks
+ * the endpoint of a key and a second, independent hash its database.
+ */
+static int nr_dbs = 1;
+
+/*
+ * Records per database index of the closed handles, the open ones are
+ * summed in at every report
+ */
+static unsigned long long *db_nrecs;
+static struct kt_handle *handles;
+static pthread_mutex_t handles_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int shard_endpoint(int shard)
+{
+	return shard / nr_dbs;
+}
+
+/* FNV-1a, finalized so that it does not follow the jump ring's FNV-1a */
+static int key_dbidx(const char *key, int ksiz)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	int i;
+
+	for (i = 0; i < ksiz; i++) {
+		hash ^= (unsigned char)key[i];
+		hash *= 1099511628211ULL;
+	}
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+
+	return hash % nr_dbs;
+}
+
+static int key_shard(struct kt_handle *h, const char *key)
+{
+	int ksiz = strlen(key);
+	int endpoint = shard_ring_lookup(ring, key, ksiz);
+	int shard = endpoint * nr_dbs;
+	int dbidx;
+
+	if (nr_dbs == 1) {
+		shard_counter_add(h->counter, endpoint, 1);
+		return shard;
+	}
+
+	dbidx = key_dbidx(key, ksiz);
+	h->nrecs[shard + dbidx]++;
+
+	return shard + dbidx;
+}
+
+static void shard_account(struct kt_handle *h, int shard,
+			unsigned long long nrecs)
+{
+	if (nr_dbs == 1)
+		shard_counter_add(h->counter, shard, nrecs);
+	else
+		h->nrecs[shard] += nrecs;
+}
+
+/* Called with handles_lock held, while the handle is idle */
+static void db_collect(struct kt_handle *h)
+{
+	int i;
+
+	for (i = 0; i < h->nr_shards; i++) {
+		db_nrecs[i % nr_dbs] += h->nrecs[i];
+		shard_counter_add(h->counter, shard_endpoint(i), h->nrecs[i]);
+		h->nrecs[i] = 0;
+	}
+}
+
+static void db_collect_all(void)
+{
+	struct kt_handle *h;
+
+	pthread_mutex_lock(&handles_lock);
+	for (h = handles; h; h = h->next)
+		db_collect(h);
+	pthread_mutex_unlock(&handles_lock);
+}
+
+static void db_register(struct kt_handle *h)
+{
+	h->nrecs = NULL;
+	if (nr_dbs < 2)
+		return;
+
+	h->nrecs = new unsigned long long[h->nr_shards]();
+	pthread_mutex_lock(&handles_lock);
+	h->next = handles;
+	handles = h;
+	pthread_mutex_unlock(&handles_lock);
+}
+
+static void db_unregister(struct kt_handle *h)
+{
+	struct kt_handle **p;
+
+	if (!h->nrecs)
+		return;
+
+	pthread_mutex_lock(&handles_lock);
+	for (p = &handles; *p != h; p = &(*p)->next)
+		;
+	*p = h->next;
+	db_collect(h);
+	pthread_mutex_unlock(&handles_lock);
+
+	delete[] h->nrecs;
+}
+
+/*
+ * Records per database index summed over the endpoints, and the skew,
+ * once db_collect_all() has collected them
+ */
+static void db_report(void)
+{
+	unsigned long long total = 0, max = 0;
+	int i;
+
+	if (nr_dbs < 2)
+		return;
+
+	for (i = 0; i < nr_dbs; i++) {
+		total += db_nrecs[i];
+		if (db_nrecs[i] > max)
+			max = db_nrecs[i];
+	}
+
+	printf("# kt-db index records share(%%)\n");
+	for (i = 0; i < nr_dbs; i++) {
+		printf("# kt-db %d %llu %.1f\n", i, db_nrecs[i],
+			total ? 100.0 * db_nrecs[i] / total : 0.0);
+		db_nrecs[i] = 0;
+	}
+	printf("# kt-db skew %.2f (max/mean over %d databases)\n",
+		total ? (double)max * nr_dbs / total : 0.0, nr_dbs);
+}
+
+/*
+ * Spare strings for the records of batches.  Cleared records swap their
+ * key or value out into a pool and new records swap one back in, so the
+ * string buffers keep their capacity instead of being freed.
+ */
+struct string_pool {
+	vector<string> strs;
+};
+
+static void pool_get(struct string_pool *pool, string *str)
+{
+	if (pool->strs.empty())
+		return;
+	str->swap(pool->strs.back());
+	pool->strs.pop_back();
+}
+
+static void pool_put(struct string_pool *pool, string *str)
+{
+	pool->strs.push_back(string());
+	pool->strs.back().swap(*str);
+}
+
+/*
+ * One batch split by shard.  The binary protocol tests fill bulkrecs,
+ * the HTTP ones keys and/or recs.  Every handle reuses its batch for
+ * all of its tests, so the vectors and strings are allocated once.
+ * The string pools are per shard too: the fan-out threads of rangeout
+ * and range each fill the part of their own shard.
+ */
+struct kt_batch {
+	struct kt_handle *h;
+	vector<RemoteDB::BulkRecord> *bulkrecs;
+	vector<string> *keys;
+	map<string, string> *recs;
+	struct string_pool *key_pools;
+	struct string_pool *value_pools;
+	size_t nrecs;
+};
+
+static void kt_batch_init(struct kt_batch *b, struct kt_handle *h, int batch)
+{
+	int i;
+
+	b->h = h;
+	b->bulkrecs = new vector<RemoteDB::BulkRecord>[h->nr_shards];
+	b->keys = new vector<string>[h->nr_shards];
+	b->recs = new map<string, string>[h->nr_shards];
+	b->key_pools = new string_pool[h->nr_shards];
+	b->value_pools = new string_pool[h->nr_shards];
+	for (i = 0; i < h->nr_shards; i++) {
+		b->bulkrecs[i].reserve(batch);
+		b->keys[i].reserve(batch);
+		b->key_pools[i].strs.reserve(batch);
+		b->value_pools[i].strs.reserve(batch);
+	}
+	b->nrecs = 0;
+}
+
+/* Returns the strings of the shard's bulk records to its pools */
+static void kt_batch_clear_bulkrecs(struct kt_batch *b, int shard)
+{
+	vector<RemoteDB::BulkRecord> *bulkrecs = &b->bulkrecs[shard];
+	size_t i;
+
+	for (i = 0; i < bulkrecs->size(); i++) {
+		pool_put(&b->key_pools[shard], &(*bulkrecs)[i].key);
+		pool_put(&b->value_pools[shard], &(*bulkrecs)[i].value);
+	}
+	bulkrecs->clear();
+}
+
+static void kt_batch_clear_keys(struct kt_batch *b, int shard)
+{
+	vector<string> *keys = &b->keys[shard];
+	size_t i;
+
+	for (i = 0; i < keys->size(); i++)
+		pool_put(&b->key_pools[shard], &(*keys)[i]);
+	keys->clear();
+}
+
+static void kt_batch_clear(struct kt_batch *b)
+{
+	int i;
+
+	for (i = 0; i < b->h->nr_shards; i++) {
+		kt_batch_clear_bulkrecs(b, i);
+		kt_batch_clear_keys(b, i);
+		b->recs[i].clear();
+	}
+	b->nrecs = 0;
+}
+
+static void kt_batch_destroy(struct kt_batch *b)
+{
+	delete[] b->bulkrecs;
+	delete[] b->keys;
+	delete[] b->recs;
+	delete[] b->key_pools;
+	delete[] b->value_pools;
+}
+
+/* Appends an empty record with pooled strings to the shard's part */
+static RemoteDB::BulkRecord *shard_bulkrec(struct kt_batch *b, int shard)
+{
+	vector<RemoteDB::BulkRecord> *bulkrecs = &b->bulkrecs[shard];
+	RemoteDB::BulkRecord *rec;
+
+	bulkrecs->resize(bulkrecs->size() + 1);
+	rec = &bulkrecs->back();
+	/* The binary protocol ignores set_target() */
+	rec->dbidx = shard % nr_dbs;
+	pool_get(&b->key_pools[shard], &rec->key);
+	pool_get(&b->value_pools[shard], &rec->value);
+	rec->xt = 0;
+
+	return rec;
+}
+
+static string *shard_key(struct kt_batch *b, int shard)
+{
+	vector<string> *keys = &b->keys[shard];
+
+	keys->resize(keys->size() + 1);
+	pool_get(&b->key_pools[shard], &keys->back());
+
+	return &keys->back();
+}
+
+static void push_bulkrec(struct kt_batch *b, const char *key,
+			const string &value, int64_t xt)
+{
+	RemoteDB::BulkRecord *rec = shard_bulkrec(b, key_shard(b->h, key));
+
+	rec->key.assign(key);
+	/* Copy rather than share the buffer of a reference counted string */
+	rec->value.assign(value.data(), value.size());
+	rec->xt = xt;
+	b->nrecs++;
+}
+
+static void push_key(struct kt_batch *b, const char *key)
+{
+	shard_key(b, key_shard(b->h, key))->assign(key);
+	b->nrecs++;
+}
+
 static void *open_db(struct benchmark_config *config)
 {
-	RemoteDB *db = new RemoteDB();
+	struct kt_handle *h = new kt_handle;
+	int i;
+
+	h->nr_shards = shard_ring_size(ring) * nr_dbs;
+	h->dbs = new RemoteDB *[h->nr_shards];
+
+	for (i = 0; i < h->nr_shards; i++) {
+		RemoteDB *db = new RemoteDB();
+		const char *host = shard_ring_host(ring, shard_endpoint(i));
+		int port = shard_ring_port(ring, shard_endpoint(i));
+
+		if (!db->open(host, port)) {
+			die("open error: %s:%d: %s", host, port,
+				db->error().name());
+		}
+		if (nr_dbs > 1) {
+			char expr[16];
 
-	if (!db->open(config->host, config->port)) {
-		die("open error: %s", db->error().name());
+			sprintf(expr, "%d", i % nr_dbs);
+			db->set_target(expr);
+		}
+		h->dbs[i] = db;
 	}
-	return db;
+
+	h->rpcs = NULL;
+	if (protocol == PROTOCOL_PIPELINE) {
+		h->rpcs = new struct kt_rpc *[h->nr_shards];
+		for (i = 0; i < h->nr_shards; i++) {
+			int endpoint = shard_endpoint(i);
+
+			h->rpcs[i] = kt_rpc_open(shard_ring_host(ring, endpoint),
+						shard_ring_port(ring, endpoint),
+						pipeline);
+		}
+	}
+	h->fanout = shard_fanout_create(h->nr_shards);
+	h->counter = shard_counter_create(ring);
+	db_register(h);
+	h->batch = new kt_batch;
+	kt_batch_init(h->batch, h, batch_limit(config->batch));
+
+	return h;
 }
 
 static void close_db(void *db)
 {
-	RemoteDB *rdb = (RemoteDB *)db;
+	struct kt_handle *h = (struct kt_handle *)db;
+	int i;
+
+	shard_fanout_destroy(h->fanout);
+	db_unregister(h);
+	shard_counter_destroy(h->counter);
+	kt_batch_destroy(h->batch);
+	delete h->batch;
+
+	if (h->rpcs) {
+		for (i = 0; i < h->nr_shards; i++)
+			kt_rpc_close(h->rpcs[i]);
+		delete[] h->rpcs;
+	}
+
+	for (i = 0; i < h->nr_shards; i++) {
+		RemoteDB *rdb = h->dbs[i];
 
-	if (!rdb->close()){
-		die("close error: %s", rdb->error().name());
+		if (!rdb->close()){
+			die("close error: %s", rdb->error().name());
+		}
+		delete rdb;
 	}
-	delete rdb;
+	delete[] h->dbs;
+	delete h;
+}
+
+static RemoteDB *key_db(struct kt_handle *h, const string &key)
+{
+	return h->dbs[key_shard(h, key.c_str())];
 }
 
 static bool debug = false;
 
 static void put_test(void *db, int num, int vsiz, unsigned int seed)
 {
-	RemoteDB *rdb = (RemoteDB *)db;
+	struct kt_handle *h = (struct kt_handle *)db;
 	struct keygen keygen;
 	string value(vsiz, '\0');
 	int i;
@@ -42,13 +491,15 @@ static void put_test(void *db, int num, int vsiz, unsigned int seed)
 	for (i = 0; i < num; i++) {
 		string key(keygen_next_key(&keygen));
 
-		rdb->set(key, value);
+		key_db(h, key)->set(key, value);
 	}
+
+	account_ops(num);
 }
 
 static void get_test(void *db, int num, int vsiz, unsigned int seed)
 {
-	RemoteDB *rdb = (RemoteDB *)db;
+	struct kt_handle *h = (struct kt_handle *)db;
 	struct keygen keygen;
 	int i;
 
@@ -58,59 +509,133 @@ static void get_test(void *db, int num, int vsiz, unsigned int seed)
 		string key(keygen_next_key(&keygen));
 		string value;
 
-		rdb->get(key, &value);
+		key_db(h, key)->get(key, &value);
 		if (debug && vsiz != value.size())
 			die("Unexpected value size: %d", value.size());
 	}
+
+	account_ops(num);
+}
+
+static void set_bulk_binary_shard(int shard, void *arg)
+{
+	struct kt_batch *b = (struct kt_batch *)arg;
+
+	if (b->bulkrecs[shard].size())
+		b->h->dbs[shard]->set_bulk_binary(b->bulkrecs[shard]);
+}
+
+static void get_bulk_binary_shard(int shard, void *arg)
+{
+	struct kt_batch *b = (struct kt_batch *)arg;
+
+	if (b->bulkrecs[shard].size())
+		b->h->dbs[shard]->get_bulk_binary(&b->bulkrecs[shard]);
+}
+
+static void remove_bulk_binary_shard(int shard, void *arg)
+{
+	struct kt_batch *b = (struct kt_batch *)arg;
+
+	if (b->bulkrecs[shard].size())
+		b->h->dbs[shard]->remove_bulk_binary(b->bulkrecs[shard]);
+}
+
+static void set_bulk_shard(int shard, void *arg)
+{
+	struct kt_batch *b = (struct kt_batch *)arg;
+
+	if (b->recs[shard].size())
+		b->h->dbs[shard]->set_bulk(b->recs[shard]);
+}
+
+static void get_bulk_shard(int shard, void *arg)
+{
+	struct kt_batch *b = (struct kt_batch *)arg;
+
+	if (b->keys[shard].size())
+		b->h->dbs[shard]->get_bulk(b->keys[shard], &b->recs[shard]);
+}
+
+static void remove_bulk_shard(int shard, void *arg)
+{
+	struct kt_batch *b = (struct kt_batch *)arg;
+
+	if (b->keys[shard].size())
+		b->h->dbs[shard]->remove_bulk(b->keys[shard]);
+}
+
+static void kt_batch_send(struct kt_batch *b, void (*fn)(int, void *))
+{
+	shard_fanout_run(b->h->fanout, fn, b);
 }
 
 static void putlist_bin_test(void *db, const char *command, int num, int vsiz,
 			int batch, unsigned int seed)
 {
-	RemoteDB *rdb = (RemoteDB *)db;
+	struct kt_handle *h = (struct kt_handle *)db;
 	struct keygen keygen;
 	string value(vsiz, '\0');
-	vector<RemoteDB::BulkRecord> bulkrecs;
+	struct kt_batch *b = h->batch;
+	unsigned long long start;
 	int i;
 
 	keygen_init(&keygen, seed);
+	start = batch_start();
 
 	for (i = 0; i < num; i++) {
-		string key(keygen_next_key(&keygen));
-		RemoteDB::BulkRecord rec = { 0, key, value, kc::INT64MAX };
+		push_bulkrec(b, keygen_next_key(&keygen), value, kc::INT64MAX);
 
-		bulkrecs.push_back(rec);
-
-		if (bulkrecs.size() >= batch) {
-			rdb->set_bulk_binary(bulkrecs);
-			bulkrecs.clear();
+		if (b->nrecs >= batch) {
+			kt_batch_send(b, set_bulk_binary_shard);
+			batch = batch_end(batch, b->nrecs, start);
+			kt_batch_clear(b);
+			start = batch_start();
 		}
 	}
-	if (bulkrecs.size())
-		rdb->set_bulk_binary(bulkrecs);
+	if (b->nrecs)
+		kt_batch_send(b, set_bulk_binary_shard);
+
+	kt_batch_clear(b);
+
+	account_ops(num);
 }
 
 static void putlist_test(void *db, const char *command, int num, int vsiz,
 			int batch, unsigned int seed)
 {
-	RemoteDB *rdb = (RemoteDB *)db;
+	struct kt_handle *h = (struct kt_handle *)db;
 	struct keygen keygen;
 	string value(vsiz, '\0');
-	map<string, string> list;
+	struct kt_batch *b = h->batch;
+	unsigned long long start;
 	int i;
 
 	keygen_init(&keygen, seed);
+	start = batch_start();
 
 	for (i = 0; i < num; i++) {
-		list[string (keygen_next_key(&keygen))] = value;
-
-		if (list.size() >= batch) {
-			rdb->set_bulk(list);
-			list.clear();
+		const char *key = keygen_next_key(&keygen);
+		map<string, string> *recs = &b->recs[key_shard(b->h, key)];
+
+		/* Sequential keys ascend, so the end is the right place */
+		recs->insert(recs->end(),
+			map<string, string>::value_type(key, value));
+		b->nrecs++;
+
+		if (b->nrecs >= batch) {
+			kt_batch_send(b, set_bulk_shard);
+			batch = batch_end(batch, b->nrecs, start);
+			kt_batch_clear(b);
+			start = batch_start();
 		}
 	}
-	if (list.size())
-		rdb->set_bulk(list);
+	if (b->nrecs)
+		kt_batch_send(b, set_bulk_shard);
+
+	kt_batch_clear(b);
+
+	account_ops(num);
 }
 
 static void check_keys(vector<string> *list, int num, unsigned int seed)
@@ -135,18 +660,56 @@ static void check_keys(vector<string> *list, int num, unsigned int seed)
 	}
 }
 
+struct fwmkeys_job {
+	struct kt_handle *h;
+	const char *prefix;
+	vector<string> *lists;
+};
+
+static void fwmkeys_shard(int shard, void *arg)
+{
+	struct fwmkeys_job *job = (struct fwmkeys_job *)arg;
+
+	job->h->dbs[shard]->match_prefix(string(job->prefix),
+					&job->lists[shard], -1);
+	shard_account(job->h, shard, job->lists[shard].size());
+}
+
 static void fwmkeys_test(void *db, int num, unsigned int seed)
 {
-	RemoteDB *rdb = (RemoteDB *)db;
+	struct kt_handle *h = (struct kt_handle *)db;
 	struct keygen keygen;
 	char prefix[KEYGEN_PREFIX_SIZE + 1];
-	vector<string> list;
+	struct fwmkeys_job job;
+	vector<string> *list;
+	int i;
 
 	keygen_init(&keygen, seed);
-	rdb->match_prefix(string (keygen_prefix(&keygen, prefix)), &list, -1);
-	check_keys(&list, num, seed);
+
+	job.h = h;
+	job.prefix = keygen_prefix(&keygen, prefix);
+	job.lists = new vector<string>[h->nr_shards];
+	shard_fanout_run(h->fanout, fwmkeys_shard, &job);
+
+	/* Every shard holds part of the prefix, merge them back in order */
+	list = &job.lists[0];
+	for (i = 1; i < h->nr_shards; i++)
+		list->insert(list->end(), job.lists[i].begin(),
+				job.lists[i].end());
+	if (h->nr_shards > 1)
+		sort(list->begin(), list->end());
+	check_keys(list, num, seed);
+
+	delete[] job.lists;
+
+	account_ops(num);
 }
 
+/*
+ * keygen is NULL and batch is negative when the records cannot be
+ * checked against the key sequence, which is the case when a batch is
+ * split over several shards.
+ */
 static void check_bin_records(vector<RemoteDB::BulkRecord> *bulkrecs,
 			struct keygen *keygen, int vsiz, int batch)
 {
@@ -157,7 +720,7 @@ static void check_bin_records(vector<RemoteDB::BulkRecord> *bulkrecs,
 
 	recnum = bulkrecs->size();
 
-	if (recnum != batch)
+	if (batch >= 0 && recnum != batch)
 		die("Unexpected list size %d", recnum);
 
 	vector<RemoteDB::BulkRecord>::iterator it = bulkrecs->begin();
@@ -168,7 +731,7 @@ static void check_bin_records(vector<RemoteDB::BulkRecord> *bulkrecs,
 		int keysiz = it->key.size();
 		int valsiz = it->value.size();
 
-		if (strncmp(keygen_next_key(keygen), key, keysiz))
+		if (keygen && strncmp(keygen_next_key(keygen), key, keysiz))
 			die("Unexpected key");
 		if (valsiz != vsiz)
 			die("Unexpected value size %d", valsiz);
@@ -188,7 +751,7 @@ static void check_records(map<string, string> *recs, struct keygen *keygen,
 
 	recnum = recs->size();
 
-	if (recnum != batch)
+	if (batch >= 0 && recnum != batch)
 		die("Unexpected list size %d", recnum);
 
 	map<string, string>::const_iterator it = recs->begin();
@@ -199,7 +762,7 @@ static void check_records(map<string, string> *recs, struct keygen *keygen,
 		int keysiz = it->first.size();
 		int valsiz = it->second.size();
 
-		if (strncmp(keygen_next_key(keygen), key, keysiz))
+		if (keygen && strncmp(keygen_next_key(keygen), key, keysiz))
 			die("Unexpected key");
 		if (valsiz != vsiz)
 			die("Unexpected value size %d", valsiz);
@@ -208,188 +771,936 @@ static void check_records(map<string, string> *recs, struct keygen *keygen,
 	}
 }
 
+static void check_bin_batch(struct kt_batch *b, struct keygen *keygen,
+			int vsiz)
+{
+	int i;
+
+	if (b->h->nr_shards == 1) {
+		check_bin_records(&b->bulkrecs[0], keygen, vsiz, b->nrecs);
+		return;
+	}
+	for (i = 0; i < b->h->nr_shards; i++)
+		check_bin_records(&b->bulkrecs[i], NULL, vsiz,
+				b->bulkrecs[i].size());
+}
+
+static void check_batch(struct kt_batch *b, struct keygen *keygen, int vsiz)
+{
+	int i;
+
+	if (b->h->nr_shards == 1) {
+		check_records(&b->recs[0], keygen, vsiz, b->nrecs);
+		return;
+	}
+	for (i = 0; i < b->h->nr_shards; i++)
+		check_records(&b->recs[i], NULL, vsiz, b->keys[i].size());
+}
+
 static void getlist_bin_test(void *db, const char *command, int num, int vsiz,
 			int batch, unsigned int seed)
 {
-	RemoteDB *rdb = (RemoteDB *)db;
+	struct kt_handle *h = (struct kt_handle *)db;
 	struct keygen keygen;
 	struct keygen keygen_for_check;
-	vector<RemoteDB::BulkRecord> bulkrecs;
+	struct kt_batch *b = h->batch;
+	unsigned long long start;
 	int i;
 
 	keygen_init(&keygen, seed);
 	keygen_init(&keygen_for_check, seed);
+	start = batch_start();
 
 	for (i = 0; i < num; i++) {
-		string key(keygen_next_key(&keygen));
-		RemoteDB::BulkRecord rec = { 0, key, "", 0 };
-
-		bulkrecs.push_back(rec);
-
-		if (bulkrecs.size() >= batch) {
-			rdb->get_bulk_binary(&bulkrecs);
-			check_bin_records(&bulkrecs, &keygen_for_check, vsiz,
-					bulkrecs.size());
-			bulkrecs.clear();
+		push_bulkrec(b, keygen_next_key(&keygen), "", 0);
+
+		if (b->nrecs >= batch) {
+			kt_batch_send(b, get_bulk_binary_shard);
+			batch = batch_end(batch, b->nrecs, start);
+			check_bin_batch(b, &keygen_for_check, vsiz);
+			kt_batch_clear(b);
+			start = batch_start();
 		}
 	}
-	if (bulkrecs.size()) {
-		rdb->get_bulk_binary(&bulkrecs);
-		check_bin_records(&bulkrecs, &keygen_for_check, vsiz,
-				bulkrecs.size());
+	if (b->nrecs) {
+		kt_batch_send(b, get_bulk_binary_shard);
+		check_bin_batch(b, &keygen_for_check, vsiz);
 	}
+
+	kt_batch_clear(b);
+
+	account_ops(num);
 }
 
 static void getlist_test(void *db, const char *command, int num, int vsiz,
 			int batch, unsigned int seed)
 {
-	RemoteDB *rdb = (RemoteDB *)db;
+	struct kt_handle *h = (struct kt_handle *)db;
 	struct keygen keygen;
 	struct keygen keygen_for_check;
-	vector<string> list;
-	map<string, string> recs;
+	struct kt_batch *b = h->batch;
+	unsigned long long start;
 	int i;
 
 	keygen_init(&keygen, seed);
 	keygen_init(&keygen_for_check, seed);
+	start = batch_start();
 
 	for (i = 0; i < num; i++) {
-		list.push_back(string(keygen_next_key(&keygen)));
-
-		if (list.size() >= batch) {
-			rdb->get_bulk(list, &recs);
-			check_records(&recs, &keygen_for_check, vsiz,
-					list.size());
-			recs.clear();
-			list.clear();
+		push_key(b, keygen_next_key(&keygen));
+
+		if (b->nrecs >= batch) {
+			kt_batch_send(b, get_bulk_shard);
+			batch = batch_end(batch, b->nrecs, start);
+			check_batch(b, &keygen_for_check, vsiz);
+			kt_batch_clear(b);
+			start = batch_start();
 		}
 	}
-	if (list.size()) {
-		rdb->get_bulk(list, &recs);
-		check_records(&recs, &keygen_for_check, vsiz, list.size());
-		recs.clear();
+	if (b->nrecs) {
+		kt_batch_send(b, get_bulk_shard);
+		check_batch(b, &keygen_for_check, vsiz);
 	}
+
+	kt_batch_clear(b);
+
+	account_ops(num);
 }
 
-static void range_test(void *db, const char *command, int num, int vsiz,
-			int batch, unsigned int seed)
+static unsigned long long now_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+/*
+ * Records and requests of one strategy over a run or phase, and the
+ * wall time from its first start to its last end across all works
+ */
+struct kt_rate {
+	unsigned long long records;
+	unsigned long long requests;
+	unsigned long long first_us;
+	unsigned long long last_us;
+};
+
+static pthread_mutex_t rate_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void kt_rate_add(struct kt_rate *rate, unsigned long long start,
+			unsigned long long records, unsigned long long requests)
 {
-	RemoteDB *rdb = (RemoteDB *)db;
+	unsigned long long end = now_us();
+
+	pthread_mutex_lock(&rate_lock);
+	if (!rate->first_us || start < rate->first_us)
+		rate->first_us = start;
+	if (end > rate->last_us)
+		rate->last_us = end;
+	rate->records += records;
+	rate->requests += requests;
+	pthread_mutex_unlock(&rate_lock);
+}
+
+static void kt_rate_report(const char *what, const char *const *names,
+			struct kt_rate *rates, int nr_rates)
+{
+	int i;
+
+	for (i = 0; i < nr_rates; i++) {
+		struct kt_rate *rate = &rates[i];
+		double sec = (rate->last_us - rate->first_us) / 1000000.0;
+
+		if (!rate->requests)
+			continue;
+		printf("# %s %s: %llu records, %llu requests, "
+			"%.1f records/request, %.3f s, %.1f records/s\n",
+			what, names[i], rate->records, rate->requests,
+			(double)rate->records / rate->requests, sec,
+			sec > 0 ? rate->records / sec : 0.0);
+	}
+	memset(rates, 0, sizeof(*rates) * nr_rates);
+}
+
+/*
+ * rangeout strategies (-kt-rangeout)
+ *
+ * prefix: match_prefix up to batch keys and remove_bulk_binary them
+ * cursor: step a cursor over up to batch keys from the prefix and
+ *         remove_bulk_binary them
+ * script: the kvbench_rangeout procedure of kyototycoontest.lua does
+ *         both in the server, one round trip per batch (ktserver must
+ *         run with -scr kyototycoontest.lua)
+ */
+enum { RANGEOUT_PREFIX, RANGEOUT_CURSOR, RANGEOUT_SCRIPT, NR_RANGEOUT };
+
+static const char *const rangeout_names[NR_RANGEOUT] = {
+	"prefix", "cursor", "script",
+};
+static int rangeout_strategy = RANGEOUT_PREFIX;
+static struct kt_rate rangeout_rates[NR_RANGEOUT];
+
+/*
+ * Fills the shard's keys of the batch with up to max keys of the prefix.
+ * Returns the number of requests it took.
+ */
+static int cursor_keys(struct kt_batch *b, int shard, RemoteDB::Cursor *cur,
+			const char *prefix, int max)
+{
+	vector<string> *keys = &b->keys[shard];
+	size_t len = strlen(prefix);
+	int requests = 1;
+
+	cur->jump(prefix, len);
+
+	while (keys->size() < max) {
+		string *key = shard_key(b, shard);
+
+		requests++;
+		if (!cur->get_key(key, true) || key->compare(0, len, prefix)) {
+			pool_put(&b->key_pools[shard], key);
+			keys->pop_back();
+			break;
+		}
+	}
+
+	return requests;
+}
+
+/* The procedures run on database "db" of the server */
+static void script_target(map<string, string> *params, int shard)
+{
+	char buf[32];
+
+	sprintf(buf, "%d", shard % nr_dbs);
+	(*params)["db"] = buf;
+}
+
+static int64_t rangeout_script(RemoteDB *rdb, int shard, const char *prefix,
+			int max)
+{
+	map<string, string> params, result;
+	char buf[32];
+
+	sprintf(buf, "%d", max);
+	params["prefix"] = prefix;
+	params["max"] = buf;
+	script_target(&params, shard);
+
+	if (!rdb->play_script_binary("kvbench_rangeout", params, &result))
+		die("play_script error: %s: %s", rdb->error().name(),
+			rdb->error().message());
+
+	return atoll(result["num"].c_str());
+}
+
+struct rangeout_job {
+	struct kt_handle *h;
+	int batch;
+	unsigned int seed;
+	int nrecs;
+	int requests;
+};
+
+/* Remove the prefix from one shard, batch records per bulk removal */
+static void rangeout_shard(int shard, void *arg)
+{
+	struct rangeout_job *job = (struct rangeout_job *)arg;
+	RemoteDB *rdb = job->h->dbs[shard];
+	RemoteDB::Cursor *cur = NULL;
+	struct kt_batch *b = job->h->batch;
+	vector<string> *keys = &b->keys[shard];
 	struct keygen keygen;
 	char prefix[KEYGEN_PREFIX_SIZE + 1];
-	string key, value;
-	int nrecs = 0;
+	int batch = job->batch;
+	int nrecs = 0, requests = 0;
 
-	keygen_init(&keygen, seed);
+	keygen_init(&keygen, job->seed);
 	keygen_prefix(&keygen, prefix);
+	if (rangeout_strategy == RANGEOUT_CURSOR)
+		cur = rdb->cursor();
+
+	while (1) {
+		unsigned long long start = batch_start();
+		int64_t removed;
+		size_t i;
+
+		if (rangeout_strategy == RANGEOUT_SCRIPT) {
+			removed = rangeout_script(rdb, shard, prefix, batch);
+			requests++;
+		} else {
+			kt_batch_clear_bulkrecs(b, shard);
+			kt_batch_clear_keys(b, shard);
+			if (cur) {
+				requests += cursor_keys(b, shard, cur, prefix,
+							batch);
+			} else {
+				rdb->match_prefix(prefix, keys, batch);
+				requests++;
+			}
+			if (keys->empty())
+				break;
+
+			/* The keys are not needed after the removal */
+			for (i = 0; i < keys->size(); i++)
+				shard_bulkrec(b, shard)->key.swap((*keys)[i]);
+			removed = rdb->remove_bulk_binary(b->bulkrecs[shard]);
+			requests++;
+		}
+		if (removed < 0)
+			die("rangeout error: %s", rdb->error().name());
+		if (!removed)
+			break;
+
+		nrecs += removed;
+		batch = batch_end(batch, removed, start);
+	}
+
+	delete cur;
+	kt_batch_clear_bulkrecs(b, shard);
+	kt_batch_clear_keys(b, shard);
+
+	shard_account(job->h, shard, nrecs);
+	__sync_fetch_and_add(&job->nrecs, nrecs);
+	__sync_fetch_and_add(&job->requests, requests);
+}
+
+static void rangeout_test(void *db, const char *command, int num, int vsiz,
+			int batch, unsigned int seed)
+{
+	struct kt_handle *h = (struct kt_handle *)db;
+	struct rangeout_job job = { h, batch, seed, 0, 0 };
+	unsigned long long start = now_us();
+
+	shard_fanout_run(h->fanout, rangeout_shard, &job);
+	kt_rate_add(&rangeout_rates[rangeout_strategy], start, job.nrecs,
+			job.requests);
+
+	if (debug && num != job.nrecs)
+		die("Unexpected number of records are deleted: %d", job.nrecs);
+
+	account_ops(job.nrecs);
+}
+
+/*
+ * range strategies (-kt-range)
+ *
+ * cursor: one cursor step per record
+ * bulk:   match_prefix the keys of the prefix once, then get_bulk_binary
+ *         them batch records per round trip
+ * script: the kvbench_range procedure of kyototycoontest.lua returns
+ *         the next batch records of the prefix per round trip
+ */
+enum { RANGE_CURSOR, RANGE_BULK, RANGE_SCRIPT, NR_RANGE };
+
+static const char *const range_names[NR_RANGE] = {
+	"cursor", "bulk", "script",
+};
+static int range_strategy = RANGE_CURSOR;
+static struct kt_rate range_rates[NR_RANGE];
+
+struct range_job {
+	struct kt_handle *h;
+	int num;
+	int vsiz;
+	int batch;
+	unsigned int seed;
+	int nrecs;
+	int requests;
+};
+
+static void check_range_record(struct range_job *job, struct keygen *keygen,
+			const string &key, const string &value)
+{
+	if (debug && job->vsiz != value.size())
+		die("Unexpected value size: %d", value.size());
+	if (debug && job->h->nr_shards == 1 &&
+			strncmp(keygen_next_key(keygen), key.data(), key.size()))
+		die("Unexpected key");
+}
+
+static int range_cursor(struct range_job *job, int shard,
+			const char *prefix, struct keygen *keygen,
+			int *requests)
+{
+	RemoteDB *rdb = job->h->dbs[shard];
 	RemoteDB::Cursor *cur = rdb->cursor();
-	cur->jump(prefix, strlen(prefix));
+	size_t len = strlen(prefix);
+	string key, value;
+	int nrecs = 0;
 
-	while (cur->get(&key, &value)) {
-		if (strncmp(key.data(), prefix, strlen(prefix))) {
+	cur->jump(prefix, len);
+	(*requests)++;
+
+	while (cur->get(&key, &value, NULL, true)) {
+		(*requests)++;
+		if (key.compare(0, len, prefix))
 			break;
-		}
-		if (debug && vsiz != value.size())
-			die("Unexpected value size: %d", value.size());
-		if (debug && strncmp(keygen_next_key(&keygen),
-				key.data(), key.size()))
-			die("Unexpected key");
+		check_range_record(job, keygen, key, value);
 		nrecs++;
 	}
-	if (debug && num != nrecs)
-		die("Unexpected record num: %d", nrecs);
 
 	delete cur;
+
+	return nrecs;
 }
 
-static void rangeout_test(void *db, const char *command, int num, int vsiz,
+static int range_bulk(struct range_job *job, int shard,
+			const char *prefix, struct keygen *keygen,
+			int *requests)
+{
+	RemoteDB *rdb = job->h->dbs[shard];
+	struct kt_batch *b = job->h->batch;
+	vector<string> *keys = &b->keys[shard];
+	vector<RemoteDB::BulkRecord> *bulkrecs = &b->bulkrecs[shard];
+	int batch = job->batch;
+	size_t pos = 0;
+	int nrecs = 0;
+
+	kt_batch_clear_keys(b, shard);
+	rdb->match_prefix(prefix, keys, -1);
+	(*requests)++;
+	/* Only tree databases return the keys in order */
+	sort(keys->begin(), keys->end());
+
+	while (pos < keys->size()) {
+		unsigned long long start = batch_start();
+		size_t end = min(keys->size(), pos + batch);
+		int64_t found;
+		size_t i;
+
+		kt_batch_clear_bulkrecs(b, shard);
+		/* Each key is looked up once, so move it to its record */
+		for (i = pos; i < end; i++)
+			shard_bulkrec(b, shard)->key.swap((*keys)[i]);
+		found = rdb->get_bulk_binary(bulkrecs);
+		(*requests)++;
+		if (found < 0)
+			die("get_bulk_binary error: %s", rdb->error().name());
+
+		for (i = 0; i < bulkrecs->size(); i++) {
+			/* Records removed since match_prefix come back with xt < 0 */
+			if ((*bulkrecs)[i].xt < 0)
+				continue;
+			check_range_record(job, keygen, (*bulkrecs)[i].key,
+					(*bulkrecs)[i].value);
+			nrecs++;
+		}
+		batch = batch_end(batch, end - pos, start);
+		pos = end;
+	}
+	kt_batch_clear_bulkrecs(b, shard);
+	kt_batch_clear_keys(b, shard);
+
+	return nrecs;
+}
+
+static int range_script(struct range_job *job, int shard,
+			const char *prefix, struct keygen *keygen,
+			int *requests)
+{
+	RemoteDB *rdb = job->h->dbs[shard];
+	map<string, string> params, result;
+	int batch = job->batch;
+	char max[32];
+	int nrecs = 0;
+
+	params["prefix"] = prefix;
+	params["start"] = prefix;
+	script_target(&params, shard);
+
+	while (1) {
+		unsigned long long start = batch_start();
+		map<string, string>::const_iterator it;
+
+		sprintf(max, "%d", batch);
+		params["max"] = max;
+		result.clear();
+		if (!rdb->play_script_binary("kvbench_range", params, &result))
+			die("play_script error: %s: %s", rdb->error().name(),
+				rdb->error().message());
+		(*requests)++;
+		if (result.empty())
+			break;
+
+		for (it = result.begin(); it != result.end(); it++)
+			check_range_record(job, keygen, it->first, it->second);
+		nrecs += result.size();
+
+		batch = batch_end(batch, result.size(), start);
+		/* Continue right after the last key */
+		params["start"] = result.rbegin()->first + string(1, '\0');
+	}
+
+	return nrecs;
+}
+
+/* Scan the prefix on one shard, checking the key order if it has all of it */
+static void range_shard(int shard, void *arg)
+{
+	struct range_job *job = (struct range_job *)arg;
+	struct keygen keygen;
+	char prefix[KEYGEN_PREFIX_SIZE + 1];
+	int nrecs, requests = 0;
+
+	keygen_init(&keygen, job->seed);
+	keygen_prefix(&keygen, prefix);
+
+	switch (range_strategy) {
+	case RANGE_BULK:
+		nrecs = range_bulk(job, shard, prefix, &keygen, &requests);
+		break;
+	case RANGE_SCRIPT:
+		nrecs = range_script(job, shard, prefix, &keygen, &requests);
+		break;
+	default:
+		nrecs = range_cursor(job, shard, prefix, &keygen, &requests);
+		break;
+	}
+
+	shard_account(job->h, shard, nrecs);
+	__sync_fetch_and_add(&job->nrecs, nrecs);
+	__sync_fetch_and_add(&job->requests, requests);
+}
+
+static void range_test(void *db, const char *command, int num, int vsiz,
 			int batch, unsigned int seed)
 {
-	die("rangeout_test is not implemented");
+	struct kt_handle *h = (struct kt_handle *)db;
+	struct range_job job = { h, num, vsiz, batch, seed, 0, 0 };
+	unsigned long long start = now_us();
+
+	shard_fanout_run(h->fanout, range_shard, &job);
+	kt_rate_add(&range_rates[range_strategy], start, job.nrecs,
+			job.requests);
+
+	if (debug && num != job.nrecs)
+		die("Unexpected record num: %d", job.nrecs);
+
+	account_ops(job.nrecs);
 }
 
 static void outlist_bin_test(void *db, const char *command, int num, int batch,
 			unsigned int seed)
 {
-	RemoteDB *rdb = (RemoteDB *)db;
+	struct kt_handle *h = (struct kt_handle *)db;
 	struct keygen keygen;
-	vector<RemoteDB::BulkRecord> bulkrecs;
+	struct kt_batch *b = h->batch;
+	unsigned long long start;
 	int i;
 
 	keygen_init(&keygen, seed);
+	start = batch_start();
 
 	for (i = 0; i < num; i++) {
-		string key(keygen_next_key(&keygen));
-		RemoteDB::BulkRecord rec = { 0, key, "", 0 };
-
-		bulkrecs.push_back(rec);
+		push_bulkrec(b, keygen_next_key(&keygen), "", 0);
 
-		if (bulkrecs.size() >= batch) {
-			rdb->remove_bulk_binary(bulkrecs);
-			bulkrecs.clear();
+		if (b->nrecs >= batch) {
+			kt_batch_send(b, remove_bulk_binary_shard);
+			batch = batch_end(batch, b->nrecs, start);
+			kt_batch_clear(b);
+			start = batch_start();
 		}
 	}
-	if (bulkrecs.size())
-		rdb->remove_bulk_binary(bulkrecs);
+	if (b->nrecs)
+		kt_batch_send(b, remove_bulk_binary_shard);
+
+	kt_batch_clear(b);
+
+	account_ops(num);
 }
 
 static void outlist_test(void *db, const char *command, int num, int batch,
 			unsigned int seed)
 {
-	RemoteDB *rdb = (RemoteDB *)db;
+	struct kt_handle *h = (struct kt_handle *)db;
 	struct keygen keygen;
-	vector<string> list;
+	struct kt_batch *b = h->batch;
+	unsigned long long start;
+	int i;
+
+	keygen_init(&keygen, seed);
+	start = batch_start();
+
+	for (i = 0; i < num; i++) {
+		push_key(b, keygen_next_key(&keygen));
+
+		if (b->nrecs >= batch) {
+			kt_batch_send(b, remove_bulk_shard);
+			batch = batch_end(batch, b->nrecs, start);
+			kt_batch_clear(b);
+			start = batch_start();
+		}
+	}
+	if (b->nrecs)
+		kt_batch_send(b, remove_bulk_shard);
+
+	kt_batch_clear(b);
+
+	account_ops(num);
+}
+
+/*
+ * Pipelined HTTP RPCs: every shard gets one list of "_key" and value
+ * pairs per batch, which is queued on its connection without waiting
+ * for the replies of the previous batches.
+ */
+static TCLIST **rpc_lists_new(struct kt_handle *h)
+{
+	TCLIST **ins = new TCLIST *[h->nr_shards];
+	int i;
+
+	for (i = 0; i < h->nr_shards; i++)
+		ins[i] = tclistnew();
+
+	return ins;
+}
+
+static void rpc_lists_del(struct kt_handle *h, TCLIST **ins)
+{
+	int i;
+
+	for (i = 0; i < h->nr_shards; i++)
+		tclistdel(ins[i]);
+	delete[] ins;
+}
+
+static void rpc_push(struct kt_handle *h, TCLIST **ins, const char *key,
+			const void *vbuf, int vsiz)
+{
+	char name[KEYGEN_KEY_SIZE + 1];
+	int shard = key_shard(h, key);
+
+	name[0] = '_';
+	strcpy(name + 1, key);
+	tclistpush2(ins[shard], name);
+	tclistpush(ins[shard], vbuf, vsiz);
+}
+
+/*
+ * One test's pipelined RPCs.  The replies are read after later batches
+ * are queued, so every batch is timed until the last reply of its
+ * calls, one per shard it has keys on, and that adapts the size of the
+ * batches queued from then on.
+ */
+struct rpc_test {
+	const char *procedure;
+	int batch;
+	int vsiz;
+	int found;
+	unsigned long long errors;
+};
+
+struct rpc_batch {
+	struct rpc_test *test;
+	unsigned long long start;
+	int nrecs;
+	int pending;
+};
+
+static void rpc_batch_put(struct rpc_batch *b)
+{
+	struct rpc_test *test = b->test;
+
+	if (--b->pending)
+		return;
+	test->batch = batch_end(test->batch, b->nrecs, b->start);
+	delete b;
+}
+
+static void rpc_done(void *arg, int status, const TCLIST *out)
+{
+	struct rpc_batch *b = (struct rpc_batch *)arg;
+	struct rpc_test *test = b->test;
+	int i;
+
+	if (status != 200) {
+		test->errors++;
+	} else if (out) {
+		for (i = 0; i + 1 < tclistnum(out); i += 2) {
+			int siz;
+
+			/* Records come as "_key", the rest is "num" */
+			if (tclistval2(out, i)[0] != '_')
+				continue;
+			tclistval(out, i + 1, &siz);
+			if (debug && siz != test->vsiz)
+				die("Unexpected value size %d", siz);
+			test->found++;
+		}
+	}
+	rpc_batch_put(b);
+}
+
+static void rpc_send(struct kt_handle *h, TCLIST **ins, struct rpc_test *test,
+			int nrecs, unsigned long long start)
+{
+	struct rpc_batch *b;
+	int i;
+
+	if (!nrecs)
+		return;
+
+	b = new rpc_batch;
+	b->test = test;
+	b->start = start;
+	b->nrecs = nrecs;
+	/* Held until every call is queued, a full pipeline reads replies */
+	b->pending = 1;
+
+	for (i = 0; i < h->nr_shards; i++) {
+		if (!tclistnum(ins[i]))
+			continue;
+		if (nr_dbs > 1) {
+			char expr[16];
+
+			sprintf(expr, "%d", i % nr_dbs);
+			tclistpush2(ins[i], "DB");
+			tclistpush2(ins[i], expr);
+		}
+		b->pending++;
+		kt_rpc_call(h->rpcs[i], test->procedure, ins[i], rpc_done, b);
+		tclistclear(ins[i]);
+	}
+	rpc_batch_put(b);
+}
+
+static void rpc_sync(struct kt_handle *h, struct rpc_test *test)
+{
 	int i;
 
+	for (i = 0; i < h->nr_shards; i++)
+		kt_rpc_sync(h->rpcs[i]);
+	if (debug && test->errors)
+		die("%llu %s RPCs failed", test->errors, test->procedure);
+}
+
+static void rpc_run(struct kt_handle *h, struct rpc_test *test, int num,
+			int vsiz, unsigned int seed)
+{
+	struct keygen keygen;
+	string value(vsiz, '\0');
+	TCLIST **ins = rpc_lists_new(h);
+	unsigned long long start;
+	int i, nrecs = 0;
+
 	keygen_init(&keygen, seed);
+	start = batch_start();
 
 	for (i = 0; i < num; i++) {
-		list.push_back(string(keygen_next_key(&keygen)));
+		rpc_push(h, ins, keygen_next_key(&keygen), value.data(), vsiz);
 
-		if (list.size() >= batch) {
-			rdb->remove_bulk(list);
-			list.clear();
+		if (++nrecs >= test->batch) {
+			rpc_send(h, ins, test, nrecs, start);
+			nrecs = 0;
+			start = batch_start();
 		}
 	}
-	if (list.size())
-		rdb->remove_bulk(list);
+	rpc_send(h, ins, test, nrecs, start);
+	rpc_sync(h, test);
+
+	rpc_lists_del(h, ins);
+
+	account_ops(num);
+}
+
+static void putlist_rpc_test(void *db, const char *command, int num, int vsiz,
+			int batch, unsigned int seed)
+{
+	struct rpc_test test = { "set_bulk", batch, vsiz, 0, 0 };
+
+	rpc_run((struct kt_handle *)db, &test, num, vsiz, seed);
+}
+
+static void getlist_rpc_test(void *db, const char *command, int num, int vsiz,
+			int batch, unsigned int seed)
+{
+	struct rpc_test test = { "get_bulk", batch, vsiz, 0, 0 };
+
+	rpc_run((struct kt_handle *)db, &test, num, 0, seed);
+
+	if (debug && test.found != num)
+		die("Unexpected record num: %d", test.found);
+}
+
+static void outlist_rpc_test(void *db, const char *command, int num, int batch,
+			unsigned int seed)
+{
+	struct rpc_test test = { "remove_bulk", batch, 0, 0, 0 };
+
+	rpc_run((struct kt_handle *)db, &test, num, 0, seed);
 }
 
-static struct benchmark_config config;
+static void report(struct benchmark_config *config)
+{
+	unsigned long long sent, received;
+
+	/* The databases' counts feed the endpoints' too */
+	db_collect_all();
+	shard_ring_report(ring);
+	db_report();
+	kt_rate_report("range", range_names, range_rates, NR_RANGE);
+	kt_rate_report("rangeout", rangeout_names, rangeout_rates,
+			NR_RANGEOUT);
+
+	socket_bytes(&sent, &received);
+	if (nr_ops) {
+		/* Every TCP socket of the process, kvbench's included */
+		printf("# wire %s: %llu ops, %.1f bytes/op sent, "
+			"%.1f bytes/op received (all TCP sockets)\n",
+			protocol_names[protocol],
+			nr_ops, (double)sent / nr_ops,
+			(double)received / nr_ops);
+		/*
+		 * Every operator new of the process: kvbench's own batches
+		 * are reused, so most of these are the client library's,
+		 * e.g. its request buffers and the keys match_prefix returns.
+		 */
+		printf("# alloc %llu operator new calls, %.2f per op "
+			"(whole process, client library included)\n",
+			nr_allocs, (double)nr_allocs / nr_ops);
+	}
+	nr_ops = 0;
+	nr_allocs = 0;
+}
+
+static int parse_strategy(const char *option, const char *arg,
+			const char *const *names, int nr_names)
+{
+	int i;
+
+	for (i = 0; i < nr_names; i++) {
+		if (!strcmp(arg, names[i]))
+			return i;
+	}
+	die("Invalid %s: %s", option, arg);
+
+	return -1;
+}
+
+static int parse_option(struct benchmark_config *config, int argc,
+			char **argv, int i)
+{
+	if (!strcmp(argv[i], "-kt-rangeout")) {
+		rangeout_strategy = parse_strategy(argv[i], argv[i + 1],
+						rangeout_names, NR_RANGEOUT);
+		return 2;
+	} else if (!strcmp(argv[i], "-kt-protocol")) {
+		protocol = parse_strategy(argv[i], argv[i + 1],
+					protocol_names, NR_PROTOCOL);
+		protocol_given = true;
+		return 2;
+	} else if (!strcmp(argv[i], "-kt-pipeline")) {
+		pipeline = atoi(argv[i + 1]);
+		if (pipeline < 1)
+			die("Invalid pipeline depth: %s", argv[i + 1]);
+		pipeline_given = true;
+		return 2;
+	} else if (!strcmp(argv[i], "-kt-dbs")) {
+		nr_dbs = atoi(argv[i + 1]);
+		if (nr_dbs < 1)
+			die("Invalid number of databases: %s", argv[i + 1]);
+		return 2;
+	} else if (!strcmp(argv[i], "-kt-range")) {
+		range_strategy = parse_strategy(argv[i], argv[i + 1],
+						range_names, NR_RANGE);
+		return 2;
+	}
+
+	return 0;
+}
+
+static void init_config(struct benchmark_config *config)
+{
+	config->producer = "nop";
+	config->consumer = "nop";
+	config->host = "localhost";
+	config->port = 1978;
+	config->num = 5000000;
+	config->vsiz = 100;
+	config->batch = 1000;
+	config->producer_thnum = 1;
+	config->consumer_thnum = 1;
+	config->debug = false;
+	config->verbose = 1;
+	config->ops.open_db = open_db;
+	config->ops.close_db = close_db;
+	config->ops.put_test = put_test;
+	config->ops.get_test = get_test;
+	config->ops.fwmkeys_test = fwmkeys_test;
+	config->ops.rangeout_test = rangeout_test;
+	config->ops.putlist_test = putlist_bin_test;
+	config->ops.getlist_test = getlist_bin_test;
+	config->ops.outlist_test = outlist_bin_test;
+	config->ops.range_test = range_test;
+	config->ops.parse_option = parse_option;
+	config->ops.report = report;
+
+	/* The same plugin may be loaded for several -backend runs */
+	protocol = PROTOCOL_BINARY;
+	pipeline = 8;
+	protocol_given = false;
+	pipeline_given = false;
+	nr_dbs = 1;
+	range_strategy = RANGE_CURSOR;
+	rangeout_strategy = RANGEOUT_PREFIX;
+}
+
+static void setup(struct benchmark_config *config)
+{
+	unsigned long long sent, received;
+
+	if (pipeline_given) {
+		if (protocol_given && protocol != PROTOCOL_PIPELINE)
+			die("-kt-pipeline needs -kt-protocol pipeline, not %s",
+				protocol_names[protocol]);
+		protocol = PROTOCOL_PIPELINE;
+	}
+
+	debug = config->debug;
+	if (ring)
+		shard_ring_destroy(ring);
+	ring = shard_ring_create(config->hosts, config->host, config->port,
+				config->shard_hash);
+	delete[] db_nrecs;
+	db_nrecs = new unsigned long long[nr_dbs]();
+
+	if (protocol == PROTOCOL_HTTP) {
+		config->ops.putlist_test = putlist_test;
+		config->ops.getlist_test = getlist_test;
+		config->ops.outlist_test = outlist_test;
+	} else if (protocol == PROTOCOL_PIPELINE) {
+		config->ops.putlist_test = putlist_rpc_test;
+		config->ops.getlist_test = getlist_rpc_test;
+		config->ops.outlist_test = outlist_rpc_test;
+	}
+
+	/* Count from here, not from the start of the process */
+	socket_bytes(&sent, &received);
+}
+
+#ifdef BENCHMARK_PLUGIN
+
+extern "C" {
+struct benchmark_plugin benchmark_plugin = {
+	"kyototycoon", init_config, setup,
+};
+}
+
+#else
 
 int main(int argc, char **argv)
 {
-	config.producer = "nop";
-	config.consumer = "nop";
-	config.host = "localhost";
-	config.port = 1978;
-	config.num = 5000000;
-	config.vsiz = 100;
-	config.batch = 1000;
-	config.producer_thnum = 1;
-	config.consumer_thnum = 1;
-	config.debug = false;
-	config.verbose = 1;
-	config.ops.open_db = open_db;
-	config.ops.close_db = close_db;
-	config.ops.put_test = put_test;
-	config.ops.get_test = get_test;
-	config.ops.fwmkeys_test = fwmkeys_test;
-	config.ops.rangeout_test = rangeout_test;
-	if (0) { /* HTTP */
-		config.ops.putlist_test = putlist_test;
-		config.ops.getlist_test = getlist_test;
-		config.ops.outlist_test = outlist_test;
-	} else { /* binary protocol */
-		config.ops.putlist_test = putlist_bin_test;
-		config.ops.getlist_test = getlist_bin_test;
-		config.ops.outlist_test = outlist_bin_test;
-	}
-	config.ops.range_test = range_test;
-	
+	static struct benchmark_config config;
+
+	init_config(&config);
 	parse_options(&config, argc, argv);
-	debug = config.debug;
+	setup(&config);
 	benchmark(&config);
 
 	return 0;
 }
+
+#endif
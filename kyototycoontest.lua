@@ -0,0 +1,62 @@
+--
+-- Server side procedures of kyototycoontest, load them with
+--
+--	ktserver -scr kyototycoontest.lua ...
+--
+
+kt = __kyototycoon__
+
+-- The database of index "db" (-kt-dbs), the first one without it
+local function target_db(inmap)
+	local idx = tonumber(inmap.db or "0")
+
+	return idx and kt.dbs[idx + 1]
+end
+
+-- Return up to "max" records from "start" on whose keys start with "prefix"
+function kvbench_range(inmap, outmap)
+	local db = target_db(inmap)
+	local prefix = inmap.prefix
+	local start = inmap.start
+	local max = tonumber(inmap.max)
+
+	if not db or not prefix or not start or not max then
+		return kt.RVEINVALID
+	end
+
+	local cur = db:cursor()
+	cur:jump(start)
+	while max > 0 do
+		local key, value = cur:get(true)
+
+		if not key or key:sub(1, #prefix) ~= prefix then
+			break
+		end
+		outmap[key] = value
+		max = max - 1
+	end
+	cur:disable()
+
+	return kt.RVSUCCESS
+end
+
+-- Remove up to "max" records whose keys start with "prefix"
+function kvbench_rangeout(inmap, outmap)
+	local db = target_db(inmap)
+	local prefix = inmap.prefix
+	local max = tonumber(inmap.max)
+
+	if not db or not prefix or not max then
+		return kt.RVEINVALID
+	end
+
+	local keys = db:match_prefix(prefix, max)
+	local num = db:remove_bulk(keys, false)
+
+	if num < 0 then
+		return kt.RVEINTERNAL
+	end
+	outmap.num = num
+
+	return kt.RVSUCCESS
+end
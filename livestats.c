@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include "livestats.h"
+
+struct livestats {
+	void *map;
+	size_t size;
+	struct livestats_header *header;
+	struct livestats_thread *slots;
+};
+
+static unsigned long long livestats_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+struct livestats *livestats_create(const char *path, int nthreads)
+{
+	struct livestats *stats;
+	struct livestats_header *header;
+	size_t size;
+	int fd;
+
+	size = sizeof(*header) + sizeof(struct livestats_thread) * nthreads;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return NULL;
+	if (ftruncate(fd, size) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	stats = malloc(sizeof(*stats));
+	if (!stats) {
+		close(fd);
+		return NULL;
+	}
+	stats->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (stats->map == MAP_FAILED) {
+		free(stats);
+		return NULL;
+	}
+	memset(stats->map, 0, size);
+
+	stats->size = size;
+	stats->header = header = stats->map;
+	stats->slots = (struct livestats_thread *)(header + 1);
+
+	header->version = LIVESTATS_VERSION;
+	header->header_size = sizeof(*header);
+	header->thread_size = sizeof(struct livestats_thread);
+	header->nthreads = nthreads;
+	header->state = LIVESTATS_RUNNING;
+	header->pid = getpid();
+	header->hist_buckets = LIVESTATS_HIST_BUCKETS;
+	header->start_us = livestats_now();
+
+	/* Publish the magic last so that readers never see a partial header */
+	__sync_synchronize();
+	header->magic = LIVESTATS_MAGIC;
+
+	return stats;
+}
+
+void livestats_destroy(struct livestats *stats)
+{
+	stats->header->state = LIVESTATS_FINISHED;
+	msync(stats->map, stats->size, MS_ASYNC);
+	munmap(stats->map, stats->size);
+	free(stats);
+}
+
+struct livestats_thread *livestats_slot(struct livestats *stats, int id,
+				const char *role, const char *command)
+{
+	struct livestats_thread *slot = &stats->slots[id];
+
+	slot->id = id;
+	strncpy(slot->role, role, LIVESTATS_ROLE_SIZE - 1);
+	strncpy(slot->command, command, LIVESTATS_COMMAND_SIZE - 1);
+
+	return slot;
+}
+
+int livestats_hist_bucket(unsigned long long us)
+{
+	int bucket = 0;
+
+	while (us) {
+		us >>= 1;
+		bucket++;
+	}
+	if (bucket >= LIVESTATS_HIST_BUCKETS)
+		bucket = LIVESTATS_HIST_BUCKETS - 1;
+
+	return bucket;
+}
+
+void livestats_account(struct livestats_thread *slot, unsigned long long ops,
+		unsigned long long bytes, unsigned long long elapsed_us)
+{
+	volatile struct livestats_thread *s = slot;
+
+	s->seq++;
+	__sync_synchronize();
+
+	s->works++;
+	s->ops += ops;
+	s->bytes += bytes;
+	s->elapsed_us += elapsed_us;
+	s->hist[livestats_hist_bucket(elapsed_us)]++;
+	s->updated_us = livestats_now();
+
+	__sync_synchronize();
+	s->seq++;
+}
+
+#define LIVESTATS_READ_RETRIES 1000
+
+/*
+ * Returns false if no consistent copy could be made, in which case only
+ * the fields set at slot creation (id, role, command) can be trusted
+ */
+bool livestats_read_slot(const volatile struct livestats_thread *slot,
+			struct livestats_thread *copy)
+{
+	uint32_t seq;
+	int i;
+
+	for (i = 0; i < LIVESTATS_READ_RETRIES; i++) {
+		seq = slot->seq;
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+		__sync_synchronize();
+		memcpy(copy, (const void *)slot, sizeof(*copy));
+		__sync_synchronize();
+		if (slot->seq == seq)
+			return true;
+	}
+	memcpy(copy, (const void *)slot, sizeof(*copy));
+
+	return false;
+}
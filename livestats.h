@@ -0,0 +1,79 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Live benchmark statistics exported through an mmap'd file
+ *
+ * The file is laid out in host byte order as one header followed by
+ * one slot per worker thread:
+ *
+ *	struct livestats_header
+ *	struct livestats_thread [header.nthreads]
+ *
+ * Readers must check magic and version, and must use header_size and
+ * thread_size to locate the slots so that fields can be appended to
+ * either struct without breaking older readers.
+ *
+ * Every slot is guarded by a sequence lock.  The worker owning the slot
+ * makes seq odd before it updates the counters and even again after.
+ * Readers copy the slot and retry until seq was the same even value
+ * before and after the copy.  Writers never wait for readers.  A writer
+ * that died in the middle of an update leaves seq odd for good, so
+ * readers give up after a bounded number of retries and treat the slot
+ * as stale.
+ *
+ * All counters are cumulative since the slot was initialized.  The
+ * latency histogram counts works whose elapsed time falls in
+ * [2^(i-1), 2^i) microseconds (bucket 0 is < 1us), so rolling views are
+ * obtained by diffing two snapshots.
+ */
+
+#define LIVESTATS_MAGIC 0x4c565354	/* "LVST" */
+#define LIVESTATS_VERSION 1
+
+#define LIVESTATS_HIST_BUCKETS 40
+#define LIVESTATS_ROLE_SIZE 16
+#define LIVESTATS_COMMAND_SIZE 48
+
+enum {
+	LIVESTATS_RUNNING = 1,
+	LIVESTATS_FINISHED = 2,
+};
+
+struct livestats_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t thread_size;
+	uint32_t nthreads;
+	uint32_t state;
+	uint32_t pid;
+	uint32_t hist_buckets;
+	uint64_t start_us;
+};
+
+struct livestats_thread {
+	uint32_t seq;
+	uint32_t id;
+	char role[LIVESTATS_ROLE_SIZE];
+	char command[LIVESTATS_COMMAND_SIZE];
+	uint64_t works;
+	uint64_t ops;
+	uint64_t bytes;
+	uint64_t elapsed_us;
+	uint64_t updated_us;
+	uint64_t hist[LIVESTATS_HIST_BUCKETS];
+};
+
+struct livestats;
+
+struct livestats *livestats_create(const char *path, int nthreads);
+void livestats_destroy(struct livestats *stats);
+struct livestats_thread *livestats_slot(struct livestats *stats, int id,
+				const char *role, const char *command);
+void livestats_account(struct livestats_thread *slot, unsigned long long ops,
+		unsigned long long bytes, unsigned long long elapsed_us);
+
+int livestats_hist_bucket(unsigned long long us);
+bool livestats_read_slot(const volatile struct livestats_thread *slot,
+			struct livestats_thread *copy);
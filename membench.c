@@ -0,0 +1,446 @@
+#include <tcutil.h>
+#include <string.h>
+#include "testutil.h"
+
+static bool debug = false;
+
+/*
+ * In-memory reference backend
+ *
+ * Every record is kept twice: in a TCMDB, which is a hash table striped
+ * over several locks, for point operations, and in a prefix-sharded
+ * ordered tree for fwmkeys and range scans.  Keys of one keygen prefix
+ * always land in the same tree shard, so threads working on different
+ * prefixes never share a lock.  The numbers this backend reports are
+ * the ceiling the harness itself allows.
+ */
+
+#define MEMDB_SHARDS 64
+
+struct tree_shard {
+	pthread_mutex_t mutex;
+	TCTREE *tree;
+};
+
+struct memdb {
+	TCMDB *mdb;
+	struct tree_shard shards[MEMDB_SHARDS];
+};
+
+/* Shared by all benchmark threads */
+static struct memdb *memdb;
+
+#define MEMDB_MAX_BNUM (1U << 26)
+
+static void *open_db(struct benchmark_config *config)
+{
+	unsigned long long bnum;
+	int i;
+
+	if (memdb)
+		return memdb;
+
+	bnum = (unsigned long long)config->num_works * config->num;
+	if (bnum > MEMDB_MAX_BNUM)
+		bnum = MEMDB_MAX_BNUM;
+
+	memdb = xmalloc(sizeof(*memdb));
+	memdb->mdb = tcmdbnew2(bnum);
+
+	for (i = 0; i < MEMDB_SHARDS; i++) {
+		pthread_mutex_init(&memdb->shards[i].mutex, NULL);
+		memdb->shards[i].tree = tctreenew();
+	}
+
+	return memdb;
+}
+
+static void close_db(void *db)
+{
+	int i;
+
+	if (memdb != db)
+		return;
+
+	for (i = 0; i < MEMDB_SHARDS; i++) {
+		tctreedel(memdb->shards[i].tree);
+		pthread_mutex_destroy(&memdb->shards[i].mutex);
+	}
+	tcmdbdel(memdb->mdb);
+	free(memdb);
+	memdb = NULL;
+}
+
+static struct tree_shard *tree_shard(struct memdb *mem, const char *key,
+				int ksiz)
+{
+	unsigned int hash = 2166136261U;
+	int i;
+
+	if (ksiz > KEYGEN_PREFIX_SIZE)
+		ksiz = KEYGEN_PREFIX_SIZE;
+
+	for (i = 0; i < ksiz; i++)
+		hash = (hash ^ (unsigned char)key[i]) * 16777619U;
+
+	return &mem->shards[hash % MEMDB_SHARDS];
+}
+
+static void mem_put(struct memdb *mem, TCTREE *tree, const char *key,
+		const char *value, int vsiz)
+{
+	int ksiz = strlen(key);
+
+	tcmdbput(mem->mdb, key, ksiz, value, vsiz);
+	tctreeput(tree, key, ksiz, value, vsiz);
+}
+
+static void mem_out(struct memdb *mem, TCTREE *tree, const char *key, int ksiz)
+{
+	tcmdbout(mem->mdb, key, ksiz);
+	tctreeout(tree, key, ksiz);
+}
+
+static void put_test(void *db, int num, int vsiz, unsigned int seed)
+{
+	struct memdb *mem = db;
+	struct keygen keygen;
+	char *value = xmalloc(vsiz);
+	int i;
+
+	keygen_init(&keygen, seed);
+
+	for (i = 0; i < num; i++) {
+		const char *key = keygen_next_key(&keygen);
+		struct tree_shard *shard = tree_shard(mem, key, strlen(key));
+
+		pthread_mutex_lock(&shard->mutex);
+		mem_put(mem, shard->tree, key, value, vsiz);
+		pthread_mutex_unlock(&shard->mutex);
+	}
+
+	free(value);
+}
+
+static void get_test(void *db, int num, int vsiz, unsigned int seed)
+{
+	struct memdb *mem = db;
+	struct keygen keygen;
+	int i;
+
+	keygen_init(&keygen, seed);
+
+	for (i = 0; i < num; i++) {
+		const char *key = keygen_next_key(&keygen);
+		void *value;
+		int siz = 0;
+
+		value = tcmdbget(mem->mdb, key, strlen(key), &siz);
+		if (debug && !value)
+			die("No record: %s", key);
+		if (debug && vsiz != siz)
+			die("Unexpected value size: %d", siz);
+
+		free(value);
+	}
+}
+
+/*
+ * Batched tests take the tree shard lock once per batch, which is what
+ * the atomic variants of the remote backends amount to.
+ */
+static void putlist_test(void *db, const char *command, int num, int vsiz,
+			int batch, unsigned int seed)
+{
+	struct memdb *mem = db;
+	struct keygen keygen;
+	char *value = xmalloc(vsiz);
+	struct tree_shard *shard;
+	char prefix[KEYGEN_PREFIX_SIZE + 1];
+	unsigned long long start;
+	int i, n;
+
+	keygen_init(&keygen, seed);
+	keygen_prefix(&keygen, prefix);
+	shard = tree_shard(mem, prefix, KEYGEN_PREFIX_SIZE);
+
+	for (i = 0; i < num; i += n) {
+		start = batch_start();
+
+		pthread_mutex_lock(&shard->mutex);
+		for (n = 0; n < batch && i + n < num; n++) {
+			mem_put(mem, shard->tree, keygen_next_key(&keygen),
+				value, vsiz);
+		}
+		pthread_mutex_unlock(&shard->mutex);
+
+		batch = batch_end(batch, n, start);
+	}
+
+	free(value);
+}
+
+static void check_keys(TCLIST *list, int num, unsigned int seed)
+{
+	int i;
+	struct keygen keygen;
+
+	if (!debug)
+		return;
+
+	keygen_init(&keygen, seed);
+
+	if (num != tclistnum(list))
+		die("Unexpected key num: %d", tclistnum(list));
+
+	for (i = 0; i < num; i++) {
+		int ksiz;
+		const char *key = tclistval(list, i, &ksiz);
+
+		if (strncmp(keygen_next_key(&keygen), key, ksiz))
+			die("Unexpected key");
+	}
+}
+
+static void fwmkeys_test(void *db, int num, unsigned int seed)
+{
+	struct memdb *mem = db;
+	struct keygen keygen;
+	char prefix[KEYGEN_PREFIX_SIZE + 1];
+	struct tree_shard *shard;
+	TCLIST *list = tclistnew();
+	const char *key;
+	int ksiz;
+
+	keygen_init(&keygen, seed);
+	keygen_prefix(&keygen, prefix);
+	shard = tree_shard(mem, prefix, KEYGEN_PREFIX_SIZE);
+
+	pthread_mutex_lock(&shard->mutex);
+	tctreeiterinit2(shard->tree, prefix, KEYGEN_PREFIX_SIZE);
+	while ((key = tctreeiternext(shard->tree, &ksiz)) != NULL) {
+		if (ksiz < KEYGEN_PREFIX_SIZE ||
+		    memcmp(key, prefix, KEYGEN_PREFIX_SIZE))
+			break;
+		tclistpush(list, key, ksiz);
+	}
+	pthread_mutex_unlock(&shard->mutex);
+
+	check_keys(list, num, seed);
+	tclistdel(list);
+}
+
+static void getlist_test(void *db, const char *command, int num, int vsiz,
+			int batch, unsigned int seed)
+{
+	struct memdb *mem = db;
+	struct keygen keygen;
+	unsigned long long start;
+	int i, n;
+
+	keygen_init(&keygen, seed);
+
+	for (i = 0; i < num; i += n) {
+		start = batch_start();
+
+		for (n = 0; n < batch && i + n < num; n++) {
+			const char *key = keygen_next_key(&keygen);
+			void *value;
+			int siz = 0;
+
+			value = tcmdbget(mem->mdb, key, strlen(key), &siz);
+			if (debug && !value)
+				die("No record: %s", key);
+			if (debug && vsiz != siz)
+				die("Unexpected value size: %d", siz);
+			free(value);
+		}
+
+		batch = batch_end(batch, n, start);
+	}
+}
+
+static void range_test(void *db, const char *command, int num, int vsiz,
+			int batch, unsigned int seed)
+{
+	struct memdb *mem = db;
+	struct keygen keygen;
+	char prefix[KEYGEN_PREFIX_SIZE + 1];
+	char last[KEYGEN_KEY_SIZE];
+	int lsiz = KEYGEN_PREFIX_SIZE;
+	struct tree_shard *shard;
+	int nrecs = 0;
+
+	keygen_init(&keygen, seed);
+	keygen_prefix(&keygen, prefix);
+	memcpy(last, prefix, KEYGEN_PREFIX_SIZE);
+	shard = tree_shard(mem, prefix, KEYGEN_PREFIX_SIZE);
+
+	while (1) {
+		unsigned long long start = batch_start();
+		const char *key;
+		int ksiz, n = 0;
+
+		/* Resume right after the last key of the previous batch */
+		pthread_mutex_lock(&shard->mutex);
+		tctreeiterinit2(shard->tree, last, lsiz);
+		while (n < batch &&
+		       (key = tctreeiternext(shard->tree, &ksiz)) != NULL) {
+			int siz;
+
+			if (ksiz < KEYGEN_PREFIX_SIZE ||
+			    memcmp(key, prefix, KEYGEN_PREFIX_SIZE))
+				break;
+			if (ksiz == lsiz && !memcmp(key, last, lsiz))
+				continue;
+
+			tctreeiterval(key, &siz);
+			if (debug && strncmp(keygen_next_key(&keygen), key, ksiz))
+				die("Unexpected key");
+			if (debug && siz != vsiz)
+				die("Unexpected value size %d", siz);
+
+			memcpy(last, key, ksiz);
+			lsiz = ksiz;
+			n++;
+		}
+		pthread_mutex_unlock(&shard->mutex);
+
+		if (!n)
+			break;
+		nrecs += n;
+		batch = batch_end(batch, n, start);
+	}
+	if (debug && num != nrecs)
+		die("Unexpected record num: %d", nrecs);
+}
+
+static void rangeout_test(void *db, const char *command, int num, int vsiz,
+			int batch, unsigned int seed)
+{
+	struct memdb *mem = db;
+	struct keygen keygen;
+	char prefix[KEYGEN_PREFIX_SIZE + 1];
+	struct tree_shard *shard;
+	TCLIST *keys = tclistnew();
+	int nrecs = 0;
+
+	keygen_init(&keygen, seed);
+	keygen_prefix(&keygen, prefix);
+	shard = tree_shard(mem, prefix, KEYGEN_PREFIX_SIZE);
+
+	while (1) {
+		unsigned long long start = batch_start();
+		const char *key;
+		int ksiz, i;
+
+		pthread_mutex_lock(&shard->mutex);
+		tctreeiterinit2(shard->tree, prefix, KEYGEN_PREFIX_SIZE);
+		while (tclistnum(keys) < batch &&
+		       (key = tctreeiternext(shard->tree, &ksiz)) != NULL) {
+			if (ksiz < KEYGEN_PREFIX_SIZE ||
+			    memcmp(key, prefix, KEYGEN_PREFIX_SIZE))
+				break;
+			tclistpush(keys, key, ksiz);
+		}
+		for (i = 0; i < tclistnum(keys); i++) {
+			key = tclistval(keys, i, &ksiz);
+			mem_out(mem, shard->tree, key, ksiz);
+		}
+		pthread_mutex_unlock(&shard->mutex);
+
+		if (!tclistnum(keys))
+			break;
+		nrecs += tclistnum(keys);
+		batch = batch_end(batch, tclistnum(keys), start);
+		tclistclear(keys);
+	}
+	if (debug && num != nrecs)
+		die("Unexpected number of records are deleted");
+
+	tclistdel(keys);
+}
+
+static void outlist_test(void *db, const char *command, int num, int batch,
+			unsigned int seed)
+{
+	struct memdb *mem = db;
+	struct keygen keygen;
+	char prefix[KEYGEN_PREFIX_SIZE + 1];
+	struct tree_shard *shard;
+	unsigned long long start;
+	int i, n;
+
+	keygen_init(&keygen, seed);
+	keygen_prefix(&keygen, prefix);
+	shard = tree_shard(mem, prefix, KEYGEN_PREFIX_SIZE);
+
+	for (i = 0; i < num; i += n) {
+		start = batch_start();
+
+		pthread_mutex_lock(&shard->mutex);
+		for (n = 0; n < batch && i + n < num; n++) {
+			const char *key = keygen_next_key(&keygen);
+
+			mem_out(mem, shard->tree, key, strlen(key));
+		}
+		pthread_mutex_unlock(&shard->mutex);
+
+		batch = batch_end(batch, n, start);
+	}
+}
+
+static struct benchmark_config config = {
+	.producer = "nop",
+	.consumer = "nop",
+	.num = 5000000,
+	.vsiz = 100,
+	.batch = 1000,
+	.producer_thnum = 1,
+	.consumer_thnum = 1,
+	.debug = false,
+	.verbose = 1,
+	.ops = {
+		.open_db = open_db,
+		.close_db = close_db,
+		.put_test = put_test,
+		.get_test = get_test,
+		.putlist_test = putlist_test,
+		.fwmkeys_test = fwmkeys_test,
+		.getlist_test = getlist_test,
+		.range_test = range_test,
+		.rangeout_test = rangeout_test,
+		.outlist_test = outlist_test,
+	},
+};
+
+static void setup(struct benchmark_config *config)
+{
+	debug = config->debug;
+}
+
+#ifdef BENCHMARK_PLUGIN
+
+static void init_config(struct benchmark_config *plugin_config)
+{
+	*plugin_config = config;
+}
+
+struct benchmark_plugin benchmark_plugin = {
+	.name = "membench",
+	.init = init_config,
+	.setup = setup,
+};
+
+#else
+
+int main(int argc, char **argv)
+{
+	parse_options(&config, argc, argv);
+	setup(&config);
+	benchmark(&config);
+
+	return 0;
+}
+
+#endif
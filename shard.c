@@ -0,0 +1,457 @@
+#include <tcutil.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "testutil.h"
+#include "shard.h"
+
+#define KETAMA_POINTS_PER_HASH 4
+#define KETAMA_POINTS 160
+
+struct shard_endpoint {
+	char *host;
+	int port;
+	/* Records of the counters destroyed since the last report */
+	unsigned long long nrecs;
+};
+
+/*
+ * Every benchmark handle counts its records in a counter of its own, so
+ * that the key lookups don't share a cache line across threads.  Only
+ * the thread running the handle's part for a shard writes its entry.
+ */
+struct shard_counter {
+	struct shard_ring *ring;
+	unsigned long long *nrecs;
+	struct shard_counter *next;
+};
+
+struct ketama_point {
+	uint32_t hash;
+	int shard;
+};
+
+struct shard_ring {
+	bool jump;
+	int nr_shards;
+	struct shard_endpoint *endpoints;
+	int nr_points;
+	struct ketama_point *points;
+
+	pthread_mutex_t counters_mutex;
+	struct shard_counter *counters;
+};
+
+/* tcmd5hash() returns the digest in lower case hex */
+static int hex_digit(char c)
+{
+	return c <= '9' ? c - '0' : c - 'a' + 10;
+}
+
+static void md5_digest(const void *ptr, int size, unsigned char *digest)
+{
+	char hex[33];
+	int i;
+
+	tcmd5hash(ptr, size, hex);
+	for (i = 0; i < 16; i++)
+		digest[i] = hex_digit(hex[i * 2]) << 4 | hex_digit(hex[i * 2 + 1]);
+}
+
+static uint32_t ketama_point_hash(const unsigned char *digest, int n)
+{
+	return ((uint32_t)digest[3 + n * 4] << 24) |
+		((uint32_t)digest[2 + n * 4] << 16) |
+		((uint32_t)digest[1 + n * 4] << 8) |
+		digest[n * 4];
+}
+
+static int cmp_point(const void *a, const void *b)
+{
+	const struct ketama_point *pa = a, *pb = b;
+
+	if (pa->hash != pb->hash)
+		return pa->hash < pb->hash ? -1 : 1;
+	return pa->shard - pb->shard;
+}
+
+static void ketama_build(struct shard_ring *ring)
+{
+	int i, j, k;
+
+	ring->nr_points = ring->nr_shards * KETAMA_POINTS;
+	ring->points = xmalloc(sizeof(*ring->points) * ring->nr_points);
+
+	for (i = 0, k = 0; i < ring->nr_shards; i++) {
+		struct shard_endpoint *ep = &ring->endpoints[i];
+
+		for (j = 0; j < KETAMA_POINTS / KETAMA_POINTS_PER_HASH; j++) {
+			unsigned char digest[16];
+			char name[300];
+			int n, len;
+
+			len = snprintf(name, sizeof(name), "%s:%d-%d",
+					ep->host, ep->port, j);
+			md5_digest(name, len, digest);
+
+			for (n = 0; n < KETAMA_POINTS_PER_HASH; n++, k++) {
+				ring->points[k].hash = ketama_point_hash(digest, n);
+				ring->points[k].shard = i;
+			}
+		}
+	}
+	qsort(ring->points, ring->nr_points, sizeof(*ring->points), cmp_point);
+}
+
+static int ketama_lookup(struct shard_ring *ring, const char *key, int ksiz)
+{
+	unsigned char digest[16];
+	uint32_t hash;
+	int lo = 0, hi = ring->nr_points;
+
+	md5_digest(key, ksiz, digest);
+	hash = ketama_point_hash(digest, 0);
+
+	/* First point at or after the key's hash, wrapping around */
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+
+		if (ring->points[mid].hash < hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == ring->nr_points)
+		lo = 0;
+
+	return ring->points[lo].shard;
+}
+
+static uint64_t fnv1a_64(const char *key, int ksiz)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	int i;
+
+	for (i = 0; i < ksiz; i++)
+		hash = (hash ^ (unsigned char)key[i]) * 1099511628211ULL;
+
+	return hash;
+}
+
+static int jump_lookup(struct shard_ring *ring, const char *key, int ksiz)
+{
+	uint64_t hash = fnv1a_64(key, ksiz);
+	int64_t b = -1, j = 0;
+
+	while (j < ring->nr_shards) {
+		b = j;
+		hash = hash * 2862933555777941757ULL + 1;
+		j = (b + 1) * ((double)(1LL << 31) / (double)((hash >> 33) + 1));
+	}
+
+	return b;
+}
+
+static void parse_endpoint(struct shard_endpoint *ep, const char *str,
+			int len, int default_port)
+{
+	const char *colon = memchr(str, ':', len);
+	int hlen = colon ? colon - str : len;
+
+	if (!hlen)
+		die("Invalid endpoint: %.*s", len, str);
+
+	ep->host = xmalloc(hlen + 1);
+	memcpy(ep->host, str, hlen);
+	ep->host[hlen] = '\0';
+	ep->port = colon ? atoi(colon + 1) : default_port;
+	ep->nrecs = 0;
+}
+
+struct shard_ring *shard_ring_create(const char *hosts, const char *host,
+				int port, const char *hash)
+{
+	struct shard_ring *ring = xmalloc(sizeof(*ring));
+	const char *p;
+
+	memset(ring, 0, sizeof(*ring));
+	pthread_mutex_init(&ring->counters_mutex, NULL);
+
+	if (!hash || !strcmp(hash, "ketama"))
+		ring->jump = false;
+	else if (!strcmp(hash, "jump"))
+		ring->jump = true;
+	else
+		die("Invalid shard hash: %s", hash);
+
+	if (!hosts) {
+		ring->nr_shards = 1;
+		ring->endpoints = xmalloc(sizeof(*ring->endpoints));
+		ring->endpoints[0].host = strdup(host);
+		ring->endpoints[0].port = port;
+		ring->endpoints[0].nrecs = 0;
+		return ring;
+	}
+
+	for (p = hosts; p; p = strchr(p, ',')) {
+		const char *end;
+
+		if (*p == ',')
+			p++;
+		end = strchr(p, ',');
+
+		ring->endpoints = realloc(ring->endpoints,
+			sizeof(*ring->endpoints) * (ring->nr_shards + 1));
+		if (!ring->endpoints)
+			die("realloc: out of memory");
+
+		parse_endpoint(&ring->endpoints[ring->nr_shards++], p,
+				end ? end - p : strlen(p), port);
+	}
+
+	if (!ring->jump && ring->nr_shards > 1)
+		ketama_build(ring);
+
+	return ring;
+}
+
+void shard_ring_destroy(struct shard_ring *ring)
+{
+	int i;
+
+	for (i = 0; i < ring->nr_shards; i++)
+		free(ring->endpoints[i].host);
+	free(ring->endpoints);
+	free(ring->points);
+	pthread_mutex_destroy(&ring->counters_mutex);
+	free(ring);
+}
+
+int shard_ring_size(struct shard_ring *ring)
+{
+	return ring->nr_shards;
+}
+
+const char *shard_ring_host(struct shard_ring *ring, int shard)
+{
+	return ring->endpoints[shard].host;
+}
+
+int shard_ring_port(struct shard_ring *ring, int shard)
+{
+	return ring->endpoints[shard].port;
+}
+
+int shard_ring_lookup(struct shard_ring *ring, const char *key, int ksiz)
+{
+	if (ring->nr_shards == 1)
+		return 0;
+	if (ring->jump)
+		return jump_lookup(ring, key, ksiz);
+
+	return ketama_lookup(ring, key, ksiz);
+}
+
+struct shard_counter *shard_counter_create(struct shard_ring *ring)
+{
+	struct shard_counter *counter = xmalloc(sizeof(*counter));
+	size_t size = sizeof(*counter->nrecs) * ring->nr_shards;
+
+	counter->ring = ring;
+	counter->nrecs = xmalloc(size);
+	memset(counter->nrecs, 0, size);
+
+	pthread_mutex_lock(&ring->counters_mutex);
+	counter->next = ring->counters;
+	ring->counters = counter;
+	pthread_mutex_unlock(&ring->counters_mutex);
+
+	return counter;
+}
+
+void shard_counter_destroy(struct shard_counter *counter)
+{
+	struct shard_ring *ring = counter->ring;
+	struct shard_counter **p;
+	int i;
+
+	pthread_mutex_lock(&ring->counters_mutex);
+	for (p = &ring->counters; *p != counter; p = &(*p)->next)
+		;
+	*p = counter->next;
+	for (i = 0; i < ring->nr_shards; i++)
+		ring->endpoints[i].nrecs += counter->nrecs[i];
+	pthread_mutex_unlock(&ring->counters_mutex);
+
+	free(counter->nrecs);
+	free(counter);
+}
+
+void shard_counter_add(struct shard_counter *counter, int shard,
+			unsigned long long nrecs)
+{
+	/* There is no skew to report with a single endpoint */
+	if (counter->ring->nr_shards > 1)
+		counter->nrecs[shard] += nrecs;
+}
+
+/*
+ * Print the records every shard handled since the last report and the
+ * max/mean skew, then start counting again.  The counters are summed
+ * without synchronizing with their owners, which are idle between runs.
+ */
+void shard_ring_report(struct shard_ring *ring)
+{
+	unsigned long long total = 0, max = 0;
+	struct shard_counter *counter;
+	int i;
+
+	if (ring->nr_shards < 2)
+		return;
+
+	pthread_mutex_lock(&ring->counters_mutex);
+	for (counter = ring->counters; counter; counter = counter->next) {
+		for (i = 0; i < ring->nr_shards; i++) {
+			ring->endpoints[i].nrecs += counter->nrecs[i];
+			counter->nrecs[i] = 0;
+		}
+	}
+	pthread_mutex_unlock(&ring->counters_mutex);
+
+	for (i = 0; i < ring->nr_shards; i++) {
+		unsigned long long nrecs = ring->endpoints[i].nrecs;
+
+		total += nrecs;
+		if (nrecs > max)
+			max = nrecs;
+	}
+
+	printf("# shard endpoint records share(%%)\n");
+	for (i = 0; i < ring->nr_shards; i++) {
+		struct shard_endpoint *ep = &ring->endpoints[i];
+
+		printf("# shard %s:%d %llu %.1f\n", ep->host, ep->port,
+			ep->nrecs, total ? 100.0 * ep->nrecs / total : 0.0);
+		ep->nrecs = 0;
+	}
+	printf("# shard skew %.2f (max/mean over %d shards)\n",
+		total ? (double)max * ring->nr_shards / total : 0.0,
+		ring->nr_shards);
+}
+
+struct fanout_thread {
+	struct shard_fanout *fanout;
+	int shard;
+	pthread_t tid;
+};
+
+struct shard_fanout {
+	int nr_shards;
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	void (*fn)(int shard, void *arg);
+	void *arg;
+	struct batch_tuner *tuner;
+	unsigned long generation;
+	int pending;
+	bool stop;
+	struct fanout_thread *threads;
+};
+
+static void *fanout_thread(void *arg)
+{
+	struct fanout_thread *thread = arg;
+	struct shard_fanout *fanout = thread->fanout;
+	unsigned long generation = 0;
+
+	while (1) {
+		pthread_mutex_lock(&fanout->mutex);
+		while (!fanout->stop && fanout->generation == generation)
+			pthread_cond_wait(&fanout->work_cond, &fanout->mutex);
+		if (fanout->stop) {
+			pthread_mutex_unlock(&fanout->mutex);
+			break;
+		}
+		generation = fanout->generation;
+		pthread_mutex_unlock(&fanout->mutex);
+
+		/* The shard's batches count for the caller's command */
+		batch_tuner_attach(fanout->tuner);
+		fanout->fn(thread->shard, fanout->arg);
+
+		pthread_mutex_lock(&fanout->mutex);
+		if (!--fanout->pending)
+			pthread_cond_signal(&fanout->done_cond);
+		pthread_mutex_unlock(&fanout->mutex);
+	}
+
+	return NULL;
+}
+
+struct shard_fanout *shard_fanout_create(int nr_shards)
+{
+	struct shard_fanout *fanout = xmalloc(sizeof(*fanout));
+	int i;
+
+	memset(fanout, 0, sizeof(*fanout));
+	fanout->nr_shards = nr_shards;
+	pthread_mutex_init(&fanout->mutex, NULL);
+	pthread_cond_init(&fanout->work_cond, NULL);
+	pthread_cond_init(&fanout->done_cond, NULL);
+
+	fanout->threads = xmalloc(sizeof(*fanout->threads) * nr_shards);
+	for (i = 1; i < nr_shards; i++) {
+		fanout->threads[i].fanout = fanout;
+		fanout->threads[i].shard = i;
+		xpthread_create(&fanout->threads[i].tid, fanout_thread,
+				&fanout->threads[i]);
+	}
+
+	return fanout;
+}
+
+void shard_fanout_destroy(struct shard_fanout *fanout)
+{
+	int i;
+
+	pthread_mutex_lock(&fanout->mutex);
+	fanout->stop = true;
+	pthread_cond_broadcast(&fanout->work_cond);
+	pthread_mutex_unlock(&fanout->mutex);
+
+	for (i = 1; i < fanout->nr_shards; i++)
+		xpthread_join(fanout->threads[i].tid);
+
+	pthread_cond_destroy(&fanout->done_cond);
+	pthread_cond_destroy(&fanout->work_cond);
+	pthread_mutex_destroy(&fanout->mutex);
+	free(fanout->threads);
+	free(fanout);
+}
+
+void shard_fanout_run(struct shard_fanout *fanout,
+		void (*fn)(int shard, void *arg), void *arg)
+{
+	if (fanout->nr_shards == 1) {
+		fn(0, arg);
+		return;
+	}
+
+	pthread_mutex_lock(&fanout->mutex);
+	fanout->fn = fn;
+	fanout->arg = arg;
+	fanout->tuner = batch_tuner_self();
+	fanout->pending = fanout->nr_shards - 1;
+	fanout->generation++;
+	pthread_cond_broadcast(&fanout->work_cond);
+	pthread_mutex_unlock(&fanout->mutex);
+
+	fn(0, arg);
+
+	pthread_mutex_lock(&fanout->mutex);
+	while (fanout->pending)
+		pthread_cond_wait(&fanout->done_cond, &fanout->mutex);
+	pthread_mutex_unlock(&fanout->mutex);
+}
@@ -0,0 +1,51 @@
+/*
+ * Client-side sharding over several server instances
+ *
+ * A shard ring is built from "-hosts host:port,host:port,..." (or the
+ * single -host/-port endpoint) and maps every key to one endpoint with
+ * either hash:
+ *
+ *	ketama	libketama compatible continuum, 160 points per endpoint
+ *		taken from md5("host:port-N"), keys hashed with md5
+ *	jump	Lamping and Veach's jump consistent hash over the
+ *		endpoint list order, keys hashed with 64-bit FNV-1a
+ *
+ * Every benchmark handle counts the records it routes to (or scans
+ * from) every shard in a shard_counter of the ring, so that load skew
+ * can be reported after each run.  A counter is written only by its
+ * handle, one thread per shard.
+ */
+
+struct shard_ring;
+
+struct shard_ring *shard_ring_create(const char *hosts, const char *host,
+				int port, const char *hash);
+void shard_ring_destroy(struct shard_ring *ring);
+int shard_ring_size(struct shard_ring *ring);
+const char *shard_ring_host(struct shard_ring *ring, int shard);
+int shard_ring_port(struct shard_ring *ring, int shard);
+int shard_ring_lookup(struct shard_ring *ring, const char *key, int ksiz);
+void shard_ring_report(struct shard_ring *ring);
+
+struct shard_counter;
+
+struct shard_counter *shard_counter_create(struct shard_ring *ring);
+void shard_counter_destroy(struct shard_counter *counter);
+void shard_counter_add(struct shard_counter *counter, int shard,
+			unsigned long long nrecs);
+
+/*
+ * Parallel fan-out to every shard
+ *
+ * Each fan-out owns one persistent thread per shard except the first,
+ * whose part runs on the caller.  shard_fanout_run() calls fn(shard, arg)
+ * for every shard concurrently and returns once all of them returned.
+ * A fan-out is not shared, every benchmark handle creates its own.
+ */
+
+struct shard_fanout;
+
+struct shard_fanout *shard_fanout_create(int nr_shards);
+void shard_fanout_destroy(struct shard_fanout *fanout);
+void shard_fanout_run(struct shard_fanout *fanout,
+		void (*fn)(int shard, void *arg), void *arg);
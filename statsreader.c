@@ -0,0 +1,305 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <err.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "livestats.h"
+
+static void die(const char *err, ...)
+{
+	va_list params;
+
+	va_start(params, err);
+	verrx(EXIT_FAILURE, err, params);
+	va_end(params);
+}
+
+static int interval = 1;
+static int listen_port;
+static const char *stats_path;
+
+static void parse_options(int argc, char **argv)
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "i:l:")) != -1) {
+		switch (c) {
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case 'l':
+			listen_port = atoi(optarg);
+			break;
+		default:
+			die("usage: statsreader [-i interval] [-l port] file");
+		}
+	}
+	if (optind >= argc)
+		die("usage: statsreader [-i interval] [-l port] file");
+
+	stats_path = argv[optind];
+	if (interval < 1)
+		interval = 1;
+}
+
+struct snapshot {
+	struct livestats_header header;
+	struct livestats_thread *threads;
+	bool *stale;
+};
+
+/*
+ * Copy a consistent view of every thread slot, slots that stay in the
+ * middle of an update are marked stale.  Returns false if the file does
+ * not exist yet or is not a stats file we understand.
+ */
+static bool read_snapshot(struct snapshot *snap)
+{
+	struct livestats_header *header;
+	struct stat st;
+	void *map;
+	int fd;
+	int i;
+
+	fd = open(stats_path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(*header)) {
+		close(fd);
+		return false;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+
+	header = map;
+	if (header->magic != LIVESTATS_MAGIC ||
+	    header->version != LIVESTATS_VERSION ||
+	    header->thread_size < sizeof(struct livestats_thread) ||
+	    st.st_size < header->header_size +
+			(off_t)header->thread_size * header->nthreads) {
+		munmap(map, st.st_size);
+		return false;
+	}
+
+	snap->header = *header;
+	snap->threads = realloc(snap->threads,
+			sizeof(struct livestats_thread) * header->nthreads);
+	snap->stale = realloc(snap->stale,
+			sizeof(*snap->stale) * header->nthreads);
+	if (!snap->threads || !snap->stale)
+		die("realloc: out of memory");
+
+	for (i = 0; i < header->nthreads; i++) {
+		const char *slot = (const char *)map + header->header_size +
+					header->thread_size * i;
+
+		snap->stale[i] = !livestats_read_slot(
+				(const struct livestats_thread *)slot,
+				&snap->threads[i]);
+	}
+	munmap(map, st.st_size);
+
+	return true;
+}
+
+/* Upper bound in microseconds of the bucket holding the q-quantile */
+static unsigned long long hist_quantile(const uint64_t *hist, double q)
+{
+	unsigned long long total = 0, sum = 0;
+	int i;
+
+	for (i = 0; i < LIVESTATS_HIST_BUCKETS; i++)
+		total += hist[i];
+	if (!total)
+		return 0;
+
+	for (i = 0; i < LIVESTATS_HIST_BUCKETS; i++) {
+		sum += hist[i];
+		if (sum >= total * q)
+			break;
+	}
+	return 1ULL << i;
+}
+
+static void print_snapshot(struct snapshot *cur, struct snapshot *prev)
+{
+	int i;
+
+	printf("# id role command works ops/s MB/s p50(us) p99(us)\n");
+
+	for (i = 0; i < cur->header.nthreads; i++) {
+		struct livestats_thread *t = &cur->threads[i];
+		struct livestats_thread zero;
+		struct livestats_thread *p = &zero;
+		uint64_t hist[LIVESTATS_HIST_BUCKETS];
+		int j;
+
+		if (cur->stale[i]) {
+			printf("%d %s %s stale\n", t->id, t->role, t->command);
+			continue;
+		}
+
+		memset(&zero, 0, sizeof(zero));
+		if (prev && prev->header.start_us == cur->header.start_us &&
+		    i < prev->header.nthreads && !prev->stale[i])
+			p = &prev->threads[i];
+
+		for (j = 0; j < LIVESTATS_HIST_BUCKETS; j++)
+			hist[j] = t->hist[j] - p->hist[j];
+
+		printf("%d %s %s %llu %llu %llu.%03llu %llu %llu\n", t->id,
+			t->role, t->command,
+			(unsigned long long)t->works,
+			(unsigned long long)(t->ops - p->ops) / interval,
+			(unsigned long long)(t->bytes - p->bytes) / interval
+				/ 1000000,
+			(unsigned long long)(t->bytes - p->bytes) / interval
+				/ 1000 % 1000,
+			hist_quantile(hist, 0.5), hist_quantile(hist, 0.99));
+	}
+	fflush(stdout);
+}
+
+static void print_loop(void)
+{
+	struct snapshot snap[2];
+	int cur = 0;
+	bool have_prev = false;
+
+	memset(snap, 0, sizeof(snap));
+
+	while (1) {
+		if (read_snapshot(&snap[cur])) {
+			print_snapshot(&snap[cur],
+					have_prev ? &snap[!cur] : NULL);
+			have_prev = true;
+			cur = !cur;
+		}
+		sleep(interval);
+	}
+}
+
+static void write_metrics(FILE *out, struct snapshot *snap)
+{
+	int i, j;
+
+	fprintf(out, "# TYPE kvbench_ops_total counter\n");
+	fprintf(out, "# TYPE kvbench_bytes_total counter\n");
+	fprintf(out, "# TYPE kvbench_work_latency_us histogram\n");
+	fprintf(out, "# TYPE kvbench_stale gauge\n");
+
+	for (i = 0; i < snap->header.nthreads; i++) {
+		struct livestats_thread *t = &snap->threads[i];
+		char labels[128];
+		unsigned long long cum = 0;
+
+		snprintf(labels, sizeof(labels),
+			"thread=\"%d\",role=\"%s\",command=\"%s\"",
+			t->id, t->role, t->command);
+
+		/* A stale slot's counters may be torn, leave them out */
+		fprintf(out, "kvbench_stale{%s} %d\n", labels, snap->stale[i]);
+		if (snap->stale[i])
+			continue;
+
+		fprintf(out, "kvbench_ops_total{%s} %llu\n", labels,
+			(unsigned long long)t->ops);
+		fprintf(out, "kvbench_bytes_total{%s} %llu\n", labels,
+			(unsigned long long)t->bytes);
+		/*
+		 * Bucket j holds whole microseconds below 2^j, the last one
+		 * also everything larger, so it only has the +Inf bound.
+		 */
+		for (j = 0; j < LIVESTATS_HIST_BUCKETS - 1; j++) {
+			cum += t->hist[j];
+			fprintf(out,
+				"kvbench_work_latency_us_bucket{%s,le=\"%llu\"} %llu\n",
+				labels, (1ULL << j) - 1, cum);
+		}
+		cum += t->hist[j];
+		fprintf(out, "kvbench_work_latency_us_bucket{%s,le=\"+Inf\"} %llu\n",
+			labels, cum);
+		fprintf(out, "kvbench_work_latency_us_sum{%s} %llu\n", labels,
+			(unsigned long long)t->elapsed_us);
+		fprintf(out, "kvbench_work_latency_us_count{%s} %llu\n", labels,
+			(unsigned long long)t->works);
+	}
+}
+
+static void serve_loop(void)
+{
+	struct sockaddr_in addr;
+	struct snapshot snap;
+	int sockfd;
+	int on = 1;
+
+	memset(&snap, 0, sizeof(snap));
+
+	sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (sockfd < 0)
+		die("socket failed");
+	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	/* Local scrapers only */
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(listen_port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		die("bind failed: port %d", listen_port);
+	if (listen(sockfd, 16) < 0)
+		die("listen failed");
+
+	while (1) {
+		char request[4096];
+		FILE *out;
+		int fd;
+
+		fd = accept(sockfd, NULL, NULL);
+		if (fd < 0)
+			continue;
+		/* The request itself does not matter, every path is /metrics */
+		if (read(fd, request, sizeof(request)) < 0) {
+			close(fd);
+			continue;
+		}
+		out = fdopen(fd, "w");
+		if (!out) {
+			close(fd);
+			continue;
+		}
+		if (read_snapshot(&snap)) {
+			fprintf(out, "HTTP/1.0 200 OK\r\n"
+				"Content-Type: text/plain; version=0.0.4\r\n"
+				"\r\n");
+			write_metrics(out, &snap);
+		} else {
+			fprintf(out, "HTTP/1.0 503 Service Unavailable\r\n\r\n");
+		}
+		fclose(out);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	parse_options(argc, argv);
+
+	if (listen_port)
+		serve_loop();
+	else
+		print_loop();
+
+	return 0;
+}
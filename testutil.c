@@ -1,12 +1,16 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
 #include <stdarg.h>
 #include <err.h>
+#include <unistd.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <tcutil.h>
 #include "testutil.h"
+#include "livestats.h"
 
 void die(const char *err, ...)
 {
@@ -103,6 +107,18 @@ void keygen_init(struct keygen *keygen, unsigned int seed)
 		keygen_sequence_init(keygen, seed);
 }
 
+#define _MIN(x, y) ({				\
+	typeof(x) _min1 = (x);			\
+	typeof(y) _min2 = (y);			\
+	(void) (&_min1 == &_min2);		\
+	_min1 < _min2 ? _min1 : _min2; })
+
+#define _MAX(x, y) ({				\
+	typeof(x) _max1 = (x);			\
+	typeof(y) _max2 = (y);			\
+	(void) (&_max1 == &_max2);		\
+	_max1 > _max2 ? _max1 : _max2; })
+
 static unsigned long long tv_to_us(const struct timeval *tv)
 {
 	unsigned long long us = tv->tv_usec;
@@ -128,14 +144,231 @@ static unsigned long long stopwatch_stop(unsigned long long start)
 	return tv_to_us(&tv) - start;
 }
 
+/*
+ * Adaptive batch sizing
+ *
+ * Every batched backend loop reports the latency of each batch it
+ * issues to the tuner of the command its thread runs, so that every
+ * command finds its own size.  Once BATCH_WINDOW batches have
+ * completed, the p99 latency and throughput of that window decide the
+ * command's next batch size: additive increase while p99 stays under
+ * the SLO, multiplicative decrease otherwise.
+ */
+
+#define BATCH_WINDOW 64
+
+struct batch_tuner {
+	char *command;
+	pthread_mutex_t mutex;
+	int size;
+	unsigned long long window_start;
+	unsigned long long window_recs;
+	unsigned long long latency[BATCH_WINDOW];
+	int nr_latency;
+	int nr_windows;
+	int best_size;
+	unsigned long long best_rate;
+	struct batch_tuner *next;
+};
+
+/* Settings shared by the tuners of a run */
+static struct batch_tuning {
+	bool enabled;
+	pthread_mutex_t mutex;
+	unsigned long long slo_us;
+	int size;
+	int min;
+	int max;
+	int step;
+	unsigned long long origin;
+	struct batch_tuner *tuners;
+} batch_tuning = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* The tuner of the command the calling thread runs, if any */
+static __thread struct batch_tuner *batch_tuner;
+
+/* No worker runs between runs, so the old tuners can go */
+static void batch_tuner_init(struct benchmark_config *config)
+{
+	struct batch_tuning *tuning = &batch_tuning;
+
+	while (tuning->tuners) {
+		struct batch_tuner *bt = tuning->tuners;
+
+		tuning->tuners = bt->next;
+		pthread_mutex_destroy(&bt->mutex);
+		free(bt->command);
+		free(bt);
+	}
+
+	tuning->enabled = config->slo_ms > 0;
+	if (!tuning->enabled)
+		return;
+
+	tuning->slo_us = config->slo_ms * 1000;
+	tuning->size = config->batch;
+	tuning->min = 1;
+	tuning->max = config->batch_max;
+	tuning->step = config->batch / 8 > 0 ? config->batch / 8 : 1;
+	tuning->origin = stopwatch_start();
+
+	printf("# batch command time size p99(us) rec/s\n");
+}
+
+/* Returns NULL unless -slo-ms is given */
+static struct batch_tuner *batch_tuner_get(const char *command)
+{
+	struct batch_tuning *tuning = &batch_tuning;
+	struct batch_tuner **p;
+	struct batch_tuner *bt;
+
+	if (!tuning->enabled)
+		return NULL;
+
+	pthread_mutex_lock(&tuning->mutex);
+	for (p = &tuning->tuners; *p; p = &(*p)->next) {
+		if (!strcmp((*p)->command, command))
+			break;
+	}
+	bt = *p;
+	if (!bt) {
+		bt = xmalloc(sizeof(*bt));
+		memset(bt, 0, sizeof(*bt));
+		bt->command = strdup(command);
+		pthread_mutex_init(&bt->mutex, NULL);
+		bt->size = tuning->size;
+		bt->window_start = stopwatch_start();
+		bt->best_size = tuning->size;
+		*p = bt;
+	}
+	pthread_mutex_unlock(&tuning->mutex);
+
+	return bt;
+}
+
+struct batch_tuner *batch_tuner_self(void)
+{
+	return batch_tuner;
+}
+
+void batch_tuner_attach(struct batch_tuner *bt)
+{
+	batch_tuner = bt;
+}
+
+static int cmp_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void batch_tuner_adjust(struct batch_tuner *bt, unsigned long long now)
+{
+	struct batch_tuning *tuning = &batch_tuning;
+	unsigned long long p99, rate, t;
+
+	qsort(bt->latency, bt->nr_latency, sizeof(bt->latency[0]), cmp_ull);
+	p99 = bt->latency[(bt->nr_latency * 99 - 1) / 100];
+	rate = bt->window_recs * 1000000 / (now - bt->window_start + 1);
+
+	t = now - tuning->origin;
+	printf("# batch %s %lld.%03lld %d %llu %llu\n", bt->command,
+			t / 1000000, t / 1000 % 1000, bt->size, p99, rate);
+
+	if (p99 <= tuning->slo_us) {
+		if (rate > bt->best_rate) {
+			bt->best_rate = rate;
+			bt->best_size = bt->size;
+		}
+		bt->size = _MIN(bt->size + tuning->step, tuning->max);
+	} else {
+		bt->size = _MAX(bt->size / 2, tuning->min);
+	}
+
+	bt->window_start = now;
+	bt->window_recs = 0;
+	bt->nr_latency = 0;
+	bt->nr_windows++;
+}
+
+unsigned long long batch_start(void)
+{
+	if (!batch_tuner)
+		return 0;
+
+	return stopwatch_start();
+}
+
+int batch_end(int batch, int nrecs, unsigned long long start)
+{
+	struct batch_tuner *bt = batch_tuner;
+	unsigned long long now;
+
+	if (!bt)
+		return batch;
+
+	now = stopwatch_start();
+
+	pthread_mutex_lock(&bt->mutex);
+	bt->latency[bt->nr_latency++] = now - start;
+	bt->window_recs += nrecs;
+	if (bt->nr_latency == BATCH_WINDOW)
+		batch_tuner_adjust(bt, now);
+	batch = bt->size;
+	pthread_mutex_unlock(&bt->mutex);
+
+	return batch;
+}
+
+int batch_limit(int batch)
+{
+	if (!batch_tuning.enabled)
+		return batch;
+
+	return _MAX(batch, batch_tuning.max);
+}
+
+static void batch_tuner_report(struct benchmark_config *config)
+{
+	struct batch_tuning *tuning = &batch_tuning;
+	struct batch_tuner *bt;
+
+	/* Commands that issued no batches have nothing to report */
+	for (bt = tuning->tuners; bt; bt = bt->next) {
+		if (!bt->nr_windows && !bt->nr_latency)
+			continue;
+		printf("# batch chosen %s %d (%llu rec/s under p99 %llu us)\n",
+			bt->command, bt->best_size, bt->best_rate,
+			tuning->slo_us);
+	}
+}
+
 static void fixup_config(struct benchmark_config *config)
 {
+	if (!config->key)
+		config->key = "sequence";
 	if (config->producer_thnum < 1)
 		config->producer_thnum = 1;
 	if (config->consumer_thnum < 1)
 		config->consumer_thnum = 1;
 	if (config->num_works < 1)
 		config->num_works = config->producer_thnum;
+	if (config->batch < 1)
+		config->batch = 1;
+	if (config->queue_depth < 0)
+		config->queue_depth = 0;
+	if (config->batch_max < config->batch)
+		config->batch_max = config->batch * 16;
+	if (config->rate_min <= 0)
+		config->rate_min = 10;
+	if (config->rate_max < config->rate_min)
+		config->rate_max = 1000000;
+	if (config->step_sec < 1)
+		config->step_sec = 10;
 }
 
 void parse_options(struct benchmark_config *config, int argc, char **argv)
@@ -154,6 +387,10 @@ void parse_options(struct benchmark_config *config, int argc, char **argv)
 			config->host = argv[++i];
 		} else if (!strcmp(argv[i], "-port")) {
 			config->port = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-hosts")) {
+			config->hosts = argv[++i];
+		} else if (!strcmp(argv[i], "-shard-hash")) {
+			config->shard_hash = argv[++i];
 		} else if (!strcmp(argv[i], "-path")) {
 			config->path= argv[++i];
 		} else if (!strcmp(argv[i], "-num")) {
@@ -164,6 +401,10 @@ void parse_options(struct benchmark_config *config, int argc, char **argv)
 			config->seed_offset = atoi(argv[++i]);
 		} else if (!strcmp(argv[i], "-batch")) {
 			config->batch = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-batch-max")) {
+			config->batch_max = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-slo-ms")) {
+			config->slo_ms = atof(argv[++i]);
 		} else if (!strcmp(argv[i], "-thnum")) {
 			config->producer_thnum = atoi(argv[++i]);
 			config->consumer_thnum = config->producer_thnum;
@@ -173,14 +414,43 @@ void parse_options(struct benchmark_config *config, int argc, char **argv)
 			config->consumer_thnum = atoi(argv[++i]);
 		} else if (!strcmp(argv[i], "-work")) {
 			config->num_works = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-queue-depth")) {
+			config->queue_depth = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-scan-prefixes")) {
+			config->scan_prefixes = atoi(argv[++i]);
 		} else if (!strcmp(argv[i], "-key")) {
-			keygen_set_generator(argv[++i]);
+			config->key = argv[++i];
 		} else if (!strcmp(argv[i], "-debug")) {
 			config->debug = true;
 		} else if (!strcmp(argv[i], "-verbose")) {
 			config->verbose = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-rusage")) {
+			config->rusage = true;
+		} else if (!strcmp(argv[i], "-stats-file")) {
+			config->stats_file = argv[++i];
+		} else if (!strcmp(argv[i], "-scenario")) {
+			config->scenario = argv[++i];
+		} else if (!strcmp(argv[i], "-find-capacity")) {
+			config->find_capacity = true;
+		} else if (!strcmp(argv[i], "-p99-ms")) {
+			config->p99_ms = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "-p999-ms")) {
+			config->p999_ms = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "-rate-min")) {
+			config->rate_min = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "-rate-max")) {
+			config->rate_max = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "-step-sec")) {
+			config->step_sec = atoi(argv[++i]);
 		} else {
-			die("Invalid command option: %s", argv[i]);
+			int used = 0;
+
+			if (config->ops.parse_option)
+				used = config->ops.parse_option(config, argc,
+								argv, i);
+			if (!used)
+				die("Invalid command option: %s", argv[i]);
+			i += used - 1;
 		}
 	}
 
@@ -190,15 +460,26 @@ void parse_options(struct benchmark_config *config, int argc, char **argv)
 struct work {
 	unsigned int seed;
 	int progress;
+	unsigned long long scheduled;
 	unsigned long long start[2];
 	unsigned long long elapsed[2];
 };
 
+/*
+ * A queue with a non-zero depth blocks pushers while it holds that many
+ * works, so that a stage cannot run ahead of the next one.  The time
+ * pushers spent blocked is accounted in blocked_us.
+ */
 struct work_queue {
 	TCPTRLIST *list;
 	pthread_mutex_t mutex;
 	pthread_cond_t cond;
+	pthread_cond_t not_full;
 	bool open;
+	int depth;
+	unsigned long long pushes;
+	unsigned long long blocked;
+	unsigned long long blocked_us;
 };
 
 static void work_queue_open(struct work_queue *queue)
@@ -214,6 +495,7 @@ static void work_queue_close(struct work_queue *queue)
 	pthread_mutex_lock(&queue->mutex);
 	queue->open = false;
 	pthread_cond_broadcast(&queue->cond);
+	pthread_cond_broadcast(&queue->not_full);
 	pthread_mutex_unlock(&queue->mutex);
 }
 
@@ -222,6 +504,11 @@ static void work_queue_init(struct work_queue *queue)
 	queue->list = tcptrlistnew();
 	pthread_mutex_init(&queue->mutex, NULL);
 	pthread_cond_init(&queue->cond, NULL);
+	pthread_cond_init(&queue->not_full, NULL);
+	queue->depth = 0;
+	queue->pushes = 0;
+	queue->blocked = 0;
+	queue->blocked_us = 0;
 	work_queue_open(queue);
 }
 
@@ -235,13 +522,24 @@ static void work_queue_destroy(struct work_queue *queue)
 	tcptrlistdel(queue->list);
 	pthread_mutex_destroy(&queue->mutex);
 	pthread_cond_destroy(&queue->cond);
+	pthread_cond_destroy(&queue->not_full);
 }
 
 static void work_queue_push(struct work_queue *queue, struct work *work)
 {
 	pthread_mutex_lock(&queue->mutex);
+	if (queue->depth && tcptrlistnum(queue->list) >= queue->depth) {
+		unsigned long long start = stopwatch_start();
+
+		while (queue->open &&
+		       tcptrlistnum(queue->list) >= queue->depth)
+			pthread_cond_wait(&queue->not_full, &queue->mutex);
+		queue->blocked++;
+		queue->blocked_us += stopwatch_stop(start);
+	}
 	if (!queue->open)
 		die("work queue is closed");
+	queue->pushes++;
 	tcptrlistunshift(queue->list, work);
 	pthread_cond_signal(&queue->cond);
 	pthread_mutex_unlock(&queue->mutex);
@@ -263,18 +561,119 @@ static struct work *work_queue_pop(struct work_queue *queue)
 			break;
 		pthread_cond_wait(&queue->cond, &queue->mutex);
 	}
+	if (work && queue->depth)
+		pthread_cond_signal(&queue->not_full);
 	pthread_mutex_unlock(&queue->mutex);
 
 	return work;
 }
 
+static void work_queue_report(struct work_queue *queue, const char *name)
+{
+	if (!queue->depth)
+		return;
+
+	printf("# %s queue depth %d: blocked %llu.%03llu s in %llu of %llu pushes\n",
+		name, queue->depth,
+		queue->blocked_us / 1000000, queue->blocked_us / 1000 % 1000,
+		queue->blocked, queue->pushes);
+}
+
+/*
+ * Per-thread resource usage (-rusage)
+ *
+ * Sampled before and after every work with getrusage(RUSAGE_THREAD),
+ * or from /proc/thread-self where RUSAGE_THREAD is not available.  Only
+ * the worker thread itself is accounted, not threads a backend hands
+ * requests to.
+ */
+struct thread_usage {
+	unsigned long long utime_us;
+	unsigned long long stime_us;
+	unsigned long long nvcsw;
+	unsigned long long nivcsw;
+	unsigned long long minflt;
+	unsigned long long majflt;
+};
+
+#ifdef RUSAGE_THREAD
+
+static void thread_usage_sample(struct thread_usage *usage)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_THREAD, &ru) < 0)
+		die("getrusage failed");
+
+	usage->utime_us = tv_to_us(&ru.ru_utime);
+	usage->stime_us = tv_to_us(&ru.ru_stime);
+	usage->nvcsw = ru.ru_nvcsw;
+	usage->nivcsw = ru.ru_nivcsw;
+	usage->minflt = ru.ru_minflt;
+	usage->majflt = ru.ru_majflt;
+}
+
+#else
+
+static void thread_usage_sample(struct thread_usage *usage)
+{
+	unsigned long long utime, stime;
+	long ticks = sysconf(_SC_CLK_TCK);
+	char buf[1024];
+	const char *p;
+	FILE *fp;
+
+	memset(usage, 0, sizeof(*usage));
+
+	fp = fopen("/proc/thread-self/stat", "r");
+	if (!fp)
+		die("unable to open /proc/thread-self/stat");
+	p = fgets(buf, sizeof(buf), fp) ? strrchr(buf, ')') : NULL;
+	fclose(fp);
+
+	/* Fields after the command name start with the state, field 3 */
+	if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %llu %*u %llu "
+			"%*u %llu %llu", &usage->minflt, &usage->majflt,
+			&utime, &stime) != 4)
+		die("unable to parse /proc/thread-self/stat");
+	usage->utime_us = utime * 1000000 / ticks;
+	usage->stime_us = stime * 1000000 / ticks;
+
+	fp = fopen("/proc/thread-self/status", "r");
+	if (!fp)
+		die("unable to open /proc/thread-self/status");
+	while (fgets(buf, sizeof(buf), fp)) {
+		sscanf(buf, "voluntary_ctxt_switches: %llu", &usage->nvcsw);
+		sscanf(buf, "nonvoluntary_ctxt_switches: %llu", &usage->nivcsw);
+	}
+	fclose(fp);
+}
+
+#endif
+
+static void thread_usage_add(struct thread_usage *sum,
+			const struct thread_usage *end,
+			const struct thread_usage *start)
+{
+	sum->utime_us += end->utime_us - start->utime_us;
+	sum->stime_us += end->stime_us - start->stime_us;
+	sum->nvcsw += end->nvcsw - start->nvcsw;
+	sum->nivcsw += end->nivcsw - start->nivcsw;
+	sum->minflt += end->minflt - start->minflt;
+	sum->majflt += end->majflt - start->majflt;
+}
+
 struct worker_info {
 	pthread_t tid;
 	void *db;
+	bool own_db;
 	const char *command;
 	struct work_queue *in_queue;
 	struct work_queue *out_queue;
 	struct benchmark_config *config;
+	struct livestats_thread *stats;
+	unsigned long long ops;
+	struct thread_usage usage;
 };
 
 static int strstartswith(const char *str, const char *prefix)
@@ -282,16 +681,164 @@ static int strstartswith(const char *str, const char *prefix)
 	return !strncmp(str, prefix, strlen(prefix));
 }
 
+/*
+ * Number of records and payload bytes a single work of @command moves,
+ * as published in the live stats file
+ */
+static void work_volume(const char *command, struct benchmark_config *config,
+			unsigned long long *ops, unsigned long long *bytes)
+{
+	unsigned long long ksiz = KEYGEN_KEY_SIZE - 1;
+
+	if (!strcmp(command, "nop")) {
+		*ops = 0;
+		*bytes = 0;
+	} else if (strstr(command, "outlist") || !strcmp(command, "fwmkeys") ||
+			strstartswith(command, "query")) {
+		*ops = config->num;
+		*bytes = *ops * ksiz;
+	} else {
+		*ops = config->num;
+		*bytes = *ops * (ksiz + config->vsiz);
+	}
+}
+
+/*
+ * Partitioned scans ("scan" command)
+ *
+ * The key space of -scan-prefixes keygen prefixes starting at -seed
+ * (by default one per work) is split into one partition per work, and
+ * every work scans its partition through the worker's own handle, so
+ * that the partitions are scanned in parallel by all threads.  Split
+ * points are the known keygen prefixes; there is no sampling of the
+ * stored keys, so a partition never splits a prefix.
+ */
+struct scan_part {
+	unsigned long long records;
+	unsigned long long bytes;
+	unsigned long long start;
+	unsigned long long elapsed;
+};
+
+static struct scan_part *scan_parts;
+static int nr_scan_parts;
+static pthread_mutex_t scan_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void scan_work(struct worker_info *data, struct work *work,
+			unsigned long long *records, unsigned long long *bytes)
+{
+	struct benchmark_config *config = data->config;
+	int nr_prefixes = config->scan_prefixes ? config->scan_prefixes :
+						config->num_works;
+	int part = (work->seed - config->seed_offset) % config->num_works;
+	unsigned int lo = config->seed_offset +
+		(unsigned long long)part * nr_prefixes / config->num_works;
+	unsigned int hi = config->seed_offset +
+		(unsigned long long)(part + 1) * nr_prefixes / config->num_works;
+	char start_key[KEYGEN_PREFIX_SIZE + 1];
+	char end_key[KEYGEN_PREFIX_SIZE + 1];
+	struct keygen keygen;
+	unsigned long long start;
+	struct scan_part *sp;
+
+	if (!config->ops.scan_test)
+		die("scan is not supported by this backend");
+
+	*records = 0;
+	*bytes = 0;
+	start = stopwatch_start();
+	if (lo < hi) {
+		keygen_init(&keygen, lo);
+		keygen_prefix(&keygen, start_key);
+		keygen_init(&keygen, hi);
+		keygen_prefix(&keygen, end_key);
+
+		config->ops.scan_test(data->db, start_key, end_key,
+				config->batch, records, bytes);
+	}
+
+	pthread_mutex_lock(&scan_mutex);
+	if (part >= nr_scan_parts) {
+		scan_parts = realloc(scan_parts,
+				sizeof(*scan_parts) * (part + 1));
+		if (!scan_parts)
+			die("realloc: out of memory");
+		memset(scan_parts + nr_scan_parts, 0,
+			sizeof(*scan_parts) * (part + 1 - nr_scan_parts));
+		nr_scan_parts = part + 1;
+	}
+	sp = &scan_parts[part];
+	if (!sp->elapsed || start < sp->start)
+		sp->start = start;
+	sp->records += *records;
+	sp->bytes += *bytes;
+	sp->elapsed += stopwatch_stop(start);
+	pthread_mutex_unlock(&scan_mutex);
+}
+
+/*
+ * Aggregate throughput is over the wall time from the first partition
+ * starting to the last one finishing; skew is max/mean over partitions
+ */
+static void scan_report(struct benchmark_config *config)
+{
+	unsigned long long records = 0, bytes = 0, elapsed = 0;
+	unsigned long long max_records = 0, max_elapsed = 0;
+	unsigned long long first = 0, last = 0;
+	int i;
+
+	if (!nr_scan_parts)
+		return;
+
+	printf("# scan part records MB elapsed(s) MB/s\n");
+	for (i = 0; i < nr_scan_parts; i++) {
+		struct scan_part *sp = &scan_parts[i];
+		unsigned long long end = sp->start + sp->elapsed;
+
+		printf("# scan %d %llu %.1f %llu.%03llu %.1f\n", i, sp->records,
+			sp->bytes / 1048576.0, sp->elapsed / 1000000,
+			sp->elapsed / 1000 % 1000, sp->elapsed ?
+			sp->bytes / 1048576.0 * 1000000 / sp->elapsed : 0.0);
+
+		records += sp->records;
+		bytes += sp->bytes;
+		elapsed += sp->elapsed;
+		if (sp->records > max_records)
+			max_records = sp->records;
+		if (sp->elapsed > max_elapsed)
+			max_elapsed = sp->elapsed;
+		if (!i || sp->start < first)
+			first = sp->start;
+		if (end > last)
+			last = end;
+	}
+	printf("# scan total %llu records %.1f MB %.1f MB/s skew %.2f records "
+		"%.2f time\n", records, bytes / 1048576.0,
+		last > first ? bytes / 1048576.0 * 1000000 / (last - first) : 0.0,
+		records ? (double)max_records * nr_scan_parts / records : 0.0,
+		elapsed ? (double)max_elapsed * nr_scan_parts / elapsed : 0.0);
+
+	free(scan_parts);
+	scan_parts = NULL;
+	nr_scan_parts = 0;
+}
+
 static void handle_work(struct worker_info *data, struct work *work)
 {
 	const char *command = data->command;
 	struct benchmark_config *config = data->config;
 	struct benchmark_operations *bops = &config->ops;
+	struct thread_usage usage_start, usage_end;
+	unsigned long long ops, bytes;
+	unsigned long long scan_records = 0, scan_bytes = 0;
 	unsigned long start, elapsed;
 
 	if (work->progress > 1)
 		die("something wrong happened");
+	batch_tuner = batch_tuner_get(command);
 
+	if (config->rusage)
+		thread_usage_sample(&usage_start);
 	start = stopwatch_start();
 
 	if (strstartswith(command, "putlist")) {
@@ -327,6 +874,13 @@ static void handle_work(struct worker_info *data, struct work *work)
 		bops->fwmkeys_test(data->db, config->num, work->seed);
 		bops->outlist_test(data->db, "outlist_atomic", config->num,
 					config->batch, work->seed);
+	} else if (strstartswith(command, "query")) {
+		if (!bops->query_test)
+			die("%s is not supported by this backend", command);
+		bops->query_test(data->db, command, config->num,
+				config->vsiz, config->batch, work->seed);
+	} else if (!strcmp(command, "scan")) {
+		scan_work(data, work, &scan_records, &scan_bytes);
 	} else if (!strcmp(command, "put")) {
 		bops->put_test(data->db, config->num, config->vsiz, work->seed);
 	} else if (!strcmp(command, "get")) {
@@ -338,9 +892,22 @@ static void handle_work(struct worker_info *data, struct work *work)
 	}
 
 	elapsed = stopwatch_stop(start);
+	if (config->rusage) {
+		thread_usage_sample(&usage_end);
+		thread_usage_add(&data->usage, &usage_end, &usage_start);
+	}
 	work->start[work->progress] = start;
 	work->elapsed[work->progress] = elapsed;
 	work->progress++;
+
+	work_volume(command, config, &ops, &bytes);
+	if (!strcmp(command, "scan")) {
+		ops = scan_records;
+		bytes = scan_bytes;
+	}
+	data->ops += ops;
+	if (data->stats)
+		livestats_account(data->stats, ops, bytes, elapsed);
 }
 
 static void *benchmark_thread(void *arg)
@@ -358,17 +925,26 @@ static void *benchmark_thread(void *arg)
 
 static struct worker_info *create_workers(struct benchmark_config *config,
 		int thnum, const char *command, struct work_queue *in_queue,
-		struct work_queue *out_queue)
+		struct work_queue *out_queue, struct livestats *stats,
+		int stats_id, const char *role, void **dbs)
 {
 	struct worker_info *data = xmalloc(sizeof(*data) * thnum);
 	int i;
 
 	for (i = 0; i < thnum; i++) {
-		data[i].db = config->ops.open_db(config);
+		data[i].own_db = !dbs;
+		data[i].db = dbs ? dbs[i] : config->ops.open_db(config);
 		data[i].config = config;
 		data[i].command = command;
 		data[i].in_queue = in_queue;
 		data[i].out_queue = out_queue;
+		data[i].stats = NULL;
+		data[i].ops = 0;
+		memset(&data[i].usage, 0, sizeof(data[i].usage));
+		if (stats) {
+			data[i].stats = livestats_slot(stats, stats_id + i,
+							role, command);
+		}
 	}
 	for (i = 0; i < thnum; i++)
 		xpthread_create(&data[i].tid, benchmark_thread, &data[i]);
@@ -390,22 +966,67 @@ static void destroy_workers(struct worker_info *data, int thnum)
 	int i;
 
 	for (i = 0; i < thnum; i++) {
-		config->ops.close_db(data[i].db);
+		if (data[i].own_db)
+			config->ops.close_db(data[i].db);
 	}
 	free(data);
 }
 
-#define _MIN(x, y) ({				\
-	typeof(x) _min1 = (x);			\
-	typeof(y) _min2 = (y);			\
-	(void) (&_min1 == &_min2);		\
-	_min1 < _min2 ? _min1 : _min2; })
+static void usage_report_stage(const char *stage, struct worker_info *data,
+			int thnum)
+{
+	struct thread_usage sum;
+	unsigned long long ops = 0;
+	int i;
 
-#define _MAX(x, y) ({				\
-	typeof(x) _max1 = (x);			\
-	typeof(y) _max2 = (y);			\
-	(void) (&_max1 == &_max2);		\
-	_max1 > _max2 ? _max1 : _max2; })
+	memset(&sum, 0, sizeof(sum));
+	for (i = 0; i < thnum; i++) {
+		struct thread_usage zero;
+
+		memset(&zero, 0, sizeof(zero));
+		thread_usage_add(&sum, &data[i].usage, &zero);
+		ops += data[i].ops;
+	}
+	if (!ops)
+		return;
+
+	printf("# rusage %s %llu %.3f %.3f %llu %llu %llu %llu\n", stage, ops,
+		(double)sum.utime_us / ops, (double)sum.stime_us / ops,
+		sum.nvcsw, sum.nivcsw, sum.minflt, sum.majflt);
+}
+
+static void usage_report(struct benchmark_config *config,
+			struct worker_info *producers,
+			struct worker_info *consumers)
+{
+	if (!config->rusage)
+		return;
+
+	printf("# rusage stage ops user(us)/op sys(us)/op "
+		"vcsw ivcsw minflt majflt\n");
+	usage_report_stage("producer", producers, config->producer_thnum);
+	usage_report_stage("consumer", consumers, config->consumer_thnum);
+}
+
+static void add_result(struct benchmark_config *config, const char *name,
+		int works, unsigned long long records, unsigned long long elapsed,
+		unsigned long long avg[2], unsigned long long max[2])
+{
+	struct benchmark_result *result;
+
+	config->results = realloc(config->results,
+			sizeof(*result) * (config->nr_results + 1));
+	if (!config->results)
+		die("realloc: out of memory");
+
+	result = &config->results[config->nr_results++];
+	result->name = strdup(name);
+	result->works = works;
+	result->elapsed = elapsed;
+	result->records = records;
+	memcpy(result->avg, avg, sizeof(result->avg));
+	memcpy(result->max, max, sizeof(result->max));
+}
 
 static void collect_results(struct benchmark_config *config,
 			struct work_queue *queue, unsigned long long start,
@@ -414,6 +1035,7 @@ static void collect_results(struct benchmark_config *config,
 	int i;
 	unsigned long long sum[2] = { 0, 0 }, min[2] = { ULONG_MAX, ULONG_MAX };
 	unsigned long long max[2] = { 0, 0 }, avg[2];
+	unsigned long long records;
 
 	for (i = 0; i < config->num_works; i++) {
 		struct work *work = work_queue_pop(queue);
@@ -441,6 +1063,7 @@ static void collect_results(struct benchmark_config *config,
 	}
 	avg[0] = sum[0] / config->num_works;
 	avg[1] = sum[1] / config->num_works;
+	records = (unsigned long long)config->num_works * config->num;
 
 	if (config->verbose > 0) {
 		printf(
@@ -452,6 +1075,480 @@ static void collect_results(struct benchmark_config *config,
 			min[1] / 1000000, min[1] / 1000 % 1000,
 			max[1] / 1000000, max[1] / 1000 % 1000);
 	}
+
+	if (strcmp(config->consumer, "nop")) {
+		char name[256];
+
+		snprintf(name, sizeof(name), "%s/%s", config->producer,
+			config->consumer);
+		add_result(config, name, config->num_works, records, elapsed,
+			avg, max);
+	} else {
+		add_result(config, config->producer, config->num_works,
+			records, elapsed, avg, max);
+	}
+}
+
+/*
+ * Capacity finder (-find-capacity)
+ *
+ * Works are issued open loop at a fixed arrival rate for -step-sec
+ * seconds and each work's latency is measured from its scheduled
+ * arrival, so queueing behind a saturated backend is included.  The
+ * rate is doubled until the latency target is missed, then binary
+ * searched between the last passing and the first failing rate.  If
+ * even -rate-min misses the target, no capacity is reported, and if
+ * -rate-max still meets it, the capacity is only known to be at least
+ * -rate-max.  All steps share one set of handles.
+ */
+
+struct rate_step {
+	double rate;
+	double achieved;
+	unsigned long long p50;
+	unsigned long long p99;
+	unsigned long long p999;
+	bool ok;
+};
+
+static unsigned long long percentile(unsigned long long *sorted, int n,
+				double q)
+{
+	int i = n * q;
+
+	if (!n)
+		return 0;
+
+	return sorted[i < n ? i : n - 1];
+}
+
+static void run_rate_step(struct benchmark_config *config, double rate,
+			struct rate_step *step, void **dbs)
+{
+	struct worker_info *workers;
+	struct work_queue in_queue;
+	struct work_queue out_queue;
+	unsigned long long start, elapsed, interval;
+	unsigned long long *latency;
+	int nworks = rate * config->step_sec;
+	int i;
+
+	if (nworks < 1)
+		nworks = 1;
+	interval = 1000000 / rate;
+
+	work_queue_init(&in_queue);
+	work_queue_init(&out_queue);
+
+	workers = create_workers(config, config->producer_thnum,
+				config->producer, &in_queue, &out_queue,
+				NULL, 0, "producer", dbs);
+	start = stopwatch_start();
+
+	for (i = 0; i < nworks; i++) {
+		struct work *work = xmalloc(sizeof(*work));
+		unsigned long long now = stopwatch_start();
+
+		memset(work, 0, sizeof(*work));
+		/* Cycle through the preloaded key prefixes */
+		work->seed = config->seed_offset + i % config->num_works;
+		work->scheduled = start + i * interval;
+		if (work->scheduled > now)
+			usleep(work->scheduled - now);
+		work_queue_push(&in_queue, work);
+	}
+	work_queue_close(&in_queue);
+
+	join_workers(workers, config->producer_thnum);
+	work_queue_close(&out_queue);
+
+	elapsed = stopwatch_stop(start);
+
+	latency = xmalloc(sizeof(*latency) * nworks);
+	for (i = 0; i < nworks; i++) {
+		struct work *work = work_queue_pop(&out_queue);
+
+		latency[i] = work->start[0] + work->elapsed[0] -
+				work->scheduled;
+		free(work);
+	}
+	qsort(latency, nworks, sizeof(*latency), cmp_ull);
+
+	step->rate = rate;
+	step->achieved = nworks * 1000000.0 / elapsed;
+	step->p50 = percentile(latency, nworks, 0.50);
+	step->p99 = percentile(latency, nworks, 0.99);
+	step->p999 = percentile(latency, nworks, 0.999);
+	step->ok = step->achieved >= rate * 0.95 &&
+		(config->p99_ms <= 0 || step->p99 <= config->p99_ms * 1000) &&
+		(config->p999_ms <= 0 || step->p999 <= config->p999_ms * 1000);
+
+	printf("%.1f %.1f %llu.%03llu %llu.%03llu %llu.%03llu %s\n",
+		step->rate, step->achieved,
+		step->p50 / 1000, step->p50 % 1000,
+		step->p99 / 1000, step->p99 % 1000,
+		step->p999 / 1000, step->p999 % 1000,
+		step->ok ? "ok" : "fail");
+	fflush(stdout);
+
+	free(latency);
+	destroy_workers(workers, config->producer_thnum);
+	work_queue_destroy(&in_queue);
+	work_queue_destroy(&out_queue);
+}
+
+#define CAPACITY_MAX_STEPS 32
+
+static void find_capacity(struct benchmark_config *config)
+{
+	struct rate_step step;
+	double lo = 0, hi = 0;
+	double rate = config->rate_min;
+	void **dbs;
+	int i;
+
+	dbs = xmalloc(sizeof(*dbs) * config->producer_thnum);
+	for (i = 0; i < config->producer_thnum; i++)
+		dbs[i] = config->ops.open_db(config);
+
+	printf("# rate(works/s) achieved p50(ms) p99(ms) p999(ms) result\n");
+
+	for (i = 0; i < CAPACITY_MAX_STEPS; i++) {
+		run_rate_step(config, rate, &step, dbs);
+		if (!step.ok) {
+			hi = rate;
+			break;
+		}
+		lo = rate;
+		if (rate >= config->rate_max)
+			break;
+		rate = _MIN(rate * 2, config->rate_max);
+	}
+
+	while (lo > 0 && hi > 0 && i++ < CAPACITY_MAX_STEPS &&
+	       hi - lo > lo * 0.02) {
+		rate = (lo + hi) / 2;
+		run_rate_step(config, rate, &step, dbs);
+		if (step.ok)
+			lo = rate;
+		else
+			hi = rate;
+	}
+
+	if (lo == 0)
+		printf("# capacity none at or above %.1f works/s\n",
+			config->rate_min);
+	else if (hi == 0)
+		printf("# capacity at least %.1f works/s (%.1f records/s), "
+			"no step failed up to -rate-max\n", lo,
+			lo * config->num);
+	else
+		printf("# capacity %.1f works/s (%.1f records/s)\n", lo,
+			lo * config->num);
+
+	if (config->ops.report)
+		config->ops.report(config);
+	for (i = 0; i < config->producer_thnum; i++)
+		config->ops.close_db(dbs[i]);
+	free(dbs);
+}
+
+/*
+ * Scenario files (-scenario)
+ *
+ * Each non-empty line not starting with '#' describes one phase:
+ *
+ *	<name> [option=value ...]
+ *
+ * Options are command, producer, consumer, thnum, producer-thnum,
+ * consumer-thnum, num, vsiz, batch, seed, works, queue-depth,
+ * scan-prefixes, key, duration and rate.  Anything not given is
+ * inherited from the command line.  A phase ends after "works" works,
+ * or after "duration" seconds when set, in which case seeds cycle
+ * through the "works" key prefixes.  "rate" paces arrivals in works per
+ * second; otherwise at most two works per thread are outstanding.
+ *
+ * All phases run back to back on the same database handles, opened
+ * once for the largest thread counts of the scenario.
+ */
+
+struct phase {
+	char *line;
+	const char *name;
+	int duration;
+	double rate;
+	struct benchmark_config config;
+};
+
+static void parse_phase(struct phase *phase, char *line,
+			struct benchmark_config *base)
+{
+	char *saveptr;
+	char *token;
+
+	memset(phase, 0, sizeof(*phase));
+	phase->line = line;
+	phase->config = *base;
+	phase->name = strtok_r(line, " \t\n", &saveptr);
+
+	while ((token = strtok_r(NULL, " \t\n", &saveptr)) != NULL) {
+		struct benchmark_config *config = &phase->config;
+		char *value = strchr(token, '=');
+
+		if (!value)
+			die("%s: invalid phase option: %s", phase->name, token);
+		*value++ = '\0';
+
+		if (!strcmp(token, "command")) {
+			config->producer = value;
+			config->consumer = "nop";
+		} else if (!strcmp(token, "producer")) {
+			config->producer = value;
+		} else if (!strcmp(token, "consumer")) {
+			config->consumer = value;
+		} else if (!strcmp(token, "thnum")) {
+			config->producer_thnum = atoi(value);
+			config->consumer_thnum = config->producer_thnum;
+		} else if (!strcmp(token, "producer-thnum")) {
+			config->producer_thnum = atoi(value);
+		} else if (!strcmp(token, "consumer-thnum")) {
+			config->consumer_thnum = atoi(value);
+		} else if (!strcmp(token, "num")) {
+			config->num = atoi(value);
+		} else if (!strcmp(token, "vsiz")) {
+			config->vsiz = atoi(value);
+		} else if (!strcmp(token, "batch")) {
+			config->batch = atoi(value);
+		} else if (!strcmp(token, "seed")) {
+			config->seed_offset = atoi(value);
+		} else if (!strcmp(token, "works")) {
+			config->num_works = atoi(value);
+		} else if (!strcmp(token, "queue-depth")) {
+			config->queue_depth = atoi(value);
+		} else if (!strcmp(token, "scan-prefixes")) {
+			config->scan_prefixes = atoi(value);
+		} else if (!strcmp(token, "key")) {
+			config->key = value;
+		} else if (!strcmp(token, "duration")) {
+			phase->duration = atoi(value);
+		} else if (!strcmp(token, "rate")) {
+			phase->rate = atof(value);
+		} else {
+			die("%s: invalid phase option: %s", phase->name, token);
+		}
+	}
+	fixup_config(&phase->config);
+}
+
+static int load_scenario(const char *path, struct benchmark_config *base,
+			struct phase **phases)
+{
+	FILE *fp;
+	char *line = NULL;
+	size_t len = 0;
+	int nr_phases = 0;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		die("unable to open scenario: %s", path);
+
+	*phases = NULL;
+	while (getline(&line, &len, fp) >= 0) {
+		char *p = line + strspn(line, " \t\n");
+
+		if (*p == '\0' || *p == '#')
+			continue;
+
+		*phases = realloc(*phases, sizeof(**phases) * (nr_phases + 1));
+		if (!*phases)
+			die("realloc: out of memory");
+		parse_phase(&(*phases)[nr_phases++], strdup(p), base);
+	}
+	free(line);
+	fclose(fp);
+
+	if (!nr_phases)
+		die("no phases in scenario: %s", path);
+
+	return nr_phases;
+}
+
+struct phase_result {
+	int works;
+	unsigned long long sum[2];
+	unsigned long long max[2];
+};
+
+static void account_phase_work(struct phase_result *result, struct work *work)
+{
+	int i;
+
+	result->works++;
+	for (i = 0; i < 2; i++) {
+		result->sum[i] += work->elapsed[i];
+		result->max[i] = _MAX(result->max[i], work->elapsed[i]);
+	}
+	free(work);
+}
+
+static void run_phase(struct phase *phase, struct benchmark_config *base,
+			void **producer_dbs, void **consumer_dbs)
+{
+	struct benchmark_config *config = &phase->config;
+	struct worker_info *producers;
+	struct worker_info *consumers;
+	struct work_queue queue_to_producer;
+	struct work_queue queue_to_consumer;
+	struct work_queue trash_queue;
+	struct livestats *stats = NULL;
+	struct phase_result result;
+	unsigned long long start, elapsed, deadline, avg[2];
+	int window = 2 * (config->producer_thnum + config->consumer_thnum);
+	int issued = 0, outstanding = 0;
+
+	memset(&result, 0, sizeof(result));
+	keygen_set_generator(config->key);
+
+	work_queue_init(&queue_to_producer);
+	work_queue_init(&queue_to_consumer);
+	queue_to_consumer.depth = config->queue_depth;
+	work_queue_init(&trash_queue);
+
+	batch_tuner_init(config);
+
+	if (config->stats_file) {
+		stats = livestats_create(config->stats_file,
+			config->producer_thnum + config->consumer_thnum);
+		if (!stats)
+			die("unable to create stats file: %s",
+				config->stats_file);
+	}
+
+	producers = create_workers(config, config->producer_thnum,
+				config->producer, &queue_to_producer,
+				&queue_to_consumer, stats, 0, "producer",
+				producer_dbs);
+	consumers = create_workers(config, config->consumer_thnum,
+				config->consumer, &queue_to_consumer,
+				&trash_queue, stats, config->producer_thnum,
+				"consumer", consumer_dbs);
+	start = stopwatch_start();
+	deadline = start + phase->duration * 1000000ULL;
+
+	while (1) {
+		bool more;
+
+		if (phase->duration)
+			more = stopwatch_start() < deadline;
+		else
+			more = issued < config->num_works;
+
+		if (more && (phase->rate > 0 || outstanding < window)) {
+			struct work *work = xmalloc(sizeof(*work));
+
+			memset(work, 0, sizeof(*work));
+			work->seed = config->seed_offset +
+					issued % config->num_works;
+			if (phase->rate > 0) {
+				unsigned long long now = stopwatch_start();
+
+				work->scheduled = start +
+					issued * 1000000ULL / phase->rate;
+				if (work->scheduled > now)
+					usleep(work->scheduled - now);
+			}
+			work_queue_push(&queue_to_producer, work);
+			issued++;
+			outstanding++;
+		} else if (more) {
+			account_phase_work(&result,
+					work_queue_pop(&trash_queue));
+			outstanding--;
+		} else {
+			break;
+		}
+	}
+	work_queue_close(&queue_to_producer);
+
+	join_workers(producers, config->producer_thnum);
+	work_queue_close(&queue_to_consumer);
+
+	join_workers(consumers, config->consumer_thnum);
+	work_queue_close(&trash_queue);
+
+	elapsed = stopwatch_stop(start);
+
+	while (outstanding-- > 0)
+		account_phase_work(&result, work_queue_pop(&trash_queue));
+
+	avg[0] = result.sum[0] / _MAX(result.works, 1);
+	avg[1] = result.sum[1] / _MAX(result.works, 1);
+
+	printf("%s %d %lld.%03lld %.1f %lld.%03lld %lld.%03lld %lld.%03lld %lld.%03lld\n",
+		phase->name, result.works,
+		elapsed / 1000000, elapsed / 1000 % 1000,
+		(double)result.works * config->num * 1000000 / elapsed,
+		avg[0] / 1000000, avg[0] / 1000 % 1000,
+		result.max[0] / 1000000, result.max[0] / 1000 % 1000,
+		avg[1] / 1000000, avg[1] / 1000 % 1000,
+		result.max[1] / 1000000, result.max[1] / 1000 % 1000);
+	fflush(stdout);
+	batch_tuner_report(config);
+	work_queue_report(&queue_to_consumer, "consumer");
+	usage_report(config, producers, consumers);
+	scan_report(config);
+	if (config->ops.report)
+		config->ops.report(config);
+	add_result(base, phase->name, result.works,
+		(unsigned long long)result.works * config->num, elapsed,
+		avg, result.max);
+
+	destroy_workers(consumers, config->consumer_thnum);
+	destroy_workers(producers, config->producer_thnum);
+
+	if (stats)
+		livestats_destroy(stats);
+
+	work_queue_destroy(&queue_to_producer);
+	work_queue_destroy(&queue_to_consumer);
+	work_queue_destroy(&trash_queue);
+}
+
+static void run_scenario(struct benchmark_config *config)
+{
+	struct phase *phases;
+	int nr_phases;
+	int max_producers = 0, max_consumers = 0;
+	void **dbs;
+	int i;
+
+	nr_phases = load_scenario(config->scenario, config, &phases);
+
+	for (i = 0; i < nr_phases; i++) {
+		max_producers = _MAX(max_producers,
+					phases[i].config.producer_thnum);
+		max_consumers = _MAX(max_consumers,
+					phases[i].config.consumer_thnum);
+	}
+
+	/* Producer handles come first, consumer handles follow */
+	dbs = xmalloc(sizeof(*dbs) * (max_producers + max_consumers));
+	for (i = 0; i < max_producers + max_consumers; i++)
+		dbs[i] = config->ops.open_db(config);
+
+	printf("# phase works elapsed(s) records/s "
+		"avg0 max0 avg1 max1\n");
+
+	for (i = 0; i < nr_phases; i++)
+		run_phase(&phases[i], config, dbs, dbs + max_producers);
+
+	for (i = 0; i < max_producers + max_consumers; i++)
+		config->ops.close_db(dbs[i]);
+	free(dbs);
+
+	for (i = 0; i < nr_phases; i++)
+		free(phases[i].line);
+	free(phases);
 }
 
 void benchmark(struct benchmark_config *config)
@@ -462,18 +1559,41 @@ void benchmark(struct benchmark_config *config)
 	struct work_queue queue_to_producer;
 	struct work_queue queue_to_consumer;
 	struct work_queue trash_queue;
+	struct livestats *stats = NULL;
 	unsigned long long start, elapsed;
 
+	/* Nothing may carry over from an earlier -backend run */
+	keygen_set_generator(config->key);
+	if (config->scenario) {
+		run_scenario(config);
+		return;
+	}
+	batch_tuner_init(config);
+	if (config->find_capacity) {
+		find_capacity(config);
+		return;
+	}
+
 	work_queue_init(&queue_to_producer);
 	work_queue_init(&queue_to_consumer);
+	queue_to_consumer.depth = config->queue_depth;
 	work_queue_init(&trash_queue);
 
+	if (config->stats_file) {
+		stats = livestats_create(config->stats_file,
+			config->producer_thnum + config->consumer_thnum);
+		if (!stats)
+			die("unable to create stats file: %s",
+				config->stats_file);
+	}
+
 	producers = create_workers(config, config->producer_thnum,
 				config->producer, &queue_to_producer,
-				&queue_to_consumer);
+				&queue_to_consumer, stats, 0, "producer", NULL);
 	consumers = create_workers(config, config->consumer_thnum,
 				config->consumer, &queue_to_consumer,
-				&trash_queue);
+				&trash_queue, stats, config->producer_thnum,
+				"consumer", NULL);
 	start = stopwatch_start();
 
 	for (i = 0; i < config->num_works; i++) {
@@ -494,10 +1614,19 @@ void benchmark(struct benchmark_config *config)
 	elapsed = stopwatch_stop(start);
 
 	collect_results(config, &trash_queue, start, elapsed);
+	batch_tuner_report(config);
+	work_queue_report(&queue_to_consumer, "consumer");
+	usage_report(config, producers, consumers);
+	scan_report(config);
+	if (config->ops.report)
+		config->ops.report(config);
 
 	destroy_workers(consumers, config->consumer_thnum);
 	destroy_workers(producers, config->producer_thnum);
 
+	if (stats)
+		livestats_destroy(stats);
+
 	work_queue_destroy(&queue_to_producer);
 	work_queue_destroy(&queue_to_consumer);
 	work_queue_destroy(&trash_queue);
@@ -49,25 +49,111 @@ struct benchmark_operations {
 				int batch, unsigned int seed);
 	void (*outlist_test)(void *db, const char *command, int num, int batch,
 				unsigned int seed);
+	/* Optional, runs the "query*" commands of backends with queries */
+	void (*query_test)(void *db, const char *command, int num, int vsiz,
+				int batch, unsigned int seed);
+	/*
+	 * Optional, scans the keys in [start, end) for the "scan" command,
+	 * batch records per request, and returns the records and the key
+	 * and value bytes seen
+	 */
+	void (*scan_test)(void *db, const char *start, const char *end,
+				int batch, unsigned long long *records,
+				unsigned long long *bytes);
+	/*
+	 * Optional, parses the backend specific option at argv[i] and
+	 * returns the number of arguments it used, or 0 if it is unknown
+	 */
+	int (*parse_option)(struct benchmark_config *config, int argc,
+				char **argv, int i);
+	/* Optional, prints backend statistics after every run or phase */
+	void (*report)(struct benchmark_config *config);
+};
+
+/*
+ * Summary of one benchmark run or scenario phase.  Times are in
+ * microseconds; index 0 is the producer stage, 1 the consumer stage.
+ */
+struct benchmark_result {
+	char *name;
+	int works;
+	unsigned long long elapsed;
+	unsigned long long records;
+	unsigned long long avg[2];
+	unsigned long long max[2];
 };
 
 struct benchmark_config {
 	const char *producer;
 	const char *consumer;
 	const char *host;
+	const char *hosts;
+	const char *shard_hash;
 	const char *path;
 	int port;
 	int num;
 	int vsiz;
 	unsigned int seed_offset;
 	int batch;
+	int batch_max;
+	double slo_ms;
 	int producer_thnum;
 	int consumer_thnum;
 	int num_works;
+	int queue_depth;
+	int scan_prefixes;
+	const char *key;
 	bool debug;
 	int verbose;
+	bool rusage;
+	const char *stats_file;
+	const char *scenario;
+	bool find_capacity;
+	double p99_ms;
+	double p999_ms;
+	double rate_min;
+	double rate_max;
+	int step_sec;
 	struct benchmark_operations ops;
+	struct benchmark_result *results;
+	int nr_results;
+};
+
+/*
+ * Backend plugins for kvbench
+ *
+ * A backend built with -DBENCHMARK_PLUGIN exports a struct
+ * benchmark_plugin named BENCHMARK_PLUGIN_SYMBOL instead of main().
+ * init() fills a config with the backend's defaults and operations,
+ * and setup() is called once options have been parsed into it.
+ */
+#define BENCHMARK_PLUGIN_SYMBOL "benchmark_plugin"
+
+struct benchmark_plugin {
+	const char *name;
+	void (*init)(struct benchmark_config *config);
+	void (*setup)(struct benchmark_config *config);
 };
 
+/*
+ * Adaptive batch sizing (-slo-ms)
+ *
+ * Batched tests time each batch from batch_start() and pass the result
+ * to batch_end(), which returns the size of the next batch.  Both are
+ * no-ops returning the fixed -batch value unless -slo-ms is given.
+ * batch_limit() bounds every size batch_end() may return.
+ *
+ * Every command is tuned on its own, by the tuner of the worker thread
+ * that runs it.  Threads that issue batches on behalf of a worker, like
+ * a shard fan-out, attach to the worker's batch_tuner_self().
+ */
+struct batch_tuner;
+
+unsigned long long batch_start(void);
+int batch_end(int batch, int nrecs, unsigned long long start);
+int batch_limit(int batch);
+struct batch_tuner *batch_tuner_self(void);
+void batch_tuner_attach(struct batch_tuner *bt);
+
 void parse_options(struct benchmark_config *config, int argc, char **argv);
 void benchmark(struct benchmark_config *config);
@@ -1,41 +1,189 @@
 #include <tcutil.h>
 #include <tcadb.h>
+#include <tchdb.h>
+#include <tcbdb.h>
+#include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 #include "testutil.h"
 
 static bool debug = false;
 
+/*
+ * With -shards N the records are spread by key hash over N databases,
+ * each in its own file, so that threads do not all serialize on the
+ * lock of a single database.  Multi-key operations are split by shard,
+ * fwmkeys and range merge what every shard returns.
+ */
+static int nr_shards = 1;
+
+/*
+ * -native talks to the hash or B+tree database behind every TCADB
+ * directly instead of through tcadbmisc, whose TCLIST arguments and
+ * results copy each key and value twice per batch.  Hash database
+ * values are read into a buffer owned by the test, range scans use a
+ * B+tree cursor writing into reused TCXSTRs, and the _atomic batch
+ * commands run every batch in a transaction.  range_atomic is a plain
+ * cursor scan, there is no atomic cursor read.
+ */
+static bool native;
+
+/*
+ * -write-behind N makes put return once the record is in a buffer of
+ * the work, holding at most N records.  A flusher thread drains every
+ * buffer each 10ms, or as soon as one is half full, sorts what it took
+ * by key and writes it with putlist.  A put into a full buffer waits
+ * for the flusher, so memory stays bounded by about 2N records per
+ * thread, and the database is closed only after the last flush.
+ */
+static int write_behind;
+
+struct native_db {
+	TCHDB *hdb;
+	TCBDB *bdb;
+};
+
+struct tc_db {
+	int nr_shards;
+	TCADB **adbs;
+	struct native_db *natives;
+	struct write_behind *wb;
+};
+
+static struct write_behind *wb_create(struct tc_db *tc);
+static void wb_destroy(struct write_behind *wb);
+
 /* Shared by all benchmark threads */
-static TCADB *adb;
+static struct tc_db *tcdb;
+
+/*
+ * "data.tcb#opts" becomes "data-N.tcb#opts".  In-memory databases
+ * ("*", "+") need no file and keep their name.
+ */
+static char *shard_path(const char *path, int shard)
+{
+	const char *opts = strchr(path, '#');
+	int len = opts ? opts - path : strlen(path);
+	const char *ext = NULL;
+	char *buf;
+	int i;
+
+	if (nr_shards == 1 || path[0] == '*' || path[0] == '+')
+		return strdup(path);
+
+	for (i = len - 1; i >= 0 && path[i] != '/'; i--) {
+		if (path[i] == '.') {
+			ext = path + i;
+			break;
+		}
+	}
+	if (!ext)
+		ext = path + len;
+
+	buf = xmalloc(strlen(path) + 16);
+	sprintf(buf, "%.*s-%d%s", (int)(ext - path), path, shard, ext);
+
+	return buf;
+}
 
 static void *open_db(struct benchmark_config *config)
 {
-	if (adb)
-		return adb;
+	int i;
+
+	if (tcdb)
+		return tcdb;
+
+	tcdb = xmalloc(sizeof(*tcdb));
+	tcdb->nr_shards = nr_shards;
+	tcdb->adbs = xmalloc(sizeof(*tcdb->adbs) * nr_shards);
+	tcdb->natives = NULL;
+	tcdb->wb = NULL;
 
-	adb = tcadbnew();
+	for (i = 0; i < nr_shards; i++) {
+		char *path = shard_path(config->path, i);
+
+		tcdb->adbs[i] = tcadbnew();
+		if (!tcadbopen(tcdb->adbs[i], path)) {
+			die("open error: %s", path);
+		}
+		free(path);
+	}
 
-	if (!tcadbopen(adb, config->path)) {
-		die("open error: %s", config->path);
+	if (native) {
+		tcdb->natives = xmalloc(sizeof(*tcdb->natives) * nr_shards);
+
+		for (i = 0; i < nr_shards; i++) {
+			struct native_db *nd = &tcdb->natives[i];
+			TCADB *adb = tcdb->adbs[i];
+
+			nd->hdb = NULL;
+			nd->bdb = NULL;
+			if (tcadbomode(adb) == ADBOHDB)
+				nd->hdb = tcadbreveal(adb);
+			else if (tcadbomode(adb) == ADBOBDB)
+				nd->bdb = tcadbreveal(adb);
+			else
+				die("-native needs a hash or B+tree database: %s",
+					tcadbpath(adb));
+		}
 	}
-	return adb;
+	if (write_behind)
+		tcdb->wb = wb_create(tcdb);
+
+	return tcdb;
 }
 
 static void close_db(void *db)
 {
-	if (adb != db)
+	int i;
+
+	if (tcdb != db)
 		return;
 
-	if (!tcadbclose(adb))
-		die("close error: %s", tcadbpath(adb));
+	/* Flushes whatever is still buffered */
+	if (tcdb->wb)
+		wb_destroy(tcdb->wb);
+
+	for (i = 0; i < tcdb->nr_shards; i++) {
+		TCADB *adb = tcdb->adbs[i];
+
+		if (!tcadbclose(adb))
+			die("close error: %s", tcadbpath(adb));
+
+		tcadbdel(adb);
+	}
+	free(tcdb->adbs);
+	free(tcdb->natives);
+	free(tcdb);
+	tcdb = NULL;
+}
+
+static int key_shard(struct tc_db *tc, const char *key, int ksiz)
+{
+	unsigned int hash = 2166136261U;
+	int i;
+
+	if (tc->nr_shards == 1)
+		return 0;
 
-	tcadbdel(adb);
-	adb = NULL;
+	for (i = 0; i < ksiz; i++)
+		hash = (hash ^ (unsigned char)key[i]) * 16777619U;
+
+	return hash % tc->nr_shards;
+}
+
+static TCADB *key_db(struct tc_db *tc, const char *key, int ksiz)
+{
+	return tc->adbs[key_shard(tc, key, ksiz)];
 }
 
 static void put_test(void *db, int num, int vsiz, unsigned int seed)
 {
-	TCADB *adb = db;
+	struct tc_db *tc = db;
 	struct keygen keygen;
 	char *value = xmalloc(vsiz);
 	int i;
@@ -44,8 +192,9 @@ static void put_test(void *db, int num, int vsiz, unsigned int seed)
 
 	for (i = 0; i < num; i++) {
 		const char *key = keygen_next_key(&keygen);
+		int ksiz = strlen(key);
 
-		tcadbput(adb, key, strlen(key), value, vsiz);
+		tcadbput(key_db(tc, key, ksiz), key, ksiz, value, vsiz);
 	}
 
 	free(value);
@@ -53,7 +202,7 @@ static void put_test(void *db, int num, int vsiz, unsigned int seed)
 
 static void get_test(void *db, int num, int vsiz, unsigned int seed)
 {
-	TCADB *adb = db;
+	struct tc_db *tc = db;
 	struct keygen keygen;
 	int i;
 
@@ -61,10 +210,11 @@ static void get_test(void *db, int num, int vsiz, unsigned int seed)
 
 	for (i = 0; i < num; i++) {
 		const char *key = keygen_next_key(&keygen);
+		int ksiz = strlen(key);
 		void *value;
 		int siz;
 
-		value = tcadbget(adb, key, strlen(key), &siz);
+		value = tcadbget(key_db(tc, key, ksiz), key, ksiz, &siz);
 		if (debug && vsiz != siz)
 			die("Unexpected value size: %d", siz);
 			
@@ -82,33 +232,412 @@ static TCLIST *do_tcadbmisc(TCADB *adb, const char *name, const TCLIST *args)
 	return rv;
 }
 
+/* A batch of keys (and values) split by shard */
+struct shard_lists {
+	struct tc_db *tc;
+	TCLIST **lists;
+	int nrecs;
+};
+
+static void shard_lists_init(struct shard_lists *sl, struct tc_db *tc)
+{
+	int i;
+
+	sl->tc = tc;
+	sl->lists = xmalloc(sizeof(*sl->lists) * tc->nr_shards);
+	sl->nrecs = 0;
+	for (i = 0; i < tc->nr_shards; i++)
+		sl->lists[i] = tclistnew();
+}
+
+static void shard_lists_clear(struct shard_lists *sl)
+{
+	int i;
+
+	for (i = 0; i < sl->tc->nr_shards; i++)
+		tclistclear(sl->lists[i]);
+	sl->nrecs = 0;
+}
+
+static void shard_lists_destroy(struct shard_lists *sl)
+{
+	int i;
+
+	for (i = 0; i < sl->tc->nr_shards; i++)
+		tclistdel(sl->lists[i]);
+	free(sl->lists);
+}
+
+/* Add a key, and its value unless value is NULL, to the list of its shard */
+static void shard_lists_push(struct shard_lists *sl, const char *key,
+				const char *value, int vsiz)
+{
+	int ksiz = strlen(key);
+	TCLIST *list = sl->lists[key_shard(sl->tc, key, ksiz)];
+
+	tclistpush(list, key, ksiz);
+	if (value)
+		tclistpush(list, value, vsiz);
+	sl->nrecs++;
+}
+
+/* Run the misc command on every shard with a non-empty list */
+static void shard_lists_misc(struct shard_lists *sl, const char *command)
+{
+	int i;
+
+	for (i = 0; i < sl->tc->nr_shards; i++) {
+		if (tclistnum(sl->lists[i]))
+			tclistdel(do_tcadbmisc(sl->tc->adbs[i], command,
+						sl->lists[i]));
+	}
+}
+
 static void putlist_test(void *db, const char *command, int num, int vsiz,
 			int batch, unsigned int seed)
 {
-	TCADB *adb = db;
+	struct tc_db *tc = db;
 	struct keygen keygen;
 	char *value = xmalloc(vsiz);
-	TCLIST *list = tclistnew();
+	struct shard_lists sl;
+	unsigned long long start;
 	int i;
 
 	keygen_init(&keygen, seed);
+	shard_lists_init(&sl, tc);
+	start = batch_start();
 
 	for (i = 0; i < num; i++) {
-		tclistpush2(list, keygen_next_key(&keygen));
-		tclistpush(list, value, vsiz);
+		shard_lists_push(&sl, keygen_next_key(&keygen), value, vsiz);
 
-		if (tclistnum(list) / 2 >= batch) {
-			tclistdel(do_tcadbmisc(adb, command, list));
-			tclistclear(list);
+		if (sl.nrecs >= batch) {
+			shard_lists_misc(&sl, command);
+			batch = batch_end(batch, sl.nrecs, start);
+			shard_lists_clear(&sl);
+			start = batch_start();
 		}
 	}
-	if (tclistnum(list))
-		tclistdel(do_tcadbmisc(adb, command, list));
+	if (sl.nrecs)
+		shard_lists_misc(&sl, command);
 
-	tclistdel(list);
+	shard_lists_destroy(&sl);
+	free(value);
+}
+
+static unsigned long long now_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+#define WB_INTERVAL_US 10000
+
+/* The records a work put but the flusher did not take yet */
+struct wb_buffer {
+	pthread_mutex_t mutex;
+	pthread_cond_t not_full;
+	TCLIST *recs;
+	int nrecs;
+	unsigned long long first_us;
+	unsigned long long sum_us;
+	bool retired;
+	struct wb_buffer *next;
+};
+
+struct write_behind {
+	struct tc_db *tc;
+	pthread_t flusher;
+	pthread_mutex_t mutex;
+	pthread_cond_t wakeup;
+	bool stop;
+	struct wb_buffer *buffers;
+
+	/* Since the last report */
+	unsigned long long records;
+	unsigned long long batches;
+	unsigned long long lag_sum_us;
+	unsigned long long lag_max_us;
+	unsigned long long blocked;
+};
+
+/* What one flusher pass took from the buffers */
+struct wb_batch {
+	TCLIST **lists;
+	int nr_lists;
+	int nrecs;
+	unsigned long long first_us;
+	unsigned long long sum_us;
+};
+
+struct wb_rec {
+	const char *key;
+	int ksiz;
+	const char *value;
+	int vsiz;
+};
+
+static int cmp_wb_rec(const void *a, const void *b)
+{
+	const struct wb_rec *ra = a, *rb = b;
+	int rv = memcmp(ra->key, rb->key, ra->ksiz < rb->ksiz ?
+						ra->ksiz : rb->ksiz);
+
+	return rv ? rv : ra->ksiz - rb->ksiz;
+}
+
+/* Called with wb->mutex held, frees the buffers of finished works */
+static void wb_take(struct write_behind *wb, struct wb_batch *batch)
+{
+	struct wb_buffer **p = &wb->buffers;
+	int nr_buffers = 0;
+	struct wb_buffer *buf;
+
+	for (buf = wb->buffers; buf; buf = buf->next)
+		nr_buffers++;
+
+	batch->lists = xmalloc(sizeof(*batch->lists) * (nr_buffers + 1));
+	batch->nr_lists = 0;
+	batch->nrecs = 0;
+	batch->first_us = 0;
+	batch->sum_us = 0;
+
+	while ((buf = *p) != NULL) {
+		bool retired;
+
+		pthread_mutex_lock(&buf->mutex);
+		if (buf->nrecs) {
+			batch->lists[batch->nr_lists++] = buf->recs;
+			if (!batch->nrecs || buf->first_us < batch->first_us)
+				batch->first_us = buf->first_us;
+			batch->nrecs += buf->nrecs;
+			batch->sum_us += buf->sum_us;
+
+			buf->recs = tclistnew();
+			buf->nrecs = 0;
+			buf->sum_us = 0;
+			pthread_cond_broadcast(&buf->not_full);
+		}
+		retired = buf->retired;
+		pthread_mutex_unlock(&buf->mutex);
+
+		if (retired) {
+			*p = buf->next;
+			tclistdel(buf->recs);
+			pthread_cond_destroy(&buf->not_full);
+			pthread_mutex_destroy(&buf->mutex);
+			free(buf);
+		} else {
+			p = &buf->next;
+		}
+	}
+}
+
+static void wb_flush(struct write_behind *wb, struct wb_batch *batch)
+{
+	struct wb_rec *recs;
+	struct shard_lists sl;
+	unsigned long long done;
+	int i, j, n = 0;
+
+	if (!batch->nrecs) {
+		free(batch->lists);
+		return;
+	}
+
+	recs = xmalloc(sizeof(*recs) * batch->nrecs);
+	for (i = 0; i < batch->nr_lists; i++) {
+		TCLIST *list = batch->lists[i];
+
+		for (j = 0; j < tclistnum(list); j += 2, n++) {
+			recs[n].key = tclistval(list, j, &recs[n].ksiz);
+			recs[n].value = tclistval(list, j + 1, &recs[n].vsiz);
+		}
+	}
+	qsort(recs, n, sizeof(*recs), cmp_wb_rec);
+
+	shard_lists_init(&sl, wb->tc);
+	for (i = 0; i < n; i++)
+		shard_lists_push(&sl, recs[i].key, recs[i].value, recs[i].vsiz);
+	shard_lists_misc(&sl, "putlist");
+	shard_lists_destroy(&sl);
+
+	done = now_us();
+	pthread_mutex_lock(&wb->mutex);
+	wb->records += n;
+	wb->batches++;
+	wb->lag_sum_us += done * n - batch->sum_us;
+	if (done - batch->first_us > wb->lag_max_us)
+		wb->lag_max_us = done - batch->first_us;
+	pthread_mutex_unlock(&wb->mutex);
+
+	for (i = 0; i < batch->nr_lists; i++)
+		tclistdel(batch->lists[i]);
+	free(batch->lists);
+	free(recs);
+}
+
+static void *wb_flusher(void *arg)
+{
+	struct write_behind *wb = arg;
+	struct wb_batch batch;
+	bool stop;
+
+	do {
+		pthread_mutex_lock(&wb->mutex);
+		if (!wb->stop) {
+			unsigned long long deadline = now_us() + WB_INTERVAL_US;
+			struct timespec ts;
+
+			ts.tv_sec = deadline / 1000000;
+			ts.tv_nsec = deadline % 1000000 * 1000;
+			pthread_cond_timedwait(&wb->wakeup, &wb->mutex, &ts);
+		}
+		/* Every work has retired its buffer by the time of stop */
+		stop = wb->stop;
+		wb_take(wb, &batch);
+		pthread_mutex_unlock(&wb->mutex);
+
+		wb_flush(wb, &batch);
+	} while (!stop);
+
+	return NULL;
+}
+
+static struct write_behind *wb_create(struct tc_db *tc)
+{
+	struct write_behind *wb = xmalloc(sizeof(*wb));
+
+	memset(wb, 0, sizeof(*wb));
+	wb->tc = tc;
+	pthread_mutex_init(&wb->mutex, NULL);
+	pthread_cond_init(&wb->wakeup, NULL);
+	xpthread_create(&wb->flusher, wb_flusher, wb);
+
+	return wb;
+}
+
+static void wb_destroy(struct write_behind *wb)
+{
+	pthread_mutex_lock(&wb->mutex);
+	wb->stop = true;
+	pthread_cond_signal(&wb->wakeup);
+	pthread_mutex_unlock(&wb->mutex);
+
+	xpthread_join(wb->flusher);
+
+	pthread_cond_destroy(&wb->wakeup);
+	pthread_mutex_destroy(&wb->mutex);
+	free(wb);
+}
+
+static struct wb_buffer *wb_buffer_new(struct write_behind *wb)
+{
+	struct wb_buffer *buf = xmalloc(sizeof(*buf));
+
+	pthread_mutex_init(&buf->mutex, NULL);
+	pthread_cond_init(&buf->not_full, NULL);
+	buf->recs = tclistnew();
+	buf->nrecs = 0;
+	buf->first_us = 0;
+	buf->sum_us = 0;
+	buf->retired = false;
+
+	pthread_mutex_lock(&wb->mutex);
+	buf->next = wb->buffers;
+	wb->buffers = buf;
+	pthread_mutex_unlock(&wb->mutex);
+
+	return buf;
+}
+
+/* The flusher frees the buffer once it took the remaining records */
+static void wb_buffer_retire(struct write_behind *wb, struct wb_buffer *buf)
+{
+	pthread_mutex_lock(&buf->mutex);
+	buf->retired = true;
+	pthread_mutex_unlock(&buf->mutex);
+	pthread_cond_signal(&wb->wakeup);
+}
+
+static void wb_put(struct write_behind *wb, struct wb_buffer *buf,
+		const char *key, int ksiz, const char *value, int vsiz)
+{
+	unsigned long long now;
+
+	pthread_mutex_lock(&buf->mutex);
+	if (buf->nrecs >= write_behind) {
+		__sync_fetch_and_add(&wb->blocked, 1);
+		do {
+			pthread_cond_signal(&wb->wakeup);
+			pthread_cond_wait(&buf->not_full, &buf->mutex);
+		} while (buf->nrecs >= write_behind);
+	}
+
+	now = now_us();
+	tclistpush(buf->recs, key, ksiz);
+	tclistpush(buf->recs, value, vsiz);
+	if (!buf->nrecs)
+		buf->first_us = now;
+	buf->sum_us += now;
+	buf->nrecs++;
+	if (buf->nrecs == (write_behind + 1) / 2)
+		pthread_cond_signal(&wb->wakeup);
+	pthread_mutex_unlock(&buf->mutex);
+}
+
+static void wb_put_test(void *db, int num, int vsiz, unsigned int seed)
+{
+	struct tc_db *tc = db;
+	struct write_behind *wb = tc->wb;
+	struct wb_buffer *buf = wb_buffer_new(wb);
+	struct keygen keygen;
+	char *value = xmalloc(vsiz);
+	int i;
+
+	keygen_init(&keygen, seed);
+
+	for (i = 0; i < num; i++) {
+		const char *key = keygen_next_key(&keygen);
+
+		wb_put(wb, buf, key, strlen(key), value, vsiz);
+	}
+
+	wb_buffer_retire(wb, buf);
 	free(value);
 }
 
+/* Records still buffered at report time are flushed later */
+static void wb_report(struct write_behind *wb)
+{
+	unsigned long long pending = 0;
+	struct wb_buffer *buf;
+
+	pthread_mutex_lock(&wb->mutex);
+	for (buf = wb->buffers; buf; buf = buf->next) {
+		pthread_mutex_lock(&buf->mutex);
+		pending += buf->nrecs;
+		pthread_mutex_unlock(&buf->mutex);
+	}
+
+	printf("# write-behind records batches avg-batch lag-avg(ms) "
+		"lag-max(ms) blocked pending\n");
+	printf("# write-behind %llu %llu %.1f %.3f %.3f %llu %llu\n",
+		wb->records, wb->batches,
+		wb->batches ? (double)wb->records / wb->batches : 0.0,
+		wb->records ? (double)wb->lag_sum_us / wb->records / 1000 : 0.0,
+		wb->lag_max_us / 1000.0, wb->blocked, pending);
+
+	wb->records = 0;
+	wb->batches = 0;
+	wb->lag_sum_us = 0;
+	wb->lag_max_us = 0;
+	wb->blocked = 0;
+	pthread_mutex_unlock(&wb->mutex);
+}
+
 static void check_keys(TCLIST *list, int num, unsigned int seed)
 {
 	int i;
@@ -133,189 +662,338 @@ static void check_keys(TCLIST *list, int num, unsigned int seed)
 
 static void fwmkeys_test(void *db, int num, unsigned int seed)
 {
-	TCADB *adb = db;
+	struct tc_db *tc = db;
 	struct keygen keygen;
 	char prefix[KEYGEN_PREFIX_SIZE + 1];
 	TCLIST *list;
+	int i, j;
 
 	keygen_init(&keygen, seed);
+	keygen_prefix(&keygen, prefix);
+
+	list = tcadbfwmkeys2(tc->adbs[0], prefix, -1);
+	for (i = 1; i < tc->nr_shards; i++) {
+		TCLIST *part = tcadbfwmkeys2(tc->adbs[i], prefix, -1);
+
+		for (j = 0; j < tclistnum(part); j++) {
+			int ksiz;
+			const char *key = tclistval(part, j, &ksiz);
 
-	list = tcadbfwmkeys2(adb, keygen_prefix(&keygen, prefix), -1);
+			tclistpush(list, key, ksiz);
+		}
+		tclistdel(part);
+	}
+	if (tc->nr_shards > 1)
+		tclistsort(list);
 	check_keys(list, num, seed);
 
 	tclistdel(list);
 }
 
-static void check_records(TCLIST *recs, struct keygen *keygen, int vsiz,
-			int batch)
+/* A getlist reply holds the requested keys in order with their values */
+static void check_reply(TCLIST *request, TCLIST *reply, int vsiz)
 {
 	int i;
-	int recnum;
 
 	if (!debug)
 		return;
 
-	if (!recs && batch > 0)
-		die("No records returned");
-
-	recnum = tclistnum(recs);
-
-	if (recnum != batch * 2)
-		die("Unexpected list size %d", recnum);
+	if (tclistnum(reply) != tclistnum(request) * 2)
+		die("Unexpected list size %d", tclistnum(reply));
 
-	for (i = 0; i < recnum; i += 2) {
-		int keysiz;
-		const char *key = tclistval(recs, i, &keysiz);
-		int valsiz;
+	for (i = 0; i < tclistnum(request); i++) {
+		int ksiz, keysiz, valsiz;
+		const char *key = tclistval(request, i, &ksiz);
+		const char *rkey = tclistval(reply, i * 2, &keysiz);
 
-		if (strncmp(keygen_next_key(keygen), key, keysiz))
+		if (ksiz != keysiz || memcmp(key, rkey, ksiz))
 			die("Unexpected key");
-		tclistval(recs, i + 1, &valsiz);
+
+		tclistval(reply, i * 2 + 1, &valsiz);
 		if (valsiz != vsiz)
 			die("Unexpected value size %d", valsiz);
 	}
 }
 
+static void getlist_shards(struct shard_lists *sl, const char *command,
+			int vsiz)
+{
+	int i;
+
+	for (i = 0; i < sl->tc->nr_shards; i++) {
+		TCLIST *recs;
+
+		if (!tclistnum(sl->lists[i]))
+			continue;
+
+		recs = do_tcadbmisc(sl->tc->adbs[i], command, sl->lists[i]);
+		check_reply(sl->lists[i], recs, vsiz);
+		tclistdel(recs);
+	}
+}
+
 static void getlist_test(void *db, const char *command, int num, int vsiz,
 			int batch, unsigned int seed)
 {
-	TCADB *adb = db;
+	struct tc_db *tc = db;
 	struct keygen keygen;
-	struct keygen keygen_for_check;
-	TCLIST *list = tclistnew();
-	TCLIST *recs;
+	struct shard_lists sl;
+	unsigned long long start;
 	int i;
 
 	keygen_init(&keygen, seed);
-	keygen_init(&keygen_for_check, seed);
+	shard_lists_init(&sl, tc);
+	start = batch_start();
 
 	for (i = 0; i < num; i++) {
-		tclistpush2(list, keygen_next_key(&keygen));
+		shard_lists_push(&sl, keygen_next_key(&keygen), NULL, 0);
 
-		if (tclistnum(list) >= batch) {
-			recs = do_tcadbmisc(adb, command, list);
-			check_records(recs, &keygen_for_check, vsiz,
-					tclistnum(list));
-			tclistdel(recs);
-			tclistclear(list);
+		if (sl.nrecs >= batch) {
+			getlist_shards(&sl, command, vsiz);
+			batch = batch_end(batch, sl.nrecs, start);
+			shard_lists_clear(&sl);
+			start = batch_start();
 		}
 	}
-	if (tclistnum(list)) {
-		recs = do_tcadbmisc(adb, command, list);
-		check_records(recs, &keygen_for_check, vsiz, tclistnum(list));
-		tclistdel(recs);
-	}
+	if (sl.nrecs)
+		getlist_shards(&sl, command, vsiz);
 
-	tclistdel(list);
+	shard_lists_destroy(&sl);
 }
 
-static void range_nonatomic_test(void *db, int num, int vsiz, int batch,
-			unsigned int seed)
+/*
+ * Range scan state of one shard.  Records are fetched batch by batch
+ * with the range or range_atomic misc command, or read one by one from
+ * a B+tree cursor with -native, and handed out one by one so that the
+ * scans of all shards can be merged in key order.
+ */
+struct range_cursor {
+	TCADB *adb;
+	bool atomic;
+	TCLIST *args;
+	TCLIST *recs;
+	int pos;
+	bool done;
+	BDBCUR *bcur;
+	TCXSTR *kxstr;
+	TCXSTR *vxstr;
+	char prefix[KEYGEN_PREFIX_SIZE + 1];
+	bool fetched;
+};
+
+static void range_cursor_init(struct range_cursor *cur, struct tc_db *tc,
+			int shard, bool atomic, struct keygen *keygen, int batch)
 {
-	TCADB *adb = db;
-	struct keygen keygen;
-	TCLIST *args = tclistnew();
 	char start_key[KEYGEN_PREFIX_SIZE + 1];
 	char max[100];
 	char end_key[KEYGEN_PREFIX_SIZE + 1];
 
-	keygen_init(&keygen, seed);
-
-	keygen_prefix(&keygen, start_key);
+	keygen_prefix(keygen, start_key);
 	sprintf(max, "%d", batch);
-	keygen_prefix(&keygen, end_key);
+	keygen_prefix(keygen, end_key);
 	end_key[KEYGEN_PREFIX_SIZE - 1] = '-' + 1;
 
-	tclistpush2(args, start_key);
-	tclistpush2(args, max);
-	tclistpush2(args, end_key);
+	cur->adb = tc->adbs[shard];
+	cur->atomic = atomic;
+	cur->recs = NULL;
+	cur->pos = 0;
+	cur->done = false;
+	cur->bcur = NULL;
+
+	if (tc->natives) {
+		TCBDB *bdb = tc->natives[shard].bdb;
+
+		if (!bdb)
+			die("range needs a B+tree database with -native");
+
+		cur->args = NULL;
+		cur->bcur = tcbdbcurnew(bdb);
+		cur->kxstr = tcxstrnew();
+		cur->vxstr = tcxstrnew();
+		cur->fetched = false;
+		memcpy(cur->prefix, start_key, sizeof(cur->prefix));
+		if (!tcbdbcurjump(cur->bcur, start_key, KEYGEN_PREFIX_SIZE))
+			cur->done = true;
+		return;
+	}
 
-	while (1) {
-		TCLIST *recs;
-		int num_recs;
+	cur->args = tclistnew();
 
-		recs = do_tcadbmisc(adb, "range", args);
-		num_recs = tclistnum(recs) / 2;
-		if (!num_recs)
-			break;
+	tclistpush2(cur->args, start_key);
+	tclistpush2(cur->args, max);
+	tclistpush2(cur->args, end_key);
+	if (atomic)
+		tclistpush2(cur->args, "0");
+}
 
-		check_records(recs, &keygen, vsiz, num < batch ? num : batch);
-		/* overwrite start_key by the last one + '\0' */
-		tclistover(args, 0, tclistval2(recs, 2 * (num_recs - 1)), KEYGEN_KEY_SIZE + 1);
-		tclistdel(recs);
-		num -= num_recs;
+static void range_cursor_destroy(struct range_cursor *cur)
+{
+	if (cur->bcur) {
+		tcbdbcurdel(cur->bcur);
+		tcxstrdel(cur->kxstr);
+		tcxstrdel(cur->vxstr);
+		return;
 	}
-	if (debug && num)
-		die("Unexpected record num: %d", num);
+	if (cur->recs)
+		tclistdel(cur->recs);
+	tclistdel(cur->args);
+}
 
-	tclistdel(args);
+static const char *range_cursor_peek_native(struct range_cursor *cur,
+					int *ksiz)
+{
+	if (!cur->fetched && !cur->done) {
+		if (tcbdbcurrec(cur->bcur, cur->kxstr, cur->vxstr) &&
+		    tcxstrsize(cur->kxstr) >= KEYGEN_PREFIX_SIZE &&
+		    !memcmp(tcxstrptr(cur->kxstr), cur->prefix,
+				KEYGEN_PREFIX_SIZE))
+			cur->fetched = true;
+		else
+			cur->done = true;
+	}
+	if (!cur->fetched)
+		return NULL;
+
+	*ksiz = tcxstrsize(cur->kxstr);
+	return tcxstrptr(cur->kxstr);
 }
 
-static void range_atomic_test(void *db, int num, int vsiz, int batch,
-			unsigned int seed)
+/* Returns the next key of the shard without consuming it, or NULL */
+static const char *range_cursor_peek(struct range_cursor *cur, int batch,
+				int *ksiz)
 {
-	TCADB *adb = db;
-	struct keygen keygen;
-	TCLIST *args = tclistnew();
-	char start_key[KEYGEN_PREFIX_SIZE + 1];
 	char max[100];
-	char end_key[KEYGEN_PREFIX_SIZE + 1];
-	char binc[2];
+	int num_recs;
+
+	if (cur->bcur)
+		return range_cursor_peek_native(cur, ksiz);
+
+	if (cur->recs && cur->pos < tclistnum(cur->recs))
+		return tclistval(cur->recs, cur->pos, ksiz);
+	if (cur->done)
+		return NULL;
+
+	if (cur->recs) {
+		num_recs = tclistnum(cur->recs) / 2;
+		if (cur->atomic) {
+			tclistover2(cur->args, 0,
+				tclistval2(cur->recs, 2 * (num_recs - 1)));
+		} else {
+			/* overwrite start_key by the last one + '\0' */
+			tclistover(cur->args, 0,
+				tclistval2(cur->recs, 2 * (num_recs - 1)),
+				KEYGEN_KEY_SIZE + 1);
+		}
+		tclistdel(cur->recs);
+	}
+	sprintf(max, "%d", batch);
+	tclistover2(cur->args, 1, max);
+
+	cur->recs = do_tcadbmisc(cur->adb,
+			cur->atomic ? "range_atomic" : "range", cur->args);
+	cur->pos = 0;
+	if (!tclistnum(cur->recs)) {
+		cur->done = true;
+		return NULL;
+	}
 
-	keygen_init(&keygen, seed);
+	return tclistval(cur->recs, 0, ksiz);
+}
 
-	keygen_prefix(&keygen, start_key);
-	sprintf(max, "%d", batch);
-	keygen_prefix(&keygen, end_key);
-	end_key[KEYGEN_PREFIX_SIZE - 1] = '-' + 1;
-	sprintf(binc, "0");
+/* Consumes the record last peeked at and returns its value size */
+static int range_cursor_next(struct range_cursor *cur)
+{
+	int vsiz;
 
-	tclistpush2(args, start_key);
-	tclistpush2(args, max);
-	tclistpush2(args, end_key);
-	tclistpush2(args, binc);
+	if (cur->bcur) {
+		vsiz = tcxstrsize(cur->vxstr);
+		cur->fetched = false;
+		tcbdbcurnext(cur->bcur);
+		return vsiz;
+	}
 
-	while (1) {
-		TCLIST *recs;
-		int num_recs;
+	tclistval(cur->recs, cur->pos + 1, &vsiz);
+	cur->pos += 2;
 
-		recs = do_tcadbmisc(adb, "range_atomic", args);
-		num_recs = tclistnum(recs) / 2;
-		if (!num_recs)
+	return vsiz;
+}
+
+static void range_merged_test(void *db, bool atomic, int num, int vsiz,
+			int batch, unsigned int seed)
+{
+	struct tc_db *tc = db;
+	struct keygen keygen;
+	struct range_cursor *curs;
+	int nrecs = 0;
+	int i;
+
+	keygen_init(&keygen, seed);
+	curs = xmalloc(sizeof(*curs) * tc->nr_shards);
+	for (i = 0; i < tc->nr_shards; i++)
+		range_cursor_init(&curs[i], tc, i, atomic, &keygen, batch);
+
+	while (1) {
+		unsigned long long start = batch_start();
+		int n;
+
+		for (n = 0; n < batch; n++) {
+			const char *key, *min = NULL;
+			int ksiz, minsiz = 0, valsiz;
+			struct range_cursor *next = NULL;
+
+			for (i = 0; i < tc->nr_shards; i++) {
+				key = range_cursor_peek(&curs[i], batch, &ksiz);
+				if (key && (!min || strcmp(key, min) < 0)) {
+					min = key;
+					minsiz = ksiz;
+					next = &curs[i];
+				}
+			}
+			if (!next)
+				break;
+
+			if (debug && strncmp(keygen_next_key(&keygen), min,
+						minsiz))
+				die("Unexpected key");
+			valsiz = range_cursor_next(next);
+			if (debug && valsiz != vsiz)
+				die("Unexpected value size %d", valsiz);
+		}
+		if (!n)
 			break;
 
-		check_records(recs, &keygen, vsiz, num < batch ? num : batch);
-		tclistover2(args, 0, tclistval2(recs, 2 * (num_recs - 1)));
-		tclistdel(recs);
-		num -= num_recs;
+		nrecs += n;
+		batch = batch_end(batch, n, start);
 	}
-	if (debug && num)
-		die("Unexpected record num: %d", num);
+	if (debug && num != nrecs)
+		die("Unexpected record num: %d", num - nrecs);
 
-	tclistdel(args);
+	for (i = 0; i < tc->nr_shards; i++)
+		range_cursor_destroy(&curs[i]);
+	free(curs);
 }
 
 static void range_test(void *db, const char *command, int num, int vsiz,
 			int batch, unsigned int seed)
 {
 	if (!strcmp(command, "range"))
-		return range_nonatomic_test(db, num, vsiz, batch, seed);
+		return range_merged_test(db, false, num, vsiz, batch, seed);
 	else if (!strcmp(command, "range_atomic"))
-		return range_atomic_test(db, num, vsiz, batch, seed);
+		return range_merged_test(db, true, num, vsiz, batch, seed);
 
 	die("invalid range command");
 }
 
-static void rangeout_test(void *db, const char *command, int num, int vsiz,
-			int batch, unsigned int seed)
+static int rangeout_shard(TCADB *adb, const char *command, int num, int batch,
+			unsigned int seed)
 {
-	TCADB *adb = db;
 	struct keygen keygen;
 	TCLIST *args = tclistnew();
 	char start_key[KEYGEN_PREFIX_SIZE + 1];
 	char max[100];
 	char end_key[KEYGEN_PREFIX_SIZE + 1];
 	char binc[2];
+	int nrecs = 0;
 
 	keygen_init(&keygen, seed);
 
@@ -332,22 +1010,95 @@ static void rangeout_test(void *db, const char *command, int num, int vsiz,
 
 	while (1) {
 		TCLIST *recs;
+		int num_recs;
+		unsigned long long start = batch_start();
 
 		recs = do_tcadbmisc(adb, command, args);
 		if (tclistnum(recs) == 0)
 			break;
 
-		if (debug) {
-			const char *num_recs = tclistval2(recs, 0);
-			num -= atoi(num_recs);
-			if (num != 0 && atoi(num_recs) != batch)
+		num_recs = atoi(tclistval2(recs, 0));
+		/* Only a single shard knows how many records it must delete */
+		if (debug && nr_shards == 1) {
+			num -= num_recs;
+			if (num != 0 && num_recs != batch)
 				die("Unexpected number of records are deleted");
 		}
+		batch = batch_end(batch, num_recs, start);
+		sprintf(max, "%d", batch);
+		tclistover2(args, 1, max);
+		nrecs += num_recs;
 
 		tclistdel(recs);
 	}
-	if (debug && num != 0)
+
+	tclistdel(args);
+
+	return nrecs;
+}
+
+static void rangeout_test(void *db, const char *command, int num, int vsiz,
+			int batch, unsigned int seed)
+{
+	struct tc_db *tc = db;
+	int nrecs = 0;
+	int i;
+
+	for (i = 0; i < tc->nr_shards; i++)
+		nrecs += rangeout_shard(tc->adbs[i], command, num, batch, seed);
+
+	if (debug && num != nrecs)
 		die("Unexpected number of records are deleted");
+}
+
+/* The shards are scanned one after another, the scan is one partition */
+static void scan_test(void *db, const char *start, const char *end, int batch,
+		unsigned long long *records, unsigned long long *bytes)
+{
+	struct tc_db *tc = db;
+	TCLIST *args = tclistnew();
+	char max[100];
+	int i, shard;
+
+	*records = 0;
+	*bytes = 0;
+
+	for (shard = 0; shard < tc->nr_shards; shard++) {
+		int n = batch;
+
+		tclistclear(args);
+		sprintf(max, "%d", n);
+		tclistpush2(args, start);
+		tclistpush2(args, max);
+		tclistpush2(args, end);
+
+		while (1) {
+			unsigned long long bstart = batch_start();
+			TCLIST *recs = do_tcadbmisc(tc->adbs[shard], "range",
+							args);
+			int num_recs = tclistnum(recs) / 2;
+			const char *last;
+			int siz;
+
+			if (!num_recs) {
+				tclistdel(recs);
+				break;
+			}
+			for (i = 0; i < tclistnum(recs); i++) {
+				tclistval(recs, i, &siz);
+				*bytes += siz;
+			}
+			*records += num_recs;
+
+			n = batch_end(n, num_recs, bstart);
+			sprintf(max, "%d", n);
+			tclistover2(args, 1, max);
+			/* overwrite start_key by the last one + '\0' */
+			last = tclistval(recs, 2 * (num_recs - 1), &siz);
+			tclistover(args, 0, last, siz + 1);
+			tclistdel(recs);
+		}
+	}
 
 	tclistdel(args);
 }
@@ -355,28 +1106,556 @@ static void rangeout_test(void *db, const char *command, int num, int vsiz,
 static void outlist_test(void *db, const char *command, int num, int batch,
 			unsigned int seed)
 {
-	TCADB *adb = db;
+	struct tc_db *tc = db;
 	struct keygen keygen;
-	TCLIST *list = tclistnew();
+	struct shard_lists sl;
+	unsigned long long start;
 	int i;
 
 	keygen_init(&keygen, seed);
+	shard_lists_init(&sl, tc);
+	start = batch_start();
 
 	for (i = 0; i < num; i++) {
-		tclistpush2(list, keygen_next_key(&keygen));
+		shard_lists_push(&sl, keygen_next_key(&keygen), NULL, 0);
 
-		if (tclistnum(list) >= batch) {
-			tclistdel(do_tcadbmisc(adb, command, list));
-			tclistclear(list);
+		if (sl.nrecs >= batch) {
+			shard_lists_misc(&sl, command);
+			batch = batch_end(batch, sl.nrecs, start);
+			shard_lists_clear(&sl);
+			start = batch_start();
 		}
 	}
-	if (tclistnum(list))
-		tclistdel(do_tcadbmisc(adb, command, list));
+	if (sl.nrecs)
+		shard_lists_misc(&sl, command);
 
-	tclistdel(list);
+	shard_lists_destroy(&sl);
+}
+
+static struct native_db *key_native(struct tc_db *tc, const char *key,
+				int ksiz)
+{
+	return &tc->natives[key_shard(tc, key, ksiz)];
+}
+
+static void native_put(struct native_db *nd, const char *key, int ksiz,
+			const char *value, int vsiz)
+{
+	if (nd->hdb)
+		tchdbput(nd->hdb, key, ksiz, value, vsiz);
+	else
+		tcbdbput(nd->bdb, key, ksiz, value, vsiz);
+}
+
+/* Returns the value size, or -1 if the record does not exist */
+static int native_get(struct native_db *nd, const char *key, int ksiz,
+			char *buf, int max)
+{
+	void *value;
+	int siz;
+
+	if (nd->hdb)
+		return tchdbget3(nd->hdb, key, ksiz, buf, max);
+
+	/* tcbdbget3() points into a leaf other threads may evict, copy */
+	value = tcbdbget(nd->bdb, key, ksiz, &siz);
+	if (!value)
+		return -1;
+	free(value);
+
+	return siz;
+}
+
+static void native_out(struct native_db *nd, const char *key, int ksiz)
+{
+	if (nd->hdb)
+		tchdbout(nd->hdb, key, ksiz);
+	else
+		tcbdbout(nd->bdb, key, ksiz);
+}
+
+/* Shards are always locked in order, so batches cannot deadlock */
+static void native_tranbegin(struct tc_db *tc)
+{
+	int i;
+
+	for (i = 0; i < tc->nr_shards; i++) {
+		struct native_db *nd = &tc->natives[i];
+
+		if (nd->hdb ? !tchdbtranbegin(nd->hdb) :
+			      !tcbdbtranbegin(nd->bdb))
+			die("transaction begin failed");
+	}
+}
+
+static void native_trancommit(struct tc_db *tc)
+{
+	int i;
+
+	for (i = 0; i < tc->nr_shards; i++) {
+		struct native_db *nd = &tc->natives[i];
+
+		if (nd->hdb ? !tchdbtrancommit(nd->hdb) :
+			      !tcbdbtrancommit(nd->bdb))
+			die("transaction commit failed");
+	}
+}
+
+static bool is_atomic(const char *command)
+{
+	return strstr(command, "_atomic") != NULL;
+}
+
+static void native_put_test(void *db, int num, int vsiz, unsigned int seed)
+{
+	struct tc_db *tc = db;
+	struct keygen keygen;
+	char *value = xmalloc(vsiz);
+	int i;
+
+	keygen_init(&keygen, seed);
+
+	for (i = 0; i < num; i++) {
+		const char *key = keygen_next_key(&keygen);
+		int ksiz = strlen(key);
+
+		native_put(key_native(tc, key, ksiz), key, ksiz, value, vsiz);
+	}
+
+	free(value);
+}
+
+static void native_get_test(void *db, int num, int vsiz, unsigned int seed)
+{
+	struct tc_db *tc = db;
+	struct keygen keygen;
+	char *buf = xmalloc(vsiz + 1);
+	int i;
+
+	keygen_init(&keygen, seed);
+
+	for (i = 0; i < num; i++) {
+		const char *key = keygen_next_key(&keygen);
+		int ksiz = strlen(key);
+		int siz;
+
+		siz = native_get(key_native(tc, key, ksiz), key, ksiz, buf,
+				vsiz + 1);
+		if (debug && vsiz != siz)
+			die("Unexpected value size: %d", siz);
+	}
+
+	free(buf);
 }
 
-struct benchmark_config config = {
+static void native_putlist_test(void *db, const char *command, int num,
+			int vsiz, int batch, unsigned int seed)
+{
+	struct tc_db *tc = db;
+	bool atomic = is_atomic(command);
+	struct keygen keygen;
+	char *value = xmalloc(vsiz);
+	unsigned long long start;
+	int i, n;
+
+	keygen_init(&keygen, seed);
+
+	for (i = 0; i < num; i += n) {
+		start = batch_start();
+		if (atomic)
+			native_tranbegin(tc);
+
+		for (n = 0; n < batch && i + n < num; n++) {
+			const char *key = keygen_next_key(&keygen);
+			int ksiz = strlen(key);
+
+			native_put(key_native(tc, key, ksiz), key, ksiz,
+				value, vsiz);
+		}
+
+		if (atomic)
+			native_trancommit(tc);
+		batch = batch_end(batch, n, start);
+	}
+
+	free(value);
+}
+
+static void native_getlist_test(void *db, const char *command, int num,
+			int vsiz, int batch, unsigned int seed)
+{
+	struct tc_db *tc = db;
+	bool atomic = is_atomic(command);
+	struct keygen keygen;
+	char *buf = xmalloc(vsiz + 1);
+	unsigned long long start;
+	int i, n;
+
+	keygen_init(&keygen, seed);
+
+	for (i = 0; i < num; i += n) {
+		start = batch_start();
+		if (atomic)
+			native_tranbegin(tc);
+
+		for (n = 0; n < batch && i + n < num; n++) {
+			const char *key = keygen_next_key(&keygen);
+			int ksiz = strlen(key);
+			int siz;
+
+			siz = native_get(key_native(tc, key, ksiz), key, ksiz,
+					buf, vsiz + 1);
+			if (debug && vsiz != siz)
+				die("Unexpected value size: %d", siz);
+		}
+
+		if (atomic)
+			native_trancommit(tc);
+		batch = batch_end(batch, n, start);
+	}
+
+	free(buf);
+}
+
+static void native_outlist_test(void *db, const char *command, int num,
+			int batch, unsigned int seed)
+{
+	struct tc_db *tc = db;
+	bool atomic = is_atomic(command);
+	struct keygen keygen;
+	unsigned long long start;
+	int i, n;
+
+	keygen_init(&keygen, seed);
+
+	for (i = 0; i < num; i += n) {
+		start = batch_start();
+		if (atomic)
+			native_tranbegin(tc);
+
+		for (n = 0; n < batch && i + n < num; n++) {
+			const char *key = keygen_next_key(&keygen);
+			int ksiz = strlen(key);
+
+			native_out(key_native(tc, key, ksiz), key, ksiz);
+		}
+
+		if (atomic)
+			native_trancommit(tc);
+		batch = batch_end(batch, n, start);
+	}
+}
+
+/* Delete the prefix from one shard with a cursor, a batch at a time */
+static int native_rangeout_shard(struct tc_db *tc, int shard, bool atomic,
+				int batch, unsigned int seed)
+{
+	TCBDB *bdb = tc->natives[shard].bdb;
+	struct keygen keygen;
+	char prefix[KEYGEN_PREFIX_SIZE + 1];
+	int nrecs = 0;
+
+	if (!bdb)
+		die("rangeout needs a B+tree database with -native");
+
+	keygen_init(&keygen, seed);
+	keygen_prefix(&keygen, prefix);
+
+	while (1) {
+		unsigned long long start = batch_start();
+		BDBCUR *cur;
+		int n = 0;
+
+		if (atomic && !tcbdbtranbegin(bdb))
+			die("transaction begin failed");
+
+		cur = tcbdbcurnew(bdb);
+		if (tcbdbcurjump(cur, prefix, KEYGEN_PREFIX_SIZE)) {
+			while (n < batch) {
+				const char *key;
+				int ksiz;
+
+				key = tcbdbcurkey3(cur, &ksiz);
+				if (!key || ksiz < KEYGEN_PREFIX_SIZE ||
+				    memcmp(key, prefix, KEYGEN_PREFIX_SIZE))
+					break;
+				if (!tcbdbcurout(cur))
+					break;
+				n++;
+			}
+		}
+		tcbdbcurdel(cur);
+
+		if (atomic && !tcbdbtrancommit(bdb))
+			die("transaction commit failed");
+
+		if (!n)
+			break;
+		nrecs += n;
+		batch = batch_end(batch, n, start);
+	}
+
+	return nrecs;
+}
+
+static void native_rangeout_test(void *db, const char *command, int num,
+			int vsiz, int batch, unsigned int seed)
+{
+	struct tc_db *tc = db;
+	int nrecs = 0;
+	int i;
+
+	for (i = 0; i < tc->nr_shards; i++)
+		nrecs += native_rangeout_shard(tc, i, is_atomic(command),
+						batch, seed);
+
+	if (debug && num != nrecs)
+		die("Unexpected number of records are deleted");
+}
+
+/*
+ * Tuning explorer (-explore name=v1,v2,...)
+ *
+ * Every -explore adds one dimension of TC tuning parameters (bnum, apow,
+ * xmsiz, lcnum, opts, ...).  The workload given on the command line, a
+ * single command or a -scenario, is run once for every point of the
+ * grid, each time on a database rebuilt from scratch with the point's
+ * parameters appended to -path.  Every point runs in a child process,
+ * so that memory held by earlier points cannot inflate its peak RSS.
+ * Throughput, database size (sampled before the database is closed) and
+ * peak RSS of the child are reported per point, followed by the point
+ * with the best throughput.
+ */
+
+#define EXPLORE_MAX_DIMS 8
+#define EXPLORE_MAX_VALUES 16
+
+struct explore_dim {
+	char *name;
+	char *values[EXPLORE_MAX_VALUES];
+	int nr_values;
+};
+
+static struct explore_dim explore_dims[EXPLORE_MAX_DIMS];
+static int nr_explore_dims;
+
+/* Sampled by report() at the end of every run */
+static unsigned long long last_db_size;
+
+static void add_explore_dim(const char *spec)
+{
+	struct explore_dim *dim;
+	char *value, *saveptr;
+
+	if (nr_explore_dims >= EXPLORE_MAX_DIMS)
+		die("Too many -explore parameters");
+	dim = &explore_dims[nr_explore_dims++];
+
+	dim->name = strdup(spec);
+	value = strchr(dim->name, '=');
+	if (!value)
+		die("Invalid -explore parameter: %s", spec);
+	*value++ = '\0';
+
+	dim->nr_values = 0;
+	for (value = strtok_r(value, ",", &saveptr); value;
+	     value = strtok_r(NULL, ",", &saveptr)) {
+		if (dim->nr_values >= EXPLORE_MAX_VALUES)
+			die("Too many values for -explore %s", dim->name);
+		dim->values[dim->nr_values++] = value;
+	}
+	if (!dim->nr_values)
+		die("Invalid -explore parameter: %s", spec);
+}
+
+static void report(struct benchmark_config *config)
+{
+	int i;
+
+	last_db_size = 0;
+	if (tcdb) {
+		for (i = 0; i < tcdb->nr_shards; i++)
+			last_db_size += tcadbsize(tcdb->adbs[i]);
+		if (tcdb->wb)
+			wb_report(tcdb->wb);
+	}
+}
+
+#ifndef BENCHMARK_PLUGIN
+
+static void remove_db_files(const char *path)
+{
+	int i;
+
+	for (i = 0; i < nr_shards; i++) {
+		char *file = shard_path(path, i);
+		char *opts = strchr(file, '#');
+
+		if (opts)
+			*opts = '\0';
+		if (file[0] != '*' && file[0] != '+')
+			unlink(file);
+		free(file);
+	}
+}
+
+struct explore_point {
+	char *path;
+	double rate;
+	unsigned long long db_size;
+	unsigned long long rss;
+};
+
+static void explore_point_run(struct benchmark_config *base,
+			struct explore_point *point)
+{
+	struct benchmark_config config = *base;
+	unsigned long long records = 0, elapsed = 0;
+	struct rusage usage;
+	int i;
+
+	config.path = point->path;
+	config.results = NULL;
+	config.nr_results = 0;
+
+	remove_db_files(point->path);
+	benchmark(&config);
+
+	for (i = 0; i < config.nr_results; i++) {
+		records += config.results[i].records;
+		elapsed += config.results[i].elapsed;
+		free(config.results[i].name);
+	}
+	free(config.results);
+
+	point->rate = elapsed ? (double)records * 1000000 / elapsed : 0;
+	point->db_size = last_db_size;
+	getrusage(RUSAGE_SELF, &usage);
+	point->rss = usage.ru_maxrss * 1024ULL;
+}
+
+/* The child sends the measured point back through a pipe */
+static void explore_run(struct benchmark_config *base,
+			struct explore_point *point)
+{
+	int fds[2];
+	pid_t pid;
+	int status;
+
+	if (pipe(fds))
+		die("pipe failed");
+
+	pid = fork();
+	if (pid < 0)
+		die("fork failed");
+	if (!pid) {
+		close(fds[0]);
+		explore_point_run(base, point);
+		if (write(fds[1], point, sizeof(*point)) != sizeof(*point))
+			die("write failed");
+		exit(0);
+	}
+
+	close(fds[1]);
+	if (read(fds[0], point, sizeof(*point)) != sizeof(*point))
+		die("explore point failed: %s", point->path);
+	close(fds[0]);
+
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status))
+		die("explore point failed: %s", point->path);
+}
+
+static void explore(struct benchmark_config *config)
+{
+	struct explore_point *points;
+	int idx[EXPLORE_MAX_DIMS];
+	int nr_points = 1;
+	int best = 0;
+	int i, j;
+
+	for (i = 0; i < nr_explore_dims; i++)
+		nr_points *= explore_dims[i].nr_values;
+	points = xmalloc(sizeof(*points) * nr_points);
+	memset(idx, 0, sizeof(idx));
+
+	for (i = 0; i < nr_points; i++) {
+		struct explore_point *point = &points[i];
+		int len = strlen(config->path) + 1;
+		char *p;
+
+		for (j = 0; j < nr_explore_dims; j++) {
+			len += strlen(explore_dims[j].name) + 2 +
+				strlen(explore_dims[j].values[idx[j]]);
+		}
+		point->path = p = xmalloc(len);
+		p += sprintf(p, "%s", config->path);
+		for (j = 0; j < nr_explore_dims; j++) {
+			p += sprintf(p, "#%s=%s", explore_dims[j].name,
+					explore_dims[j].values[idx[j]]);
+		}
+
+		printf("# explore %d/%d %s\n", i + 1, nr_points, point->path);
+		fflush(stdout);
+		explore_run(config, point);
+		if (point->rate > points[best].rate)
+			best = i;
+
+		/* Next point, the last dimension varies fastest */
+		for (j = nr_explore_dims - 1; j >= 0; j--) {
+			if (++idx[j] < explore_dims[j].nr_values)
+				break;
+			idx[j] = 0;
+		}
+	}
+	remove_db_files(points[nr_points - 1].path);
+
+	printf("# explore point records/s size(MB) rss(MB) path\n");
+	for (i = 0; i < nr_points; i++) {
+		printf("%d %.1f %.1f %.1f %s\n", i + 1, points[i].rate,
+			points[i].db_size / 1048576.0,
+			points[i].rss / 1048576.0, points[i].path);
+	}
+	printf("# recommended %s (%.1f records/s, %.1f MB, rss %.1f MB)\n",
+		points[best].path, points[best].rate,
+		points[best].db_size / 1048576.0,
+		points[best].rss / 1048576.0);
+
+	for (i = 0; i < nr_points; i++)
+		free(points[i].path);
+	free(points);
+}
+
+#endif /* BENCHMARK_PLUGIN */
+
+static int parse_option(struct benchmark_config *config, int argc,
+			char **argv, int i)
+{
+	if (!strcmp(argv[i], "-shards")) {
+		nr_shards = atoi(argv[i + 1]);
+		if (nr_shards < 1)
+			die("Invalid number of shards: %s", argv[i + 1]);
+		return 2;
+	} else if (!strcmp(argv[i], "-native")) {
+		native = true;
+		return 1;
+	} else if (!strcmp(argv[i], "-write-behind")) {
+		write_behind = atoi(argv[i + 1]);
+		if (write_behind < 0)
+			die("Invalid write-behind size: %s", argv[i + 1]);
+		return 2;
+	} else if (!strcmp(argv[i], "-explore")) {
+#ifdef BENCHMARK_PLUGIN
+		die("-explore is only supported by tokyocabinettest");
+#endif
+		add_explore_dim(argv[i + 1]);
+		return 2;
+	}
+
+	return 0;
+}
+
+static struct benchmark_config config = {
 	.producer = "nop",
 	.consumer = "nop",
 	.path = "data.tcb",
@@ -398,14 +1677,57 @@ struct benchmark_config config = {
 		.range_test = range_test,
 		.rangeout_test = rangeout_test,
 		.outlist_test = outlist_test,
+		.scan_test = scan_test,
+		.parse_option = parse_option,
+		.report = report,
 	},
 };
 
+static void setup(struct benchmark_config *config)
+{
+	debug = config->debug;
+
+	if (native) {
+		config->ops.put_test = native_put_test;
+		config->ops.get_test = native_get_test;
+		config->ops.putlist_test = native_putlist_test;
+		config->ops.getlist_test = native_getlist_test;
+		config->ops.rangeout_test = native_rangeout_test;
+		config->ops.outlist_test = native_outlist_test;
+	}
+	if (write_behind)
+		config->ops.put_test = wb_put_test;
+}
+
+#ifdef BENCHMARK_PLUGIN
+
+static void init_config(struct benchmark_config *plugin_config)
+{
+	/* The same plugin may be loaded for several -backend runs */
+	nr_shards = 1;
+	native = false;
+	write_behind = 0;
+	*plugin_config = config;
+}
+
+struct benchmark_plugin benchmark_plugin = {
+	.name = "tokyocabinet",
+	.init = init_config,
+	.setup = setup,
+};
+
+#else
+
 int main(int argc, char **argv)
 {
 	parse_options(&config, argc, argv);
-	debug = config.debug;
-	benchmark(&config);
+	setup(&config);
+	if (nr_explore_dims)
+		explore(&config);
+	else
+		benchmark(&config);
 
 	return 0;
 }
+
+#endif
@@ -0,0 +1,613 @@
+#include <tcutil.h>
+#include <tcadb.h>
+#include <tctdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <glob.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "testutil.h"
+
+static bool debug = false;
+
+/*
+ * Tokyo Cabinet table database benchmark
+ *
+ * Every record is a row keyed by the generated key with three columns:
+ *
+ *	seq	decimal, seed * num + i for the i-th record of a work
+ *	tag	"seed-k" with k = log2(i + 1), so that the records of a work
+ *		fall into groups of 1, 2, 4, 8, ... records
+ *	val	vsiz bytes of payload
+ *
+ * The query commands read the records of a work back by column:
+ *
+ *	query		one equality query on tag per group
+ *	query_range	range queries on seq, batch records each
+ *
+ * -index column[:type],... names a lexical (default), decimal, token or
+ * qgram index for every given column.  The query_index command sets
+ * them, so that a scenario can build them over the records its load
+ * phase stored.  An index missing from the database is built and timed,
+ * and the build time is reported along with the size of the index files
+ * and the query latency for every result-set size.
+ */
+
+#define MAX_INDEXES 8
+
+struct index_spec {
+	const char *name;
+	const char *type_name;
+	int type;
+	bool built;
+	unsigned long long build_us;
+};
+
+static struct index_spec indexes[MAX_INDEXES];
+static int nr_indexes;
+
+/* Shared by all benchmark threads */
+static TCADB *adb;
+static TCTDB *tdb;
+
+static unsigned long long now_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+static void add_indexes(const char *spec)
+{
+	char *names = strdup(spec);
+	char *name, *saveptr;
+
+	for (name = strtok_r(names, ",", &saveptr); name;
+	     name = strtok_r(NULL, ",", &saveptr)) {
+		struct index_spec *idx;
+		char *type = strchr(name, ':');
+
+		if (nr_indexes >= MAX_INDEXES)
+			die("Too many indexes");
+		idx = &indexes[nr_indexes++];
+
+		if (type)
+			*type++ = '\0';
+		else
+			type = "lexical";
+
+		idx->name = name;
+		idx->type_name = type;
+		idx->built = false;
+		idx->build_us = 0;
+		if (!strcmp(type, "lexical"))
+			idx->type = TDBITLEXICAL;
+		else if (!strcmp(type, "decimal"))
+			idx->type = TDBITDECIMAL;
+		else if (!strcmp(type, "token"))
+			idx->type = TDBITTOKEN;
+		else if (!strcmp(type, "qgram"))
+			idx->type = TDBITQGRAM;
+		else
+			die("Invalid index type: %s", type);
+	}
+}
+
+/* Existing indexes are kept, only missing ones are built and timed */
+static void set_indexes(TCTDB *tdb)
+{
+	int i;
+
+	for (i = 0; i < nr_indexes; i++) {
+		struct index_spec *idx = &indexes[i];
+		unsigned long long start = now_us();
+
+		if (tctdbsetindex(tdb, idx->name, idx->type | TDBITKEEP)) {
+			idx->built = true;
+			idx->build_us = now_us() - start;
+		} else if (tctdbecode(tdb) != TCEKEEP) {
+			die("setindex error: %s: %s", idx->name,
+				tctdberrmsg(tctdbecode(tdb)));
+		}
+	}
+}
+
+static void *open_db(struct benchmark_config *config)
+{
+	if (tdb)
+		return tdb;
+
+	adb = tcadbnew();
+
+	if (!tcadbopen(adb, config->path)) {
+		die("open error: %s", config->path);
+	}
+	if (tcadbomode(adb) != ADBOTDB)
+		die("not a table database: %s", config->path);
+	tdb = tcadbreveal(adb);
+
+	return tdb;
+}
+
+static void close_db(void *db)
+{
+	if (tdb != db)
+		return;
+
+	if (!tcadbclose(adb))
+		die("close error: %s", tcadbpath(adb));
+
+	tcadbdel(adb);
+	adb = NULL;
+	tdb = NULL;
+}
+
+static int tag_group(int i)
+{
+	int k = 0;
+
+	while ((i + 1) >> (k + 1))
+		k++;
+
+	return k;
+}
+
+static void fill_columns(TCMAP *cols, unsigned int seed, int num, int i,
+			const char *value, int vsiz)
+{
+	char buf[64];
+
+	tcmapclear(cols);
+	sprintf(buf, "%llu", (unsigned long long)seed * num + i);
+	tcmapput2(cols, "seq", buf);
+	sprintf(buf, "%u-%d", seed, tag_group(i));
+	tcmapput2(cols, "tag", buf);
+	tcmapput(cols, "val", 3, value, vsiz);
+}
+
+static char *new_value(int vsiz)
+{
+	char *value = xmalloc(vsiz);
+
+	/* Column values are compared as strings by queries */
+	memset(value, 'x', vsiz);
+
+	return value;
+}
+
+static void do_put(TCTDB *tdb, const char *key, TCMAP *cols)
+{
+	if (!tctdbput(tdb, key, strlen(key), cols))
+		die("put error: %s", tctdberrmsg(tctdbecode(tdb)));
+}
+
+static void do_get(TCTDB *tdb, const char *key, int vsiz)
+{
+	TCMAP *cols = tctdbget(tdb, key, strlen(key));
+	int siz = 0;
+
+	if (debug) {
+		if (!cols)
+			die("No record: %s", key);
+		if (!tcmapget(cols, "val", 3, &siz))
+			die("No val column: %s", key);
+		if (siz != vsiz)
+			die("Unexpected value size: %d", siz);
+	}
+	if (cols)
+		tcmapdel(cols);
+}
+
+static void do_out(TCTDB *tdb, const char *key)
+{
+	if (!tctdbout(tdb, key, strlen(key)) && debug)
+		die("out error: %s", tctdberrmsg(tctdbecode(tdb)));
+}
+
+static bool is_atomic(const char *command)
+{
+	return strstr(command, "_atomic") != NULL;
+}
+
+static void tranbegin(TCTDB *tdb)
+{
+	if (!tctdbtranbegin(tdb))
+		die("tranbegin error: %s", tctdberrmsg(tctdbecode(tdb)));
+}
+
+static void trancommit(TCTDB *tdb)
+{
+	if (!tctdbtrancommit(tdb))
+		die("trancommit error: %s", tctdberrmsg(tctdbecode(tdb)));
+}
+
+static void put_test(void *db, int num, int vsiz, unsigned int seed)
+{
+	TCTDB *tdb = db;
+	struct keygen keygen;
+	char *value = new_value(vsiz);
+	TCMAP *cols = tcmapnew2(7);
+	int i;
+
+	keygen_init(&keygen, seed);
+
+	for (i = 0; i < num; i++) {
+		fill_columns(cols, seed, num, i, value, vsiz);
+		do_put(tdb, keygen_next_key(&keygen), cols);
+	}
+
+	tcmapdel(cols);
+	free(value);
+}
+
+static void get_test(void *db, int num, int vsiz, unsigned int seed)
+{
+	TCTDB *tdb = db;
+	struct keygen keygen;
+	int i;
+
+	keygen_init(&keygen, seed);
+
+	for (i = 0; i < num; i++)
+		do_get(tdb, keygen_next_key(&keygen), vsiz);
+}
+
+/*
+ * The table database has no multi-record calls, the list commands
+ * run a batch of single-record calls, in a transaction if _atomic
+ */
+static void putlist_test(void *db, const char *command, int num, int vsiz,
+			int batch, unsigned int seed)
+{
+	TCTDB *tdb = db;
+	bool atomic = is_atomic(command);
+	struct keygen keygen;
+	char *value = new_value(vsiz);
+	TCMAP *cols = tcmapnew2(7);
+	unsigned long long start;
+	int i, n;
+
+	keygen_init(&keygen, seed);
+
+	for (i = 0; i < num; i += n) {
+		start = batch_start();
+		if (atomic)
+			tranbegin(tdb);
+
+		for (n = 0; n < batch && i + n < num; n++) {
+			fill_columns(cols, seed, num, i + n, value, vsiz);
+			do_put(tdb, keygen_next_key(&keygen), cols);
+		}
+
+		if (atomic)
+			trancommit(tdb);
+		batch = batch_end(batch, n, start);
+	}
+
+	tcmapdel(cols);
+	free(value);
+}
+
+static void getlist_test(void *db, const char *command, int num, int vsiz,
+			int batch, unsigned int seed)
+{
+	TCTDB *tdb = db;
+	bool atomic = is_atomic(command);
+	struct keygen keygen;
+	unsigned long long start;
+	int i, n;
+
+	keygen_init(&keygen, seed);
+
+	for (i = 0; i < num; i += n) {
+		start = batch_start();
+		if (atomic)
+			tranbegin(tdb);
+
+		for (n = 0; n < batch && i + n < num; n++)
+			do_get(tdb, keygen_next_key(&keygen), vsiz);
+
+		if (atomic)
+			trancommit(tdb);
+		batch = batch_end(batch, n, start);
+	}
+}
+
+static void outlist_test(void *db, const char *command, int num, int batch,
+			unsigned int seed)
+{
+	TCTDB *tdb = db;
+	bool atomic = is_atomic(command);
+	struct keygen keygen;
+	unsigned long long start;
+	int i, n;
+
+	keygen_init(&keygen, seed);
+
+	for (i = 0; i < num; i += n) {
+		start = batch_start();
+		if (atomic)
+			tranbegin(tdb);
+
+		for (n = 0; n < batch && i + n < num; n++)
+			do_out(tdb, keygen_next_key(&keygen));
+
+		if (atomic)
+			trancommit(tdb);
+		batch = batch_end(batch, n, start);
+	}
+}
+
+static void fwmkeys_test(void *db, int num, unsigned int seed)
+{
+	TCTDB *tdb = db;
+	struct keygen keygen;
+	char prefix[KEYGEN_PREFIX_SIZE + 1];
+	TCLIST *list;
+
+	keygen_init(&keygen, seed);
+
+	list = tctdbfwmkeys2(tdb, keygen_prefix(&keygen, prefix), -1);
+	if (debug && tclistnum(list) != num)
+		die("Unexpected key num: %d", tclistnum(list));
+
+	tclistdel(list);
+}
+
+/* Primary keys are hashed, there is no key order to scan */
+static void range_test(void *db, const char *command, int num, int vsiz,
+			int batch, unsigned int seed)
+{
+	die("%s is not supported by the table database", command);
+}
+
+/*
+ * Query latency by result-set size, bucket 0 for empty results and
+ * bucket k for 2^(k-1) .. 2^k - 1 records
+ */
+#define QUERY_BUCKETS 32
+
+struct query_bucket {
+	unsigned long long queries;
+	unsigned long long total_us;
+	unsigned long long max_us;
+};
+
+static struct query_bucket query_buckets[QUERY_BUCKETS];
+static pthread_mutex_t query_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void account_query(int nrecs, unsigned long long us)
+{
+	struct query_bucket *qb;
+	int k = 0;
+
+	while (k < QUERY_BUCKETS - 1 && nrecs >> k)
+		k++;
+	qb = &query_buckets[k];
+
+	pthread_mutex_lock(&query_mutex);
+	qb->queries++;
+	qb->total_us += us;
+	if (us > qb->max_us)
+		qb->max_us = us;
+	pthread_mutex_unlock(&query_mutex);
+}
+
+static TCLIST *run_query(TCTDB *tdb, const char *column, int op,
+			const char *expr)
+{
+	unsigned long long start = now_us();
+	TDBQRY *qry = tctdbqrynew(tdb);
+	TCLIST *res;
+
+	tctdbqryaddcond(qry, column, op, expr);
+	res = tctdbqrysearch(qry);
+	tctdbqrydel(qry);
+	account_query(tclistnum(res), now_us() - start);
+
+	return res;
+}
+
+static void query_eq_test(TCTDB *tdb, int num, unsigned int seed)
+{
+	char expr[64];
+	int k;
+
+	for (k = 0; (1ULL << k) - 1 < (unsigned long long)num; k++) {
+		int first = (1 << k) - 1;
+		int expected = num - first < (1 << k) ? num - first : 1 << k;
+		TCLIST *res;
+
+		sprintf(expr, "%u-%d", seed, k);
+		res = run_query(tdb, "tag", TDBQCSTREQ, expr);
+		if (debug && tclistnum(res) != expected)
+			die("Unexpected result num: %d", tclistnum(res));
+		tclistdel(res);
+	}
+}
+
+static void query_range_test(TCTDB *tdb, int num, int batch, unsigned int seed)
+{
+	unsigned long long base = (unsigned long long)seed * num;
+	char expr[64];
+	int i, n;
+
+	for (i = 0; i < num; i += n) {
+		unsigned long long start = batch_start();
+		TCLIST *res;
+
+		n = num - i < batch ? num - i : batch;
+		sprintf(expr, "%llu %llu", base + i, base + i + n - 1);
+		res = run_query(tdb, "seq", TDBQCNUMBT, expr);
+		if (debug && tclistnum(res) != n)
+			die("Unexpected result num: %d", tclistnum(res));
+		tclistdel(res);
+		batch = batch_end(batch, n, start);
+	}
+}
+
+static void query_test(void *db, const char *command, int num, int vsiz,
+			int batch, unsigned int seed)
+{
+	if (!strcmp(command, "query"))
+		return query_eq_test(db, num, seed);
+	else if (!strcmp(command, "query_range"))
+		return query_range_test(db, num, batch, seed);
+	else if (!strcmp(command, "query_index"))
+		return set_indexes(db);
+
+	die("invalid query command");
+}
+
+static void report_queries(void)
+{
+	int k;
+
+	for (k = 0; k < QUERY_BUCKETS; k++) {
+		if (query_buckets[k].queries)
+			break;
+	}
+	if (k == QUERY_BUCKETS)
+		return;
+
+	printf("# query results queries avg(us) max(us)\n");
+	for (k = 0; k < QUERY_BUCKETS; k++) {
+		struct query_bucket *qb = &query_buckets[k];
+
+		if (!qb->queries)
+			continue;
+		printf("# query %llu-%llu %llu %.1f %llu\n",
+			k ? 1ULL << (k - 1) : 0, k ? (1ULL << k) - 1 : 0,
+			qb->queries, (double)qb->total_us / qb->queries,
+			qb->max_us);
+	}
+	memset(query_buckets, 0, sizeof(query_buckets));
+}
+
+/* Index files are named "<path>.idx.<column>.<type suffix>" */
+static unsigned long long index_size(const char *path, const char *name)
+{
+	unsigned long long size = 0;
+	char *pattern = xmalloc(strlen(path) + strlen(name) + 16);
+	glob_t files;
+	size_t i;
+
+	sprintf(pattern, "%s.idx.%s.*", path, name);
+	if (!glob(pattern, 0, NULL, &files)) {
+		for (i = 0; i < files.gl_pathc; i++) {
+			struct stat st;
+
+			if (!stat(files.gl_pathv[i], &st))
+				size += st.st_size;
+		}
+		globfree(&files);
+	}
+	free(pattern);
+
+	return size;
+}
+
+static void report_indexes(void)
+{
+	int i;
+
+	if (!tdb || !nr_indexes)
+		return;
+
+	tcadbsync(adb);
+
+	printf("# index column type build(s) size(MB)\n");
+	for (i = 0; i < nr_indexes; i++) {
+		struct index_spec *idx = &indexes[i];
+		unsigned long long size = index_size(tctdbpath(tdb), idx->name);
+
+		if (idx->built) {
+			printf("# index %s %s %llu.%03llu %.1f\n", idx->name,
+				idx->type_name, idx->build_us / 1000000,
+				idx->build_us / 1000 % 1000, size / 1048576.0);
+		} else {
+			printf("# index %s %s - %.1f\n", idx->name,
+				idx->type_name, size / 1048576.0);
+		}
+	}
+}
+
+static void report(struct benchmark_config *config)
+{
+	report_queries();
+	report_indexes();
+}
+
+static int parse_option(struct benchmark_config *config, int argc,
+			char **argv, int i)
+{
+	if (!strcmp(argv[i], "-index")) {
+		add_indexes(argv[i + 1]);
+		return 2;
+	}
+
+	return 0;
+}
+
+static struct benchmark_config config = {
+	.producer = "nop",
+	.consumer = "nop",
+	.path = "data.tct",
+	.num = 5000000,
+	.vsiz = 100,
+	.batch = 1000,
+	.producer_thnum = 1,
+	.consumer_thnum = 1,
+	.debug = false,
+	.verbose = 1,
+	.ops = {
+		.open_db = open_db,
+		.close_db = close_db,
+		.put_test = put_test,
+		.get_test = get_test,
+		.putlist_test = putlist_test,
+		.fwmkeys_test = fwmkeys_test,
+		.getlist_test = getlist_test,
+		.range_test = range_test,
+		.rangeout_test = range_test,
+		.outlist_test = outlist_test,
+		.query_test = query_test,
+		.parse_option = parse_option,
+		.report = report,
+	},
+};
+
+static void setup(struct benchmark_config *config)
+{
+	debug = config->debug;
+}
+
+#ifdef BENCHMARK_PLUGIN
+
+static void init_config(struct benchmark_config *plugin_config)
+{
+	/* The same plugin may be loaded for several -backend runs */
+	nr_indexes = 0;
+	*plugin_config = config;
+}
+
+struct benchmark_plugin benchmark_plugin = {
+	.name = "tokyotable",
+	.init = init_config,
+	.setup = setup,
+};
+
+#else
+
+int main(int argc, char **argv)
+{
+	parse_options(&config, argc, argv);
+	setup(&config);
+	benchmark(&config);
+
+	return 0;
+}
+
+#endif
@@ -1,39 +1,423 @@
 #include <tcutil.h>
 #include <tcrdb.h>
+#include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
 #include "testutil.h"
+#include "shard.h"
+#include "ttraw.h"
 
 static bool debug = false;
 
-static void *open_db(struct benchmark_config *config)
+/*
+ * -raw talks to the servers with the in-tree binary protocol client
+ * instead of libtokyotyrant.  With -pipeline N (which implies -raw)
+ * put and get queue up to N requests per connection before reading
+ * their replies, so that single-key throughput is not bound by the
+ * round trip time.  outlist then removes its keys with pipelined out
+ * requests rather than one misc call per batch.
+ */
+static bool raw;
+static int pipeline = 1;
+
+/* Endpoints of -hosts (or -host/-port), shared by all handles */
+static struct shard_ring *ring;
+
+/*
+ * A benchmark handle holds one connection per shard.  Batches are split
+ * by shard and the parts are sent in parallel through the fan-out.
+ */
+struct tt_handle {
+	int nr_shards;
+	TCRDB **rdbs;
+	struct tt_conn **conns;
+	struct shard_fanout *fanout;
+	struct shard_counter *counter;
+
+	/* Records written, sampled by the lag poller (-slave) */
+	unsigned long long writes;
+	struct tt_handle *next;
+};
+
+/*
+ * Replication lag (-slave host:port)
+ *
+ * While handles are open, a marker thread writes the current time to a
+ * marker key on the first endpoint every 10ms, and a poller thread
+ * reads the marker back from the slave of that endpoint every 1ms.
+ * Updates replicate in order, so once the slave shows a marker, every
+ * write acknowledged before it has reached the slave too; the time
+ * from writing a marker to seeing it is one lag sample.  Every second
+ * the poller also sums the records written through the open handles,
+ * which is the write throughput, and compares the record counts of the
+ * master and the slave to tell how far behind the slave is.
+ */
+static const char *slave_host;
+static int slave_port;
+
+#define LAG_MARKER_KEY "__lag_marker__"
+#define LAG_MARKER_US 10000
+#define LAG_POLL_US 1000
+
+struct lag_second {
+	unsigned long long writes;
+	long long behind;
+	int nr_samples;
+	unsigned long long avg_us;
+	unsigned long long p99_us;
+	unsigned long long max_us;
+};
+
+struct lag_samples {
+	unsigned long long *us;
+	int nr;
+	int max;
+};
+
+struct lag_monitor {
+	pthread_mutex_t mutex;
+	int users;
+	bool stop;
+	pthread_t marker;
+	pthread_t poller;
+	unsigned long long origin_us;
+	struct tt_handle *handles;
+	unsigned long long closed_writes;
+
+	/* Since the last report */
+	struct lag_samples samples;
+	struct lag_second *seconds;
+	int nr_seconds;
+	int first_second;
+};
+
+static struct lag_monitor lag = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static unsigned long long now_us(void)
 {
-	TCRDB *rdb;
-	const char *host = config->host;
-	int port = config->port;
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
 
-	rdb = tcrdbnew();
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
 
-	if (!tcrdbopen(rdb, host, port)){
-		int ecode = tcrdbecode(rdb);
-		die("open error: %s", tcrdberrmsg(ecode));
+static void lag_samples_push(struct lag_samples *s, unsigned long long us)
+{
+	if (s->nr == s->max) {
+		s->max = s->max ? s->max * 2 : 256;
+		s->us = realloc(s->us, sizeof(*s->us) * s->max);
+		if (!s->us)
+			die("realloc: out of memory");
 	}
+	s->us[s->nr++] = us;
+}
+
+static int cmp_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Sorts the samples */
+static unsigned long long lag_percentile(struct lag_samples *s, double p)
+{
+	if (!s->nr)
+		return 0;
+
+	qsort(s->us, s->nr, sizeof(*s->us), cmp_ull);
+
+	return s->us[(int)((s->nr - 1) * p)];
+}
+
+static void lag_account(struct tt_handle *h, int nrecs)
+{
+	if (slave_host)
+		__sync_fetch_and_add(&h->writes, nrecs);
+}
+
+/* Records written through all handles so far, with lag.mutex held */
+static unsigned long long lag_writes(void)
+{
+	unsigned long long writes = lag.closed_writes;
+	struct tt_handle *h;
+
+	for (h = lag.handles; h; h = h->next)
+		writes += h->writes;
+
+	return writes;
+}
+
+static bool lag_stopped(void)
+{
+	bool stop;
+
+	pthread_mutex_lock(&lag.mutex);
+	stop = lag.stop;
+	pthread_mutex_unlock(&lag.mutex);
+
+	return stop;
+}
+
+static TCRDB *lag_open(const char *host, int port)
+{
+	TCRDB *rdb = tcrdbnew();
+
+	if (!tcrdbopen(rdb, host, port))
+		die("open error: %s:%d: %s", host, port,
+			tcrdberrmsg(tcrdbecode(rdb)));
+
 	return rdb;
 }
 
+static void lag_close(TCRDB *rdb)
+{
+	tcrdbclose(rdb);
+	tcrdbdel(rdb);
+}
+
+static void *lag_marker_thread(void *arg)
+{
+	TCRDB *master = lag_open(shard_ring_host(ring, 0),
+				shard_ring_port(ring, 0));
+	char value[32];
+
+	while (!lag_stopped()) {
+		sprintf(value, "%llu", now_us());
+		if (!tcrdbput2(master, LAG_MARKER_KEY, value))
+			die("marker put error: %s",
+				tcrdberrmsg(tcrdbecode(master)));
+		usleep(LAG_MARKER_US);
+	}
+	lag_close(master);
+
+	return NULL;
+}
+
+static void *lag_poller_thread(void *arg)
+{
+	TCRDB *slave = lag_open(slave_host, slave_port);
+	TCRDB *master = lag_open(shard_ring_host(ring, 0),
+				shard_ring_port(ring, 0));
+	unsigned long long last_us = lag.origin_us;
+	unsigned long long next_us = lag.origin_us + 1000000;
+	unsigned long long writes;
+	struct lag_samples second = { NULL, 0, 0 };
+
+	pthread_mutex_lock(&lag.mutex);
+	writes = lag_writes();
+	pthread_mutex_unlock(&lag.mutex);
+
+	while (!lag_stopped()) {
+		char *value = tcrdbget2(slave, LAG_MARKER_KEY);
+		unsigned long long now = now_us();
+
+		/* Markers of earlier runs are older than the origin */
+		if (value) {
+			unsigned long long written = strtoull(value, NULL, 10);
+
+			if (written > last_us) {
+				last_us = written;
+				lag_samples_push(&second, now - written);
+			}
+			free(value);
+		}
+
+		if (now >= next_us) {
+			unsigned long long master_rnum = tcrdbrnum(master);
+			unsigned long long slave_rnum = tcrdbrnum(slave);
+			struct lag_second sec;
+			unsigned long long sum = 0;
+			int i;
+
+			for (i = 0; i < second.nr; i++)
+				sum += second.us[i];
+
+			sec.behind = master_rnum - slave_rnum;
+			sec.nr_samples = second.nr;
+			sec.avg_us = second.nr ? sum / second.nr : 0;
+			sec.p99_us = lag_percentile(&second, 0.99);
+			sec.max_us = second.nr ? second.us[second.nr - 1] : 0;
+
+			pthread_mutex_lock(&lag.mutex);
+			sec.writes = lag_writes() - writes;
+			writes += sec.writes;
+			lag.seconds = realloc(lag.seconds, sizeof(*lag.seconds) *
+						(lag.nr_seconds + 1));
+			if (!lag.seconds)
+				die("realloc: out of memory");
+			lag.seconds[lag.nr_seconds++] = sec;
+			for (i = 0; i < second.nr; i++)
+				lag_samples_push(&lag.samples, second.us[i]);
+			pthread_mutex_unlock(&lag.mutex);
+
+			second.nr = 0;
+			next_us += 1000000;
+		}
+		usleep(LAG_POLL_US);
+	}
+	free(second.us);
+	lag_close(master);
+	lag_close(slave);
+
+	return NULL;
+}
+
+/* The monitor runs while at least one handle is open */
+static void lag_monitor_get(struct tt_handle *h)
+{
+	pthread_mutex_lock(&lag.mutex);
+	h->next = lag.handles;
+	lag.handles = h;
+	if (lag.users++) {
+		pthread_mutex_unlock(&lag.mutex);
+		return;
+	}
+	lag.stop = false;
+	lag.origin_us = now_us();
+	pthread_mutex_unlock(&lag.mutex);
+
+	xpthread_create(&lag.marker, lag_marker_thread, NULL);
+	xpthread_create(&lag.poller, lag_poller_thread, NULL);
+}
+
+static void lag_monitor_put(struct tt_handle *h)
+{
+	struct tt_handle **p;
+
+	pthread_mutex_lock(&lag.mutex);
+	for (p = &lag.handles; *p != h; p = &(*p)->next)
+		;
+	*p = h->next;
+	lag.closed_writes += h->writes;
+	if (--lag.users) {
+		pthread_mutex_unlock(&lag.mutex);
+		return;
+	}
+	lag.stop = true;
+	pthread_mutex_unlock(&lag.mutex);
+
+	xpthread_join(lag.marker);
+	xpthread_join(lag.poller);
+}
+
+static void lag_report(void)
+{
+	struct lag_samples *s = &lag.samples;
+	int i;
+
+	pthread_mutex_lock(&lag.mutex);
+
+	printf("# lag t(s) writes/s markers avg(ms) p99(ms) max(ms) behind\n");
+	for (i = 0; i < lag.nr_seconds; i++) {
+		struct lag_second *sec = &lag.seconds[i];
+
+		printf("# lag %d %llu %d %.3f %.3f %.3f %lld\n",
+			lag.first_second + i + 1, sec->writes, sec->nr_samples,
+			sec->avg_us / 1000.0, sec->p99_us / 1000.0,
+			sec->max_us / 1000.0, sec->behind);
+	}
+	printf("# lag markers %d p50 %.3f p90 %.3f p99 %.3f max %.3f (ms)\n",
+		s->nr, lag_percentile(s, 0.5) / 1000.0,
+		lag_percentile(s, 0.9) / 1000.0,
+		lag_percentile(s, 0.99) / 1000.0,
+		s->nr ? s->us[s->nr - 1] / 1000.0 : 0.0);
+
+	lag.first_second += lag.nr_seconds;
+	lag.nr_seconds = 0;
+	s->nr = 0;
+
+	pthread_mutex_unlock(&lag.mutex);
+}
+
+static void *open_db(struct benchmark_config *config)
+{
+	struct tt_handle *h = xmalloc(sizeof(*h));
+	int i;
+
+	h->nr_shards = shard_ring_size(ring);
+	h->rdbs = NULL;
+	h->conns = NULL;
+	h->fanout = shard_fanout_create(h->nr_shards);
+	h->counter = shard_counter_create(ring);
+	h->writes = 0;
+	if (slave_host)
+		lag_monitor_get(h);
+
+	if (raw) {
+		h->conns = xmalloc(sizeof(*h->conns) * h->nr_shards);
+		for (i = 0; i < h->nr_shards; i++) {
+			h->conns[i] = tt_conn_open(shard_ring_host(ring, i),
+						shard_ring_port(ring, i),
+						pipeline);
+		}
+		return h;
+	}
+
+	h->rdbs = xmalloc(sizeof(*h->rdbs) * h->nr_shards);
+	for (i = 0; i < h->nr_shards; i++) {
+		const char *host = shard_ring_host(ring, i);
+		int port = shard_ring_port(ring, i);
+
+		h->rdbs[i] = tcrdbnew();
+		if (!tcrdbopen(h->rdbs[i], host, port)){
+			int ecode = tcrdbecode(h->rdbs[i]);
+			die("open error: %s:%d: %s", host, port,
+				tcrdberrmsg(ecode));
+		}
+	}
+
+	return h;
+}
+
 static void close_db(void *db)
 {
-	TCRDB *rdb = db;
+	struct tt_handle *h = db;
+	int i;
 
-	if (!tcrdbclose(rdb)){
-		int ecode = tcrdbecode(rdb);
-		die("close error: %s", tcrdberrmsg(ecode));
+	if (slave_host)
+		lag_monitor_put(h);
+	shard_fanout_destroy(h->fanout);
+	shard_counter_destroy(h->counter);
+
+	if (h->conns) {
+		for (i = 0; i < h->nr_shards; i++)
+			tt_conn_close(h->conns[i]);
+		free(h->conns);
+		free(h);
+		return;
 	}
-	tcrdbdel(rdb);
+
+	for (i = 0; i < h->nr_shards; i++) {
+		TCRDB *rdb = h->rdbs[i];
+
+		if (!tcrdbclose(rdb)){
+			int ecode = tcrdbecode(rdb);
+			die("close error: %s", tcrdberrmsg(ecode));
+		}
+		tcrdbdel(rdb);
+	}
+	free(h->rdbs);
+	free(h);
+}
+
+static int key_shard(struct tt_handle *h, const char *key)
+{
+	int shard = shard_ring_lookup(ring, key, strlen(key));
+
+	shard_counter_add(h->counter, shard, 1);
+
+	return shard;
 }
 
 static void put_test(void *db, int num, int vsiz, unsigned int seed)
 {
-	TCRDB *rdb = db;
+	struct tt_handle *h = db;
 	struct keygen keygen;
 	char *value = xmalloc(vsiz);
 	int i;
@@ -43,7 +427,8 @@ static void put_test(void *db, int num, int vsiz, unsigned int seed)
 	for (i = 0; i < num; i++) {
 		const char *key = keygen_next_key(&keygen);
 
-		tcrdbput(rdb, key, strlen(key), value, vsiz);
+		tcrdbput(h->rdbs[key_shard(h, key)], key, strlen(key), value, vsiz);
+		lag_account(h, 1);
 	}
 
 	free(value);
@@ -51,7 +436,7 @@ static void put_test(void *db, int num, int vsiz, unsigned int seed)
 
 static void get_test(void *db, int num, int vsiz, unsigned int seed)
 {
-	TCRDB *rdb = db;
+	struct tt_handle *h = db;
 	struct keygen keygen;
 	int i;
 
@@ -62,7 +447,8 @@ static void get_test(void *db, int num, int vsiz, unsigned int seed)
 		void *value;
 		int siz;
 
-		value = tcrdbget(rdb, key, strlen(key), &siz);
+		value = tcrdbget(h->rdbs[key_shard(h, key)], key, strlen(key),
+				&siz);
 		if (debug && vsiz != siz)
 			die("Unexpected value size: %d", siz);
 			
@@ -70,6 +456,75 @@ static void get_test(void *db, int num, int vsiz, unsigned int seed)
 	}
 }
 
+/* Single-key requests are pipelined per connection, then synced */
+static void raw_sync(struct tt_handle *h)
+{
+	int i;
+
+	for (i = 0; i < h->nr_shards; i++) {
+		tt_conn_sync(h->conns[i]);
+		if (debug && tt_conn_errors(h->conns[i]))
+			die("%llu unexpected replies from %s:%d",
+				tt_conn_errors(h->conns[i]),
+				shard_ring_host(ring, i), shard_ring_port(ring, i));
+	}
+}
+
+static void raw_put_test(void *db, int num, int vsiz, unsigned int seed)
+{
+	struct tt_handle *h = db;
+	struct keygen keygen;
+	char *value = xmalloc(vsiz);
+	int i;
+
+	keygen_init(&keygen, seed);
+
+	for (i = 0; i < num; i++) {
+		const char *key = keygen_next_key(&keygen);
+
+		tt_conn_put(h->conns[key_shard(h, key)], key, strlen(key),
+			value, vsiz);
+		lag_account(h, 1);
+	}
+	raw_sync(h);
+
+	free(value);
+}
+
+static void raw_get_test(void *db, int num, int vsiz, unsigned int seed)
+{
+	struct tt_handle *h = db;
+	struct keygen keygen;
+	int i;
+
+	keygen_init(&keygen, seed);
+
+	for (i = 0; i < num; i++) {
+		const char *key = keygen_next_key(&keygen);
+
+		tt_conn_get(h->conns[key_shard(h, key)], key, strlen(key),
+			debug ? vsiz : -1);
+	}
+	raw_sync(h);
+}
+
+static void raw_outlist_test(void *db, int num, unsigned int seed)
+{
+	struct tt_handle *h = db;
+	struct keygen keygen;
+	int i;
+
+	keygen_init(&keygen, seed);
+
+	for (i = 0; i < num; i++) {
+		const char *key = keygen_next_key(&keygen);
+
+		tt_conn_out(h->conns[key_shard(h, key)], key, strlen(key));
+		lag_account(h, 1);
+	}
+	raw_sync(h);
+}
+
 static TCLIST *do_tcrdbmisc(TCRDB *rdb, const char *name, const TCLIST *args)
 {
 	TCLIST *rv = tcrdbmisc(rdb, name, 0, args);
@@ -80,30 +535,149 @@ static TCLIST *do_tcrdbmisc(TCRDB *rdb, const char *name, const TCLIST *args)
 	return rv;
 }
 
+/* Run a misc command on one shard through either client */
+static TCLIST *shard_misc(struct tt_handle *h, int shard, const char *name,
+			const TCLIST *args)
+{
+	TCLIST *rv;
+
+	if (!h->conns)
+		return do_tcrdbmisc(h->rdbs[shard], name, args);
+
+	/* A plain getlist is what mget does, in one round trip as well */
+	if (!strcmp(name, "getlist"))
+		rv = tt_conn_mget(h->conns[shard], args);
+	else
+		rv = tt_conn_misc(h->conns[shard], name, args);
+	if (rv == NULL)
+		die("%s failed on %s:%d", name, shard_ring_host(ring, shard),
+			shard_ring_port(ring, shard));
+
+	return rv;
+}
+
+/*
+ * One batch split by shard.  requests[i] is sent to shard i with the
+ * misc command, and its reply is kept in replies[i] if replies is set.
+ */
+struct shard_batch {
+	struct tt_handle *h;
+	const char *command;
+	TCLIST **requests;
+	TCLIST **replies;
+	int nrecs;
+};
+
+static struct shard_batch *shard_batch_new(struct tt_handle *h,
+				const char *command, bool keep_replies)
+{
+	struct shard_batch *b = xmalloc(sizeof(*b));
+	int i;
+
+	b->h = h;
+	b->command = command;
+	b->requests = xmalloc(sizeof(*b->requests) * h->nr_shards);
+	b->replies = NULL;
+	b->nrecs = 0;
+	for (i = 0; i < h->nr_shards; i++)
+		b->requests[i] = tclistnew();
+
+	if (keep_replies) {
+		b->replies = xmalloc(sizeof(*b->replies) * h->nr_shards);
+		memset(b->replies, 0, sizeof(*b->replies) * h->nr_shards);
+	}
+
+	return b;
+}
+
+static void shard_batch_clear(struct shard_batch *b)
+{
+	int i;
+
+	for (i = 0; i < b->h->nr_shards; i++) {
+		tclistclear(b->requests[i]);
+		if (b->replies && b->replies[i]) {
+			tclistdel(b->replies[i]);
+			b->replies[i] = NULL;
+		}
+	}
+	b->nrecs = 0;
+}
+
+static void shard_batch_del(struct shard_batch *b)
+{
+	int i;
+
+	shard_batch_clear(b);
+	for (i = 0; i < b->h->nr_shards; i++)
+		tclistdel(b->requests[i]);
+	free(b->requests);
+	free(b->replies);
+	free(b);
+}
+
+/* Route a key, and its value unless value is NULL, to its shard */
+static void shard_batch_push(struct shard_batch *b, const char *key,
+			const char *value, int vsiz)
+{
+	TCLIST *request = b->requests[key_shard(b->h, key)];
+
+	tclistpush2(request, key);
+	if (value)
+		tclistpush(request, value, vsiz);
+	b->nrecs++;
+}
+
+static void send_shard(int shard, void *arg)
+{
+	struct shard_batch *b = arg;
+	TCLIST *reply;
+
+	if (!tclistnum(b->requests[shard]))
+		return;
+
+	reply = shard_misc(b->h, shard, b->command, b->requests[shard]);
+	if (b->replies)
+		b->replies[shard] = reply;
+	else
+		tclistdel(reply);
+}
+
+static void shard_batch_send(struct shard_batch *b)
+{
+	shard_fanout_run(b->h->fanout, send_shard, b);
+}
+
 static void putlist_test(void *db, const char *command, int num, int vsiz,
 			int batch, unsigned int seed)
 {
-	TCRDB *rdb = db;
+	struct tt_handle *h = db;
 	struct keygen keygen;
 	char *value = xmalloc(vsiz);
-	TCLIST *list = tclistnew();
+	struct shard_batch *b = shard_batch_new(h, command, false);
+	unsigned long long start;
 	int i;
 
 	keygen_init(&keygen, seed);
+	start = batch_start();
 
 	for (i = 0; i < num; i++) {
-		tclistpush2(list, keygen_next_key(&keygen));
-		tclistpush(list, value, vsiz);
-
-		if (tclistnum(list) / 2 >= batch) {
-			tclistdel(do_tcrdbmisc(rdb, command, list));
-			tclistclear(list);
+		shard_batch_push(b, keygen_next_key(&keygen), value, vsiz);
+
+		if (b->nrecs >= batch) {
+			shard_batch_send(b);
+			lag_account(h, b->nrecs);
+			batch = batch_end(batch, b->nrecs, start);
+			shard_batch_clear(b);
+			start = batch_start();
 		}
 	}
-	if (tclistnum(list))
-		tclistdel(do_tcrdbmisc(rdb, command, list));
+	if (b->nrecs) {
+		shard_batch_send(b);
+		lag_account(h, b->nrecs);
+	}
 
-	tclistdel(list);
+	shard_batch_del(b);
 	free(value);
 }
 
@@ -129,21 +703,68 @@ static void check_keys(TCLIST *list, int num, unsigned int seed)
 	}
 }
 
+struct fwmkeys_job {
+	struct tt_handle *h;
+	const char *prefix;
+	TCLIST **lists;
+};
+
+static void fwmkeys_shard(int shard, void *arg)
+{
+	struct fwmkeys_job *job = arg;
+
+	if (job->h->conns)
+		job->lists[shard] = tt_conn_fwmkeys(job->h->conns[shard],
+					job->prefix, strlen(job->prefix), -1);
+	else
+		job->lists[shard] = tcrdbfwmkeys2(job->h->rdbs[shard],
+					job->prefix, -1);
+	if (!job->lists[shard])
+		die("fwmkeys failed");
+	shard_counter_add(job->h->counter, shard,
+			tclistnum(job->lists[shard]));
+}
+
 static void fwmkeys_test(void *db, int num, unsigned int seed)
 {
-	TCRDB *rdb = db;
+	struct tt_handle *h = db;
 	struct keygen keygen;
 	char prefix[KEYGEN_PREFIX_SIZE + 1];
+	struct fwmkeys_job job;
 	TCLIST *list;
+	int i, j;
 
 	keygen_init(&keygen, seed);
 
-	list = tcrdbfwmkeys2(rdb, keygen_prefix(&keygen, prefix), -1);
+	job.h = h;
+	job.prefix = keygen_prefix(&keygen, prefix);
+	job.lists = xmalloc(sizeof(*job.lists) * h->nr_shards);
+	shard_fanout_run(h->fanout, fwmkeys_shard, &job);
+
+	/* Every shard holds part of the prefix, merge them back in order */
+	list = job.lists[0];
+	for (i = 1; i < h->nr_shards; i++) {
+		for (j = 0; j < tclistnum(job.lists[i]); j++) {
+			int ksiz;
+			const char *key = tclistval(job.lists[i], j, &ksiz);
+
+			tclistpush(list, key, ksiz);
+		}
+		tclistdel(job.lists[i]);
+	}
+	if (h->nr_shards > 1)
+		tclistsort(list);
 	check_keys(list, num, seed);
 
 	tclistdel(list);
+	free(job.lists);
 }
 
+/*
+ * keygen is NULL and batch is negative when the records cannot be
+ * checked against the key sequence, which is the case when a prefix is
+ * spread over several shards.
+ */
 static void check_records(TCLIST *recs, struct keygen *keygen, int vsiz,
 			int batch)
 {
@@ -158,7 +779,7 @@ static void check_records(TCLIST *recs, struct keygen *keygen, int vsiz,
 
 	recnum = tclistnum(recs);
 
-	if (recnum != batch * 2)
+	if (batch >= 0 && recnum != batch * 2)
 		die("Unexpected list size %d", recnum);
 
 	for (i = 0; i < recnum; i += 2) {
@@ -166,7 +787,7 @@ static void check_records(TCLIST *recs, struct keygen *keygen, int vsiz,
 		const char *key = tclistval(recs, i, &keysiz);
 		int valsiz;
 
-		if (strncmp(keygen_next_key(keygen), key, keysiz))
+		if (keygen && strncmp(keygen_next_key(keygen), key, keysiz))
 			die("Unexpected key");
 
 		tclistval(recs, i + 1, &valsiz);
@@ -175,48 +796,86 @@ static void check_records(TCLIST *recs, struct keygen *keygen, int vsiz,
 	}
 }
 
+/* A getlist reply holds the requested keys in order with their values */
+static void check_reply(TCLIST *request, TCLIST *reply, int vsiz)
+{
+	int i;
+
+	if (!debug)
+		return;
+
+	if (tclistnum(reply) != tclistnum(request) * 2)
+		die("Unexpected list size %d", tclistnum(reply));
+
+	for (i = 0; i < tclistnum(request); i++) {
+		int ksiz, keysiz, valsiz;
+		const char *key = tclistval(request, i, &ksiz);
+		const char *rkey = tclistval(reply, i * 2, &keysiz);
+
+		if (ksiz != keysiz || memcmp(key, rkey, ksiz))
+			die("Unexpected key");
+
+		tclistval(reply, i * 2 + 1, &valsiz);
+		if (valsiz != vsiz)
+			die("Unexpected value size %d", valsiz);
+	}
+}
+
+static void check_batch_replies(struct shard_batch *b, int vsiz)
+{
+	int i;
+
+	for (i = 0; i < b->h->nr_shards; i++) {
+		if (tclistnum(b->requests[i]))
+			check_reply(b->requests[i], b->replies[i], vsiz);
+	}
+}
+
 static void getlist_test(void *db, const char *command, int num, int vsiz,
 			int batch, unsigned int seed)
 {
-	TCRDB *rdb = db;
+	struct tt_handle *h = db;
 	struct keygen keygen;
-	struct keygen keygen_for_check;
-	TCLIST *list = tclistnew();
-	TCLIST *recs;
+	struct shard_batch *b = shard_batch_new(h, command, true);
+	unsigned long long start;
 	int i;
 
 	keygen_init(&keygen, seed);
-	keygen_init(&keygen_for_check, seed);
+	start = batch_start();
 
 	for (i = 0; i < num; i++) {
-		tclistpush2(list, keygen_next_key(&keygen));
-
-		if (tclistnum(list) >= batch) {
-			recs = do_tcrdbmisc(rdb, command, list);
-			check_records(recs, &keygen_for_check, vsiz,
-					tclistnum(list));
-			tclistdel(recs);
-			tclistclear(list);
+		shard_batch_push(b, keygen_next_key(&keygen), NULL, 0);
+
+		if (b->nrecs >= batch) {
+			shard_batch_send(b);
+			batch = batch_end(batch, b->nrecs, start);
+			check_batch_replies(b, vsiz);
+			shard_batch_clear(b);
+			start = batch_start();
 		}
 	}
-	if (tclistnum(list)) {
-		recs = do_tcrdbmisc(rdb, command, list);
-		check_records(recs, &keygen_for_check, vsiz, tclistnum(list));
-		tclistdel(recs);
+	if (b->nrecs) {
+		shard_batch_send(b);
+		check_batch_replies(b, vsiz);
 	}
 
-	tclistdel(list);
+	shard_batch_del(b);
 }
 
-static void range_nonatomic_test(void *db, int num, int vsiz, int batch,
-			unsigned int seed)
+/*
+ * The range tests below scan one shard and return the number of
+ * records seen.  num is -1 when the shard only holds part of the prefix.
+ */
+static int range_nonatomic(struct tt_handle *h, int shard, int num, int vsiz,
+			int batch, unsigned int seed)
 {
-	TCRDB *rdb = db;
 	struct keygen keygen;
+	struct keygen *check = num < 0 ? NULL : &keygen;
 	TCLIST *args = tclistnew();
 	char start_key[KEYGEN_PREFIX_SIZE + 1];
 	char max[100];
 	char end_key[KEYGEN_PREFIX_SIZE + 1];
+	int nrecs = 0;
 
 	keygen_init(&keygen, seed);
 
@@ -232,34 +891,44 @@ static void range_nonatomic_test(void *db, int num, int vsiz, int batch,
 	while (1) {
 		TCLIST *recs;
 		int num_recs;
+		unsigned long long start = batch_start();
 
-		recs = do_tcrdbmisc(rdb, "range", args);
+		recs = shard_misc(h, shard, "range", args);
 		num_recs = tclistnum(recs) / 2;
 		if (!num_recs)
 			break;
 
-		check_records(recs, &keygen, vsiz, num < batch ? num : batch);
+		check_records(recs, check, vsiz,
+			check ? (num < batch ? num : batch) : -1);
+		batch = batch_end(batch, num_recs, start);
+		sprintf(max, "%d", batch);
+		tclistover2(args, 1, max);
 		/* overwrite start_key by the last one + '\0' */
 		tclistover(args, 0, tclistval2(recs, 2 * (num_recs - 1)), KEYGEN_KEY_SIZE + 1);
 		tclistdel(recs);
-		num -= num_recs;
+		nrecs += num_recs;
+		if (check)
+			num -= num_recs;
 	}
-	if (debug && num)
+	if (debug && check && num)
 		die("Unexpected record num: %d", num);
 
 	tclistdel(args);
+
+	return nrecs;
 }
 
-static void range_atomic_test(void *db, int num, int vsiz, int batch,
-			unsigned int seed)
+static int range_atomic(struct tt_handle *h, int shard, int num, int vsiz,
+			int batch, unsigned int seed)
 {
-	TCRDB *rdb = db;
 	struct keygen keygen;
+	struct keygen *check = num < 0 ? NULL : &keygen;
 	TCLIST *args = tclistnew();
 	char start_key[KEYGEN_PREFIX_SIZE + 1];
 	char max[100];
 	char end_key[KEYGEN_PREFIX_SIZE + 1];
 	char binc[2];
+	int nrecs = 0;
 
 	keygen_init(&keygen, seed);
 
@@ -277,44 +946,43 @@ static void range_atomic_test(void *db, int num, int vsiz, int batch,
 	while (1) {
 		TCLIST *recs;
 		int num_recs;
+		unsigned long long start = batch_start();
 
-		recs = do_tcrdbmisc(rdb, "range_atomic", args);
+		recs = shard_misc(h, shard, "range_atomic", args);
 		num_recs = tclistnum(recs) / 2;
 		if (!num_recs)
 			break;
 
-		check_records(recs, &keygen, vsiz, num < batch ? num : batch);
+		check_records(recs, check, vsiz,
+			check ? (num < batch ? num : batch) : -1);
+		batch = batch_end(batch, num_recs, start);
+		sprintf(max, "%d", batch);
+		tclistover2(args, 1, max);
 		tclistover2(args, 0, tclistval2(recs, 2 * (num_recs - 1)));
 		tclistdel(recs);
-		num -= num_recs;
+		nrecs += num_recs;
+		if (check)
+			num -= num_recs;
 	}
-	if (debug && num)
+	if (debug && check && num)
 		die("Unexpected record num: %d", num);
 
 	tclistdel(args);
-}
-
-static void range_test(void *db, const char *command, int num, int vsiz,
-			int batch, unsigned int seed)
-{
-	if (!strcmp(command, "range"))
-		return range_nonatomic_test(db, num, vsiz, batch, seed);
-	else if (!strcmp(command, "range_atomic"))
-		return range_atomic_test(db, num, vsiz, batch, seed);
 
-	die("invalid range command");
+	return nrecs;
 }
 
-static void rangeout_test(void *db, const char *command, int num, int vsiz,
-			int batch, unsigned int seed)
+static int rangeout(struct tt_handle *h, int shard, const char *command,
+			int num, int batch, unsigned int seed)
 {
-	TCRDB *rdb = db;
 	struct keygen keygen;
 	TCLIST *args = tclistnew();
 	char start_key[KEYGEN_PREFIX_SIZE + 1];
 	char max[100];
 	char end_key[KEYGEN_PREFIX_SIZE + 1];
 	char binc[2];
+	bool check = num >= 0;
+	int nrecs = 0;
 
 	keygen_init(&keygen, seed);
 
@@ -331,46 +999,240 @@ static void rangeout_test(void *db, const char *command, int num, int vsiz,
 
 	while (1) {
 		TCLIST *recs;
+		int num_recs;
+		unsigned long long start = batch_start();
 
-		recs = do_tcrdbmisc(rdb, command, args);
+		recs = shard_misc(h, shard, command, args);
 		if (tclistnum(recs) == 0)
 			break;
-		if (debug) {
-			const char *num_recs = tclistval2(recs, 0);
-			num -= atoi(num_recs);
-			if (num != 0 && atoi(num_recs) != batch)
+		num_recs = atoi(tclistval2(recs, 0));
+		lag_account(h, num_recs);
+		if (debug && check) {
+			num -= num_recs;
+			if (num != 0 && num_recs != batch)
 				die("Unexpected number of records are deleted");
 		}
+		batch = batch_end(batch, num_recs, start);
+		sprintf(max, "%d", batch);
+		tclistover2(args, 1, max);
 		tclistdel(recs);
+		nrecs += num_recs;
 	}
-	if (debug && num != 0)
+	if (debug && check && num != 0)
 		die("Unexpected number of records are deleted");
 
 	tclistdel(args);
+
+	return nrecs;
+}
+
+struct range_job {
+	struct tt_handle *h;
+	const char *command;
+	int num;
+	int vsiz;
+	int batch;
+	unsigned int seed;
+	int nrecs;
+};
+
+static void range_shard(int shard, void *arg)
+{
+	struct range_job *job = arg;
+	struct tt_handle *h = job->h;
+	int num = h->nr_shards == 1 ? job->num : -1;
+	int nrecs;
+
+	if (!strcmp(job->command, "range"))
+		nrecs = range_nonatomic(h, shard, num, job->vsiz, job->batch,
+					job->seed);
+	else if (!strcmp(job->command, "range_atomic"))
+		nrecs = range_atomic(h, shard, num, job->vsiz, job->batch,
+					job->seed);
+	else
+		nrecs = rangeout(h, shard, job->command, num, job->batch,
+					job->seed);
+
+	shard_counter_add(h->counter, shard, nrecs);
+	__sync_fetch_and_add(&job->nrecs, nrecs);
+}
+
+/* Scan every shard in parallel, each of them holds part of the prefix */
+static void run_range_job(struct tt_handle *h, const char *command, int num,
+			int vsiz, int batch, unsigned int seed)
+{
+	struct range_job job = {
+		.h = h,
+		.command = command,
+		.num = num,
+		.vsiz = vsiz,
+		.batch = batch,
+		.seed = seed,
+		.nrecs = 0,
+	};
+
+	shard_fanout_run(h->fanout, range_shard, &job);
+
+	if (debug && job.nrecs != num)
+		die("Unexpected record num: %d", job.nrecs);
+}
+
+static void range_test(void *db, const char *command, int num, int vsiz,
+			int batch, unsigned int seed)
+{
+	if (strcmp(command, "range") && strcmp(command, "range_atomic"))
+		die("invalid range command");
+
+	run_range_job(db, command, num, vsiz, batch, seed);
+}
+
+static void rangeout_test(void *db, const char *command, int num, int vsiz,
+			int batch, unsigned int seed)
+{
+	run_range_job(db, command, num, vsiz, batch, seed);
+}
+
+struct scan_job {
+	struct tt_handle *h;
+	const char *start;
+	const char *end;
+	int batch;
+	unsigned long long records;
+	unsigned long long bytes;
+};
+
+static void scan_shard(int shard, void *arg)
+{
+	struct scan_job *job = arg;
+	TCLIST *args = tclistnew();
+	char max[100];
+	unsigned long long records = 0, bytes = 0;
+	int batch = job->batch;
+
+	sprintf(max, "%d", batch);
+	tclistpush2(args, job->start);
+	tclistpush2(args, max);
+	tclistpush2(args, job->end);
+
+	while (1) {
+		unsigned long long start = batch_start();
+		TCLIST *recs = shard_misc(job->h, shard, "range", args);
+		int num_recs = tclistnum(recs) / 2;
+		const char *last;
+		int i, siz;
+
+		if (!num_recs) {
+			tclistdel(recs);
+			break;
+		}
+		for (i = 0; i < tclistnum(recs); i++) {
+			tclistval(recs, i, &siz);
+			bytes += siz;
+		}
+		records += num_recs;
+
+		batch = batch_end(batch, num_recs, start);
+		sprintf(max, "%d", batch);
+		tclistover2(args, 1, max);
+		/* overwrite start_key by the last one + '\0' */
+		last = tclistval(recs, 2 * (num_recs - 1), &siz);
+		tclistover(args, 0, last, siz + 1);
+		tclistdel(recs);
+	}
+	tclistdel(args);
+
+	shard_counter_add(job->h->counter, shard, records);
+	__sync_fetch_and_add(&job->records, records);
+	__sync_fetch_and_add(&job->bytes, bytes);
+}
+
+/* Every shard holds part of the key range, they are scanned in parallel */
+static void scan_test(void *db, const char *start, const char *end, int batch,
+		unsigned long long *records, unsigned long long *bytes)
+{
+	struct scan_job job = {
+		.h = db,
+		.start = start,
+		.end = end,
+		.batch = batch,
+		.records = 0,
+		.bytes = 0,
+	};
+
+	shard_fanout_run(job.h->fanout, scan_shard, &job);
+
+	*records = job.records;
+	*bytes = job.bytes;
 }
 
 static void outlist_test(void *db, const char *command, int num, int batch,
 			unsigned int seed)
 {
-	TCRDB *rdb = db;
+	struct tt_handle *h = db;
 	struct keygen keygen;
-	TCLIST *list = tclistnew();
+	struct shard_batch *b;
+	unsigned long long start;
 	int i;
 
+	/* outlist_atomic needs the misc command to hold the server's lock */
+	if (pipeline > 1 && !strcmp(command, "outlist")) {
+		raw_outlist_test(db, num, seed);
+		return;
+	}
+
+	b = shard_batch_new(h, command, false);
 	keygen_init(&keygen, seed);
+	start = batch_start();
 
 	for (i = 0; i < num; i++) {
-		tclistpush2(list, keygen_next_key(&keygen));
-
-		if (tclistnum(list) >= batch) {
-			tclistdel(do_tcrdbmisc(rdb, command, list));
-			tclistclear(list);
+		shard_batch_push(b, keygen_next_key(&keygen), NULL, 0);
+
+		if (b->nrecs >= batch) {
+			shard_batch_send(b);
+			lag_account(h, b->nrecs);
+			batch = batch_end(batch, b->nrecs, start);
+			shard_batch_clear(b);
+			start = batch_start();
 		}
 	}
-	if (tclistnum(list))
-		tclistdel(do_tcrdbmisc(rdb, command, list));
+	if (b->nrecs) {
+		shard_batch_send(b);
+		lag_account(h, b->nrecs);
+	}
 
-	tclistdel(list);
+	shard_batch_del(b);
+}
+
+static void report(struct benchmark_config *config)
+{
+	shard_ring_report(ring);
+	if (slave_host)
+		lag_report();
+}
+
+static int parse_option(struct benchmark_config *config, int argc,
+			char **argv, int i)
+{
+	if (!strcmp(argv[i], "-raw")) {
+		raw = true;
+		return 1;
+	} else if (!strcmp(argv[i], "-slave")) {
+		const char *colon = strrchr(argv[i + 1], ':');
+
+		if (!colon)
+			die("Invalid slave: %s", argv[i + 1]);
+		slave_host = strndup(argv[i + 1], colon - argv[i + 1]);
+		slave_port = atoi(colon + 1);
+		return 2;
+	} else if (!strcmp(argv[i], "-pipeline")) {
+		pipeline = atoi(argv[i + 1]);
+		if (pipeline < 1)
+			die("Invalid pipeline depth: %s", argv[i + 1]);
+		raw = true;
+		return 2;
+	}
+
+	return 0;
 }
 
 static struct benchmark_config config = {
@@ -396,14 +1258,52 @@ static struct benchmark_config config = {
 		.range_test = range_test,
 		.rangeout_test = rangeout_test,
 		.outlist_test = outlist_test,
+		.scan_test = scan_test,
+		.parse_option = parse_option,
+		.report = report,
 	},
 };
 
+static void setup(struct benchmark_config *config)
+{
+	debug = config->debug;
+	if (ring)
+		shard_ring_destroy(ring);
+	ring = shard_ring_create(config->hosts, config->host, config->port,
+				config->shard_hash);
+
+	if (raw) {
+		config->ops.put_test = raw_put_test;
+		config->ops.get_test = raw_get_test;
+	}
+}
+
+#ifdef BENCHMARK_PLUGIN
+
+static void init_config(struct benchmark_config *plugin_config)
+{
+	/* The same plugin may be loaded for several -backend runs */
+	raw = false;
+	pipeline = 1;
+	slave_host = NULL;
+	*plugin_config = config;
+}
+
+struct benchmark_plugin benchmark_plugin = {
+	.name = "tokyotyrant",
+	.init = init_config,
+	.setup = setup,
+};
+
+#else
+
 int main(int argc, char **argv)
 {
 	parse_options(&config, argc, argv);
-	debug = config.debug;
+	setup(&config);
 	benchmark(&config);
 
 	return 0;
 }
+
+#endif
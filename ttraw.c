@@ -0,0 +1,468 @@
+#include <tcutil.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "testutil.h"
+#include "ttraw.h"
+
+#define TT_MAGIC 0xc8
+#define TT_CMD_PUT 0x10
+#define TT_CMD_OUT 0x20
+#define TT_CMD_GET 0x30
+#define TT_CMD_MGET 0x31
+#define TT_CMD_FWMKEYS 0x58
+#define TT_CMD_MISC 0x90
+
+/* Send buffers are written out once they grow past this */
+#define TT_SEND_FLUSH (64 * 1024)
+#define TT_RECV_SIZE (64 * 1024)
+
+/* A queued request whose reply has not been read yet */
+struct tt_pending {
+	int cmd;
+	int vsiz;
+};
+
+struct tt_conn {
+	int fd;
+	char *host;
+	int port;
+
+	char *sbuf;
+	int ssiz;
+	int scap;
+
+	char *rbuf;
+	int rpos;
+	int rlen;
+	int rcap;
+
+	int pipeline;
+	struct tt_pending *pending;
+	int head;
+	int nr_pending;
+
+	unsigned long long errors;
+};
+
+struct tt_conn *tt_conn_open(const char *host, int port, int pipeline)
+{
+	struct tt_conn *conn = xmalloc(sizeof(*conn));
+	struct addrinfo hints, *res, *ai;
+	char service[16];
+	int one = 1;
+	int err;
+
+	memset(conn, 0, sizeof(*conn));
+	conn->host = strdup(host);
+	conn->port = port;
+	conn->pipeline = pipeline < 1 ? 1 : pipeline;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	sprintf(service, "%d", port);
+
+	err = getaddrinfo(host, service, &hints, &res);
+	if (err)
+		die("getaddrinfo: %s:%d: %s", host, port, gai_strerror(err));
+
+	conn->fd = -1;
+	for (ai = res; ai; ai = ai->ai_next) {
+		conn->fd = socket(ai->ai_family, ai->ai_socktype,
+				ai->ai_protocol);
+		if (conn->fd < 0)
+			continue;
+		if (!connect(conn->fd, ai->ai_addr, ai->ai_addrlen))
+			break;
+		close(conn->fd);
+		conn->fd = -1;
+	}
+	freeaddrinfo(res);
+	if (conn->fd < 0)
+		die("connect error: %s:%d: %s", host, port, strerror(errno));
+
+	/* Requests are combined in the send buffer already */
+	setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	conn->scap = TT_SEND_FLUSH;
+	conn->sbuf = xmalloc(conn->scap);
+	conn->rcap = TT_RECV_SIZE;
+	conn->rbuf = xmalloc(conn->rcap);
+	conn->pending = xmalloc(sizeof(*conn->pending) * conn->pipeline);
+
+	return conn;
+}
+
+/*
+ * Append what the socket has to the receive buffer, which grows when it
+ * is full of unread replies
+ */
+static void recv_fill(struct tt_conn *conn)
+{
+	ssize_t n;
+
+	if (conn->rpos == conn->rlen) {
+		conn->rpos = 0;
+		conn->rlen = 0;
+	} else if (conn->rlen == conn->rcap && conn->rpos) {
+		memmove(conn->rbuf, conn->rbuf + conn->rpos,
+			conn->rlen - conn->rpos);
+		conn->rlen -= conn->rpos;
+		conn->rpos = 0;
+	} else if (conn->rlen == conn->rcap) {
+		conn->rcap *= 2;
+		conn->rbuf = realloc(conn->rbuf, conn->rcap);
+		if (!conn->rbuf)
+			die("realloc: out of memory");
+	}
+
+	do {
+		n = read(conn->fd, conn->rbuf + conn->rlen,
+			conn->rcap - conn->rlen);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0)
+		die("recv error: %s:%d: %s", conn->host, conn->port,
+			strerror(errno));
+	if (!n)
+		die("connection closed: %s:%d", conn->host, conn->port);
+
+	conn->rlen += n;
+}
+
+/*
+ * The server stops reading requests while its replies are not read, so
+ * while requests are pending the replies that arrive are buffered as
+ * the send buffer goes out, without blocking on either side.
+ */
+static void send_flush(struct tt_conn *conn)
+{
+	int off = 0;
+
+	while (off < conn->ssiz) {
+		struct pollfd pfd = { conn->fd, POLLOUT, 0 };
+		ssize_t n;
+
+		if (conn->nr_pending)
+			pfd.events |= POLLIN;
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			die("poll error: %s:%d: %s", conn->host, conn->port,
+				strerror(errno));
+		}
+		if (pfd.revents & (POLLIN | POLLHUP | POLLERR))
+			recv_fill(conn);
+		if (!(pfd.revents & POLLOUT))
+			continue;
+
+		n = send(conn->fd, conn->sbuf + off, conn->ssiz - off,
+			MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0 && (errno == EINTR || errno == EAGAIN ||
+			      errno == EWOULDBLOCK))
+			continue;
+		if (n <= 0)
+			die("send error: %s:%d: %s", conn->host, conn->port,
+				strerror(errno));
+		off += n;
+	}
+	conn->ssiz = 0;
+}
+
+static void send_bytes(struct tt_conn *conn, const void *buf, int size)
+{
+	if (conn->ssiz + size > conn->scap) {
+		while (conn->ssiz + size > conn->scap)
+			conn->scap *= 2;
+		conn->sbuf = realloc(conn->sbuf, conn->scap);
+		if (!conn->sbuf)
+			die("realloc: out of memory");
+	}
+	memcpy(conn->sbuf + conn->ssiz, buf, size);
+	conn->ssiz += size;
+}
+
+static void send_u32(struct tt_conn *conn, uint32_t num)
+{
+	unsigned char buf[4];
+
+	buf[0] = num >> 24;
+	buf[1] = num >> 16;
+	buf[2] = num >> 8;
+	buf[3] = num;
+	send_bytes(conn, buf, 4);
+}
+
+static void send_header(struct tt_conn *conn, int cmd)
+{
+	unsigned char buf[2] = { TT_MAGIC, cmd };
+
+	send_bytes(conn, buf, 2);
+}
+
+/* buf may be NULL to skip size bytes */
+static void recv_bytes(struct tt_conn *conn, void *buf, int size)
+{
+	while (size > 0) {
+		int n;
+
+		if (conn->rpos == conn->rlen)
+			recv_fill(conn);
+
+		n = conn->rlen - conn->rpos;
+		if (n > size)
+			n = size;
+		if (buf) {
+			memcpy(buf, conn->rbuf + conn->rpos, n);
+			buf = (char *)buf + n;
+		}
+		conn->rpos += n;
+		size -= n;
+	}
+}
+
+static int recv_u8(struct tt_conn *conn)
+{
+	unsigned char c;
+
+	recv_bytes(conn, &c, 1);
+
+	return c;
+}
+
+static uint32_t recv_u32(struct tt_conn *conn)
+{
+	unsigned char buf[4];
+
+	recv_bytes(conn, buf, 4);
+
+	return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) |
+		((uint32_t)buf[2] << 8) | buf[3];
+}
+
+/* Push the next size bytes to list, straight from the buffer if there */
+static void recv_push(struct tt_conn *conn, TCLIST *list, int size)
+{
+	char *buf;
+
+	if (conn->rlen - conn->rpos >= size) {
+		tclistpush(list, conn->rbuf + conn->rpos, size);
+		conn->rpos += size;
+		return;
+	}
+
+	buf = xmalloc(size);
+	recv_bytes(conn, buf, size);
+	tclistpush(list, buf, size);
+	free(buf);
+}
+
+static void recv_reply(struct tt_conn *conn, struct tt_pending *p)
+{
+	int code = recv_u8(conn);
+	int vsiz;
+
+	switch (p->cmd) {
+	case TT_CMD_PUT:
+		if (code)
+			die("put error: %s:%d", conn->host, conn->port);
+		break;
+	case TT_CMD_OUT:
+		if (code)
+			conn->errors++;
+		break;
+	case TT_CMD_GET:
+		if (code) {
+			conn->errors++;
+			break;
+		}
+		vsiz = recv_u32(conn);
+		recv_bytes(conn, NULL, vsiz);
+		if (p->vsiz >= 0 && vsiz != p->vsiz)
+			conn->errors++;
+		break;
+	default:
+		die("unexpected pending command: %x", p->cmd);
+	}
+}
+
+/* Read the reply of the oldest queued request */
+static void recv_head(struct tt_conn *conn)
+{
+	send_flush(conn);
+	recv_reply(conn, &conn->pending[conn->head]);
+	conn->head = (conn->head + 1) % conn->pipeline;
+	conn->nr_pending--;
+}
+
+/* Read the replies of every queued request */
+static void drain(struct tt_conn *conn)
+{
+	send_flush(conn);
+
+	while (conn->nr_pending)
+		recv_head(conn);
+}
+
+static void queue(struct tt_conn *conn, int cmd, int vsiz)
+{
+	struct tt_pending *p;
+
+	p = &conn->pending[(conn->head + conn->nr_pending) % conn->pipeline];
+	p->cmd = cmd;
+	p->vsiz = vsiz;
+	conn->nr_pending++;
+
+	/* Make room for one more, keeping the rest of the pipeline busy */
+	if (conn->nr_pending == conn->pipeline)
+		recv_head(conn);
+	else if (conn->ssiz >= TT_SEND_FLUSH)
+		send_flush(conn);
+}
+
+void tt_conn_put(struct tt_conn *conn, const void *kbuf, int ksiz,
+		const void *vbuf, int vsiz)
+{
+	send_header(conn, TT_CMD_PUT);
+	send_u32(conn, ksiz);
+	send_u32(conn, vsiz);
+	send_bytes(conn, kbuf, ksiz);
+	send_bytes(conn, vbuf, vsiz);
+	queue(conn, TT_CMD_PUT, -1);
+}
+
+void tt_conn_out(struct tt_conn *conn, const void *kbuf, int ksiz)
+{
+	send_header(conn, TT_CMD_OUT);
+	send_u32(conn, ksiz);
+	send_bytes(conn, kbuf, ksiz);
+	queue(conn, TT_CMD_OUT, -1);
+}
+
+void tt_conn_get(struct tt_conn *conn, const void *kbuf, int ksiz, int vsiz)
+{
+	send_header(conn, TT_CMD_GET);
+	send_u32(conn, ksiz);
+	send_bytes(conn, kbuf, ksiz);
+	queue(conn, TT_CMD_GET, vsiz);
+}
+
+void tt_conn_sync(struct tt_conn *conn)
+{
+	drain(conn);
+}
+
+unsigned long long tt_conn_errors(struct tt_conn *conn)
+{
+	return conn->errors;
+}
+
+TCLIST *tt_conn_mget(struct tt_conn *conn, const TCLIST *keys)
+{
+	TCLIST *recs;
+	int i, rnum;
+
+	send_header(conn, TT_CMD_MGET);
+	send_u32(conn, tclistnum(keys));
+	for (i = 0; i < tclistnum(keys); i++) {
+		int ksiz;
+		const char *key = tclistval(keys, i, &ksiz);
+
+		send_u32(conn, ksiz);
+		send_bytes(conn, key, ksiz);
+	}
+	drain(conn);
+
+	if (recv_u8(conn))
+		return NULL;
+
+	rnum = recv_u32(conn);
+	recs = tclistnew2(rnum * 2);
+	for (i = 0; i < rnum; i++) {
+		int ksiz = recv_u32(conn);
+		int vsiz = recv_u32(conn);
+
+		recv_push(conn, recs, ksiz);
+		recv_push(conn, recs, vsiz);
+	}
+
+	return recs;
+}
+
+TCLIST *tt_conn_fwmkeys(struct tt_conn *conn, const void *pbuf, int psiz,
+			int max)
+{
+	TCLIST *keys;
+	int i, knum;
+
+	send_header(conn, TT_CMD_FWMKEYS);
+	send_u32(conn, psiz);
+	send_u32(conn, max);
+	send_bytes(conn, pbuf, psiz);
+	drain(conn);
+
+	if (recv_u8(conn))
+		return NULL;
+
+	knum = recv_u32(conn);
+	keys = tclistnew2(knum);
+	for (i = 0; i < knum; i++)
+		recv_push(conn, keys, recv_u32(conn));
+
+	return keys;
+}
+
+TCLIST *tt_conn_misc(struct tt_conn *conn, const char *name,
+			const TCLIST *args)
+{
+	TCLIST *res;
+	int nsiz = strlen(name);
+	int i, code, rnum;
+
+	send_header(conn, TT_CMD_MISC);
+	send_u32(conn, nsiz);
+	send_u32(conn, 0);
+	send_u32(conn, tclistnum(args));
+	send_bytes(conn, name, nsiz);
+	for (i = 0; i < tclistnum(args); i++) {
+		int asiz;
+		const char *arg = tclistval(args, i, &asiz);
+
+		send_u32(conn, asiz);
+		send_bytes(conn, arg, asiz);
+	}
+	drain(conn);
+
+	code = recv_u8(conn);
+	rnum = recv_u32(conn);
+	res = tclistnew2(rnum);
+	for (i = 0; i < rnum; i++)
+		recv_push(conn, res, recv_u32(conn));
+
+	if (code) {
+		tclistdel(res);
+		return NULL;
+	}
+
+	return res;
+}
+
+void tt_conn_close(struct tt_conn *conn)
+{
+	drain(conn);
+	close(conn->fd);
+	free(conn->pending);
+	free(conn->rbuf);
+	free(conn->sbuf);
+	free(conn->host);
+	free(conn);
+}
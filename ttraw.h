@@ -0,0 +1,33 @@
+/*
+ * Minimal Tokyo Tyrant binary protocol client
+ *
+ * Requests are appended to a per-connection send buffer, which goes out
+ * when it is large, when "pipeline" requests are waiting for their
+ * replies, or when a reply is needed right away.  Replies arriving while
+ * it goes out are buffered, so that neither side blocks on a full socket.
+ *
+ * put, out and get only queue their request.  Their replies are read
+ * back in order, the oldest one when the pipeline is full and all of
+ * them at tt_conn_sync(); a
+ * failed put is fatal, missing records and gets returning a value of
+ * an unexpected size (vsiz >= 0) are counted in tt_conn_errors().
+ * mget, fwmkeys and misc read every queued reply and then wait for
+ * their own, which is returned as a list as libtokyotyrant does, or
+ * NULL on failure.
+ */
+
+struct tt_conn;
+
+struct tt_conn *tt_conn_open(const char *host, int port, int pipeline);
+void tt_conn_close(struct tt_conn *conn);
+void tt_conn_put(struct tt_conn *conn, const void *kbuf, int ksiz,
+		const void *vbuf, int vsiz);
+void tt_conn_out(struct tt_conn *conn, const void *kbuf, int ksiz);
+void tt_conn_get(struct tt_conn *conn, const void *kbuf, int ksiz, int vsiz);
+void tt_conn_sync(struct tt_conn *conn);
+unsigned long long tt_conn_errors(struct tt_conn *conn);
+TCLIST *tt_conn_mget(struct tt_conn *conn, const TCLIST *keys);
+TCLIST *tt_conn_fwmkeys(struct tt_conn *conn, const void *pbuf, int psiz,
+			int max);
+TCLIST *tt_conn_misc(struct tt_conn *conn, const char *name,
+			const TCLIST *args);